@@ -0,0 +1,51 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+
+#ifndef eopcua_client_async__h
+#define eopcua_client_async__h
+
+#include <open62541/types.h>
+
+// The answer of the server to an asynchronous request. Items are identified
+// by the NodeId pointers owned by the browse cache
+typedef struct {
+  UA_UInt32 id;
+  size_t size;
+  UA_NodeId **nodeId;
+  // Read results
+  UA_DataValue *values;
+  // Write results, NULL for the written item
+  char **results;
+  // The whole request failed
+  char *error;
+} opcua_completion;
+
+// Completions not yet delivered to the owner, the mailbox takes the data.
+// Every connection has its own mailbox
+typedef struct opcua_completions opcua_completions;
+
+opcua_completions *new_completions(void);
+void delete_completions(opcua_completions *completions);
+
+char *add_completion(opcua_completions *completions, opcua_completion *completion);
+opcua_completion *get_completions(opcua_completions *completions, size_t *size);
+void free_completions(opcua_completion *completions, size_t size);
+void purge_completions(opcua_completions *completions);
+bool has_completions(opcua_completions *completions);
+
+#endif
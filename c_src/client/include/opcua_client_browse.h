@@ -23,8 +23,19 @@
 #include <open62541/client_highlevel.h>
 #include "opcua_client_browse_cache.h"
 
-char *build_browse_cache(UA_Client *client,size_t maxNodesPerBrowse);
-char *path2nodeId( char *path, UA_NodeId *nodeId );
+// The handler releases everything bound to the removed node,
+// the context is passed by the caller
+typedef void (*remove_cache_handler)(void *context, UA_NodeId *nodeId);
+// The handler waits for the responses in place of the crawler, the update
+// loop serves its jobs meanwhile. The error stops the crawl
+typedef char *(*crawl_wait_handler)(void *context);
+
+// The MaxNodesPerBrowse operation limit of the server, 0 for no limit
+size_t read_browse_limits(UA_Client *client);
+char *build_browse_cache(UA_Client *client, opcua_cache *cache, size_t maxNodesPerBrowse, size_t maxRequests, size_t maxReferencesPerNode);
+char *refresh_browse_cache(UA_Client *client, opcua_cache *cache, UA_NodeId *folder, size_t maxNodesPerBrowse, size_t maxRequests, size_t maxReferencesPerNode, remove_cache_handler remove, crawl_wait_handler wait, void *context);
+void drop_browse_cache(opcua_cache *cache, UA_NodeId *folder, remove_cache_handler remove, void *context);
+char *path2nodeId( opcua_cache *cache, char *path, UA_NodeId *nodeId );
 
 
 #endif
\ No newline at end of file
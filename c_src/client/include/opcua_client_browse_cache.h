@@ -19,20 +19,62 @@
 #ifndef eopcua_client_browse_cache__h
 #define eopcua_client_browse_cache__h
 
+#include <stdint.h>
 #include <open62541/types.h>
 
+// The cache owns the NodeIds, a pointer returned by the cache identifies
+// the item until the cache is purged or the item is removed and reclaimed
+#define CACHE_NO_PARENT SIZE_MAX
+
 typedef struct {
-  char *path;
   UA_NodeId *nodeId;
+  // The index of the parent item, CACHE_NO_PARENT for top level items
+  size_t parent;
+  char *name;
   int nodeClass;
 } opcua_item;
 
-char *add_cache(char *path, UA_NodeId *nodeId, int nodeClass);
+// Every connection has its own cache
+typedef struct opcua_cache opcua_cache;
+
+opcua_cache *new_cache(void);
+void delete_cache(opcua_cache *cache);
+
+char *add_cache(opcua_cache *cache, UA_NodeId *parent, char *name, const UA_NodeId *nodeId, int nodeClass, UA_NodeId **cached);
+void remove_cache(opcua_cache *cache, UA_NodeId *nodeId);
+// Changes when entries are added, removed or purged
+uint64_t get_cache_generation(opcua_cache *cache);
+
+UA_NodeId *lookup_path2nodeId_cache(opcua_cache *cache, char *path);
+UA_NodeId *lookup_child_cache(opcua_cache *cache, UA_NodeId *parent, char *name);
+int lookup_nodeClass_cache(opcua_cache *cache, UA_NodeId *nodeId);
+// The path is valid until the next lookup by the same thread
+char *lookup_nodeId2path_cache(opcua_cache *cache, UA_NodeId *nodeId);
+UA_NodeId *find_nodeId_cache(opcua_cache *cache, const UA_NodeId *nodeId);
+bool in_subtree_cache(opcua_cache *cache, UA_NodeId *folder, UA_NodeId *nodeId);
+
+char *update_value_cache(opcua_cache *cache, UA_NodeId *nodeId, const UA_DataValue *value, bool monitored);
+void release_value_cache(opcua_cache *cache, UA_NodeId *nodeId);
+void touch_value_cache(opcua_cache *cache);
+bool lookup_value_cache(opcua_cache *cache, UA_NodeId *nodeId, UA_DateTime maxAge, UA_DataValue *value);
+
+// The caller frees the array, NodeIds are owned by the cache
+char *search_prefix_cache(opcua_cache *cache, char *prefix, UA_NodeId ***nodeIds, size_t *size);
+char *search_substring_cache(opcua_cache *cache, char *search, UA_NodeId ***nodeIds, size_t *size);
+char *search_regex_cache(opcua_cache *cache, char *regex, UA_NodeId ***nodeIds, size_t *size);
+char *search_glob_cache(opcua_cache *cache, char *glob, UA_NodeId ***nodeIds, size_t *size);
 
-UA_NodeId *lookup_path2nodeId_cache(char *path);
-char *lookup_nodeId2path_cache(UA_NodeId *nodeId);
+size_t get_cache_size(opcua_cache *cache);
+bool get_cache_item(opcua_cache *cache, size_t index, opcua_item *item);
+void purge_cache(opcua_cache *cache);
 
-opcua_item * get_all_cache_items(size_t *size);
-void purge_cache(void);
+// Reclaims the removed items once there are enough of them, their NodeIds
+// become invalid. The owner calls it when nothing else refers to removed items.
+// Returns false if there was nothing to do or the caches are pinned
+bool compact_cache(opcua_cache *cache);
+// A pinned cache is not compacted, the eport thread pins the caches
+// of all the connections for the time of a request
+void pin_caches(void);
+void unpin_caches(void);
 
 #endif
\ No newline at end of file
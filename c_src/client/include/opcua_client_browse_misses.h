@@ -0,0 +1,39 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+
+#ifndef eopcua_client_browse_misses__h
+#define eopcua_client_browse_misses__h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Paths the server does not know. They are answered with "invalid node"
+// without asking the server again until the entry expires
+typedef struct opcua_browse_misses opcua_browse_misses;
+
+opcua_browse_misses *new_browse_misses(void);
+void delete_browse_misses(opcua_browse_misses *misses);
+
+// The oldest entries are dropped when the cache is full, 0 means the default
+char *configure_browse_misses(opcua_browse_misses *misses, size_t maxSize, int ttl);
+
+char *add_browse_miss(opcua_browse_misses *misses, char *path);
+bool lookup_browse_miss(opcua_browse_misses *misses, char *path);
+void purge_browse_misses(opcua_browse_misses *misses);
+
+#endif
@@ -19,9 +19,14 @@
 #ifndef eopcua_client_browse_queue__h
 #define eopcua_client_browse_queue__h
 
+// Every connection has its own queue
+typedef struct opcua_browse_queue opcua_browse_queue;
 
-char *add_browse_queue(char *path);
-char **get_browse_queue(size_t *size);
-void purge_browse_queue(void);
+opcua_browse_queue *new_browse_queue(void);
+void delete_browse_queue(opcua_browse_queue *queue);
+
+char *add_browse_queue(opcua_browse_queue *queue, char *path);
+char **get_browse_queue(opcua_browse_queue *queue, size_t *size);
+void purge_browse_queue(opcua_browse_queue *queue);
 
 #endif
\ No newline at end of file
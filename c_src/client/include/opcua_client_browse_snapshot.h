@@ -0,0 +1,37 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+
+#ifndef eopcua_client_browse_snapshot__h
+#define eopcua_client_browse_snapshot__h
+
+#include "opcua_client_browse_cache.h"
+
+// The server the snapshot is taken from. The snapshot of another start of the
+// server or of other namespaces is not loaded, its NodeIds may be wrong
+typedef struct {
+  UA_DateTime startTime;
+  size_t namespacesSize;
+  UA_String *namespaces;
+} server_identity;
+
+void clear_server_identity(server_identity *identity);
+
+char *save_browse_snapshot(opcua_cache *cache, char *dir, char *url, const server_identity *identity);
+char *load_browse_snapshot(opcua_cache *cache, char *dir, char *url, const server_identity *identity);
+
+#endif
@@ -0,0 +1,47 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+
+#ifndef eopcua_client_job_queue__h
+#define eopcua_client_job_queue__h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Jobs are embedded into the structures of their arguments
+typedef struct client_job client_job;
+typedef void (*client_job_handler)(client_job *job);
+
+struct client_job{
+  client_job *_Atomic next;
+  client_job_handler handler;
+  // The caller waits for the job to be done, otherwise the handler releases it
+  bool wait;
+  atomic_bool done;
+  char *error;
+};
+
+// Every connection has its own queue
+typedef struct client_job_queue client_job_queue;
+
+client_job_queue *new_job_queue(void);
+void delete_job_queue(client_job_queue *queue);
+
+void push_job(client_job_queue *queue, client_job *job);
+client_job *pop_job(client_job_queue *queue);
+
+#endif
@@ -21,14 +21,51 @@
 
 #include <eport_c.h>
 
-char *start(char *url, char *certificate, char *privateKey, char *login, char *pass, int cycle, size_t maxNodesPerBrowse);
-void stop(void);
-bool is_started(void);
+#include "opcua_client_browse_cache.h"
+#include "opcua_client_browse_misses.h"
+#include "opcua_client_subscription.h"
+#include "opcua_client_async.h"
+
+// A session to a server with its own update loop and browse cache.
+// The object outlives the session, it is started again on reconnect
+typedef struct opcua_connection opcua_connection;
+
+opcua_connection *new_connection(void);
+// Stops the session and waits for its update loop to exit
+void delete_connection(opcua_connection *connection);
+
+char *start(opcua_connection *connection, char *url, char *certificate, char *privateKey, char *login, char *pass, int cycle, size_t maxNodesPerBrowse, size_t maxBrowseRequests, size_t maxReferencesPerNode, int publishingInterval, char *cacheDir);
+void stop(opcua_connection *connection);
+bool is_started(opcua_connection *connection);
+
+// The state of the session shared with the eport thread
+opcua_cache *connection_cache(opcua_connection *connection);
+opcua_browse_misses *connection_misses(opcua_connection *connection);
+opcua_subscriptions *connection_subscriptions(opcua_connection *connection);
+opcua_completions *connection_completions(opcua_connection *connection);
+
+char *queue_browse_path(opcua_connection *connection, char *path);
+// The paths are translated by the server right away, the caller waits
+char *resolve_paths(opcua_connection *connection, size_t size, char **paths);
 
 char* browse_servers(char *host, int port, char ***urls);
 
-char *read_values(size_t size, UA_NodeId **nodeId, UA_DataValue** values);
-char *write_values(size_t size, UA_NodeId **nodeId, UA_Variant **values, char ***results);
+char *read_values(opcua_connection *connection, size_t size, UA_NodeId **nodeId, UA_DataValue** values);
+char *write_values(opcua_connection *connection, size_t size, UA_NodeId **nodeId, UA_Variant **values, char ***results);
+
+// The results come to the completions mailbox tagged by the id
+char *read_values_async(opcua_connection *connection, UA_UInt32 id, size_t size, UA_NodeId **nodeId);
+char *write_values_async(opcua_connection *connection, UA_UInt32 id, size_t size, UA_NodeId **nodeId, UA_Variant **values);
+
+// The read request is prebuilt for the nodes, the nodes are registered on the server.
+// The values are as many as the nodes, the caller frees them
+typedef struct opcua_read_set opcua_read_set;
+char *create_read_set(size_t size, UA_NodeId **nodeId, opcua_read_set **set);
+void delete_read_set(opcua_connection *connection, opcua_read_set *set);
+char *read_set_values(opcua_connection *connection, opcua_read_set *set, UA_DataValue **values);
+
+char *subscribe_values(opcua_connection *connection, size_t size, UA_NodeId **nodeId, char ***results);
+char *unsubscribe_values(opcua_connection *connection, size_t size, UA_NodeId **nodeId, char ***results);
 
 
 #endif
\ No newline at end of file
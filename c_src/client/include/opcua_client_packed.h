@@ -0,0 +1,59 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+
+#ifndef eopcua_client_packed__h
+#define eopcua_client_packed__h
+
+#include <open62541/types.h>
+#include <cjson/cJSON.h>
+
+// Packed items are the compact alternative to the JSON results. The buffer
+// goes to the owner as one base64 string, every item is:
+//      path length:16 | path | tag:8 | value
+// For the supported scalar types the tag is the index of the type in UA_TYPES
+// plus 1, numbers are big endian, strings are prefixed by their length:32.
+// The tag 0 is followed by the status string prefixed by its length:16,
+// it is the error of the item or "ok" for the written one
+typedef struct{
+  UA_Byte *data;
+  size_t length;
+  size_t size;
+  // The first error, the items are not packed after it
+  char *error;
+} packed_buffer;
+
+void init_packed(packed_buffer *buffer);
+void clear_packed(packed_buffer *buffer);
+
+void pack_status(packed_buffer *buffer, const char *path, const char *status);
+void pack_value(packed_buffer *buffer, const char *path, const UA_DataValue *value);
+
+// The columnar results of the item set:
+//      count:32 | status:32[count] | tag:8[count] | values
+// Only the good values of the supported types are packed, in the order of
+// the items and without the tag. The others have the tag 0
+void pack_columns(packed_buffer *buffer, size_t size, const UA_DataValue *values);
+
+// The buffer is cleared
+cJSON *packed2json(packed_buffer *buffer, char **error);
+
+// Takes the next item of the buffer, the path is to be freed by the caller.
+// The status items are not accepted
+char *unpack_item(UA_ByteString *data, size_t *offset, char **path, UA_Variant **value);
+
+#endif
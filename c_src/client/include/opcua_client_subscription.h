@@ -0,0 +1,51 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+
+#ifndef eopcua_client_subscription__h
+#define eopcua_client_subscription__h
+
+#include <open62541/types.h>
+
+// Items are identified by the NodeId pointers owned by the browse cache
+typedef struct {
+  UA_NodeId *nodeId;
+  UA_DataValue value;
+} opcua_notification;
+
+// Every connection has its own registry and mailbox
+typedef struct opcua_subscriptions opcua_subscriptions;
+
+opcua_subscriptions *new_subscriptions(void);
+void delete_subscriptions(opcua_subscriptions *subscriptions);
+
+// Monitored items registry
+char *add_subscription(opcua_subscriptions *subscriptions, UA_NodeId *nodeId, UA_UInt32 monitoredItemId);
+bool lookup_subscription(opcua_subscriptions *subscriptions, UA_NodeId *nodeId, UA_UInt32 *monitoredItemId);
+void remove_subscription(opcua_subscriptions *subscriptions, UA_NodeId *nodeId);
+// The subscribed items to create them again when the subscription is lost
+UA_NodeId **get_subscriptions(opcua_subscriptions *subscriptions, size_t *size);
+void purge_subscriptions(opcua_subscriptions *subscriptions);
+
+// Data change notifications not yet delivered to the owner
+char *add_notification(opcua_subscriptions *subscriptions, UA_NodeId *nodeId, const UA_DataValue *value);
+opcua_notification *get_notifications(opcua_subscriptions *subscriptions, size_t *size);
+void remove_notification(opcua_subscriptions *subscriptions, UA_NodeId *nodeId);
+void free_notifications(opcua_notification *notifications, size_t size);
+void purge_notifications(opcua_subscriptions *subscriptions);
+
+#endif
@@ -19,15 +19,80 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 //----------------------------------------
 #include <eport_c.h>
+#include <uthash.h>
 //----------------------------------------
 #include <openssl/x509v3.h>
 //----------------------------------------
 #include "utilities.h"
 #include "opcua_client_browse.h"
 #include "opcua_client_loop.h"
-#include "opcua_client_browse_queue.h"
+#include "opcua_client_subscription.h"
+#include "opcua_client_async.h"
+#include "opcua_client_packed.h"
+
+//-----------------------------------------------------
+//  Sessions
+//-----------------------------------------------------
+// The port hosts independent sessions addressed by the handle chosen by the
+// owner. Every session has its own update loop, browse cache and subscriptions.
+// Requests without the handle go to the session 0
+typedef struct async_request async_request;
+typedef struct item_set item_set;
+
+typedef struct {
+  int handle;
+  opcua_connection *connection;
+  // Unknown paths are translated before the request, see below
+  bool resolvePaths;
+  // Asynchronous requests, see below
+  async_request *asyncRequests;
+  int asyncId;
+  // Registered item sets, see below
+  item_set *itemSets;
+  int itemSetId;
+  UT_hash_handle hh;
+} client_session;
+
+static client_session *__sessions = NULL;
+
+static void purge_async_requests(client_session *session);
+static void purge_item_sets(client_session *session);
+
+static client_session *find_session(int handle){
+    client_session *session = NULL;
+    HASH_FIND_INT(__sessions, &handle, session);
+    return session;
+}
+
+static client_session *add_session(int handle, char **error){
+    client_session *session = calloc(1, sizeof(client_session));
+    if (!session){
+        *error = "out of memory";
+        return NULL;
+    }
+    session->handle = handle;
+    session->connection = new_connection();
+    if (!session->connection){
+        free( session );
+        *error = "unable to create the connection";
+        return NULL;
+    }
+    HASH_ADD_INT(__sessions, handle, session);
+    return session;
+}
+
+static void remove_session(client_session *session){
+    HASH_DEL(__sessions, session);
+    // The registered nodes are released while the session is alive
+    purge_item_sets( session );
+    // Waits for the update loop to exit
+    delete_connection( session->connection );
+    purge_async_requests( session );
+    free( session );
+}
 
 //-----------------------------------------------------
 //  eport_c API
@@ -99,10 +164,17 @@ on_clear:
 //         "login":"user1",
 //         "password":"secret",
 //         "update_cycle":200,
-//         "max_nodes_per_browse":1000
+//         "max_nodes_per_browse":1000,
+//         "max_browse_requests":4,
+//         "max_references_per_node":0,
+//         "publishing_interval":500,
+//         "cache_dir":"/var/lib/eopcua",
+//         "resolve_paths":true,
+//         "max_misses":10000,
+//         "miss_ttl":10000
 //     }
-static cJSON* opcua_client_connect(cJSON* args, char **error){
-    if ( is_started() ){
+static cJSON* opcua_client_connect(client_session *session, cJSON* args, char **error){
+    if ( is_started(session->connection) ){
         *error = "already connected";
         goto on_error;
     }
@@ -132,6 +204,48 @@ static cJSON* opcua_client_connect(cJSON* args, char **error){
         _max_nodes_per_browse = (size_t)max_nodes_per_browse->valueint; 
     }
 
+    size_t _max_browse_requests = 0;
+    cJSON *max_browse_requests = cJSON_GetObjectItemCaseSensitive(args, "max_browse_requests");
+    if (cJSON_IsNumber(max_browse_requests)){
+        _max_browse_requests = (size_t)max_browse_requests->valueint;
+    }
+
+    size_t _max_references_per_node = 0;
+    cJSON *max_references_per_node = cJSON_GetObjectItemCaseSensitive(args, "max_references_per_node");
+    if (cJSON_IsNumber(max_references_per_node)){
+        _max_references_per_node = (size_t)max_references_per_node->valueint;
+    }
+
+    int _publishing_interval = 0;
+    cJSON *publishing_interval = cJSON_GetObjectItemCaseSensitive(args, "publishing_interval");
+    if (cJSON_IsNumber(publishing_interval)){
+        _publishing_interval = publishing_interval->valueint;
+    }
+
+    char *_cache_dir = NULL;
+    cJSON *cache_dir = cJSON_GetObjectItemCaseSensitive(args, "cache_dir");
+    if (cJSON_IsString(cache_dir) && (cache_dir->valuestring != NULL)){
+        _cache_dir = cache_dir->valuestring;
+    }
+
+    bool _resolve_paths = false;
+    cJSON *resolve_paths = cJSON_GetObjectItemCaseSensitive(args, "resolve_paths");
+    if (cJSON_IsBool(resolve_paths)){
+        _resolve_paths = cJSON_IsTrue(resolve_paths);
+    }
+
+    size_t _max_misses = 0;
+    cJSON *max_misses = cJSON_GetObjectItemCaseSensitive(args, "max_misses");
+    if (cJSON_IsNumber(max_misses)){
+        _max_misses = (size_t)max_misses->valueint;
+    }
+
+    int _miss_ttl = 0;
+    cJSON *miss_ttl = cJSON_GetObjectItemCaseSensitive(args, "miss_ttl");
+    if (cJSON_IsNumber(miss_ttl)){
+        _miss_ttl = miss_ttl->valueint;
+    }
+
     char *_certificate = NULL;
     char *_privateKey = NULL;
     cJSON *certificate = cJSON_GetObjectItemCaseSensitive(args, "certificate");
@@ -162,24 +276,163 @@ static cJSON* opcua_client_connect(cJSON* args, char **error){
         _password = password->valuestring;
     }
 
+    // Requests of the previous connection are not answered anymore
+    purge_async_requests(session);
+
+    *error = configure_browse_misses( connection_misses(session->connection), _max_misses, _miss_ttl );
+    if (*error) goto on_error;
+
     //--------------Connecting procedure------------------------------
     *error = start(
+        session->connection,
         _url,
         _certificate,
         _privateKey,
         _login,
         _password,
         _update_cycle,
-        _max_nodes_per_browse
+        _max_nodes_per_browse,
+        _max_browse_requests,
+        _max_references_per_node,
+        _publishing_interval,
+        _cache_dir
     );
     if (*error) goto on_error;
 
+    session->resolvePaths = _resolve_paths;
+
     return cJSON_CreateString("ok");
 
 on_error:
     return NULL;
 }
 
+//-----------------------------------------------------
+//  Unknown paths
+//-----------------------------------------------------
+// A path not found in the cache is answered with "invalid node" and queued
+// for the update loop, the caller has to retry. With resolve_paths the
+// unknown paths of the request are translated by one request to the server
+// before the items are looked up. The paths the server does not know are kept
+// in the negative cache for a while not to ask the server about them again.
+// The queued paths the server does not know go there too
+static char *resolve_unknown_paths(client_session *session, size_t size, char **paths){
+    char *error = NULL;
+
+    if (!session->resolvePaths) return NULL;
+
+    size_t unknownSize = 0;
+    char **unknown = malloc( size * sizeof(char *) + 1 );
+    if (!unknown) return "out of memory";
+
+    for (size_t i = 0; i < size; i++){
+        if (!paths[i]) continue;
+        if (lookup_path2nodeId_cache( connection_cache(session->connection), paths[i] )) continue;
+        if (lookup_browse_miss( connection_misses(session->connection), paths[i] )) continue;
+        unknown[unknownSize++] = paths[i];
+    }
+
+    if (unknownSize) error = resolve_paths(session->connection, unknownSize, unknown);
+
+    free( unknown );
+    return error;
+}
+
+// The paths are either the values of the array or the keys of the object
+static char *resolve_unknown_items(client_session *session, cJSON *items, bool keys){
+    char *error = NULL;
+    cJSON *item = NULL;
+
+    if (!session->resolvePaths) return NULL;
+
+    size_t size = 0;
+    char **paths = malloc( cJSON_GetArraySize( items ) * sizeof(char *) + 1 );
+    if (!paths) return "out of memory";
+
+    cJSON_ArrayForEach(item, items) {
+        paths[size++] = keys ? item->string : item->valuestring;
+    }
+
+    error = resolve_unknown_paths(session, size, paths);
+
+    free( paths );
+    return error;
+}
+
+// The path is not in the cache
+static char *unknown_path(client_session *session, char *path){
+    // The server is already asked
+    if (session->resolvePaths) return NULL;
+    if (lookup_browse_miss( connection_misses(session->connection), path )) return NULL;
+
+    return queue_browse_path( session->connection, path );
+}
+
+//-----------------------------------------------------
+//  Item results
+//-----------------------------------------------------
+// Read and write results are collected either to the JSON object or to
+// the packed buffer sent as one base64 string, see opcua_client_packed.h.
+// The zeroed results are empty
+typedef struct{
+  bool packed;
+  cJSON *json;
+  packed_buffer buffer;
+} item_results;
+
+static cJSON* item_read_result(UA_DataValue value);
+
+static char *init_item_results(item_results *results, bool packed){
+    results->packed = packed;
+    results->json = NULL;
+    init_packed( &results->buffer );
+    if (packed) return NULL;
+
+    results->json = cJSON_CreateObject();
+    return results->json ? NULL : "unable to create response object";
+}
+
+static void clear_item_results(item_results *results){
+    cJSON_Delete( results->json );
+    results->json = NULL;
+    clear_packed( &results->buffer );
+}
+
+static void add_item_status(item_results *results, char *path, char *status){
+    if (results->packed){
+        pack_status( &results->buffer, path, status );
+    }else{
+        cJSON_AddStringToObject(results->json, path, status);
+    }
+}
+
+static void add_item_value(item_results *results, char *path, UA_DataValue *value){
+    if (results->packed){
+        pack_value( &results->buffer, path, value );
+    }else{
+        cJSON_AddItemToObject(results->json, path, item_read_result(*value));
+    }
+}
+
+// The response takes the results
+static cJSON *take_item_results(item_results *results, char **error){
+    if (results->packed) return packed2json( &results->buffer, error );
+
+    cJSON *response = results->json;
+    results->json = NULL;
+    return response;
+}
+
+// The item is answered with "invalid node" if the path is not known
+static UA_NodeId *lookup_item(client_session *session, item_results *results, char *path, char **error){
+    UA_NodeId *nodeId = lookup_path2nodeId_cache( connection_cache(session->connection), path );
+    if (nodeId) return nodeId;
+
+    *error = unknown_path( session, path );
+    if (!*error) add_item_status(results, path, "invalid node");
+    return NULL;
+}
+
 static cJSON* item_read_result(UA_DataValue value){
 
     if (value.status != UA_STATUSCODE_GOOD) return cJSON_CreateString( UA_StatusCode_name( value.status ) );
@@ -195,231 +448,1074 @@ static cJSON* item_read_result(UA_DataValue value){
     return result;
 }
 
-static cJSON* opcua_client_read_items(cJSON* args, char **error){
+// The arguments are either the list of paths or an object:
+//     {
+//         "items": ["path1","path2",...],
+//         ----optional---------
+//         "max_age": 1000,
+//         "packed": true
+//     }
+// Values received not earlier than max_age milliseconds ago are taken
+// from the cache, the others are to be read from the server.
+// The results are filled in with the items not read from the server
+static void prepare_read(client_session *session, cJSON* args, item_results *results, UA_NodeId ***nodeId, size_t *valid, UA_DateTime *maxAge, char **error){
+    cJSON *item = NULL;
+    bool packed = false;
+
+    *nodeId = NULL;
+    *valid = 0;
+    *maxAge = -1;
+
+    //-----------validate the arguments-----------------------
+    cJSON *items = args;
+    if ( cJSON_IsObject(args) ){
+        items = cJSON_GetObjectItemCaseSensitive(args, "items");
+
+        cJSON *max_age = cJSON_GetObjectItemCaseSensitive(args, "max_age");
+        if (cJSON_IsNumber(max_age)){
+            *maxAge = (UA_DateTime)max_age->valueint * UA_DATETIME_MSEC;
+        }
+
+        packed = cJSON_IsTrue( cJSON_GetObjectItemCaseSensitive(args, "packed") );
+    }
+
+    if ( !cJSON_IsArray(items) ) {
+        *error = "invalid read arguments";
+        goto on_error;
+    }
+
+    *error = resolve_unknown_items(session, items, false);
+    if (*error) goto on_error;
+
+    size_t size = cJSON_GetArraySize( items );
+
+    *nodeId = malloc( size * sizeof(UA_NodeId *) + 1 );
+    if(!*nodeId){
+        *error = "out of memory";
+        goto on_error;
+    }
+
+    *error = init_item_results(results, packed);
+    if (*error) goto on_error;
+
+    opcua_cache *cache = connection_cache(session->connection);
+    UA_DataValue cached;
+    cJSON_ArrayForEach(item, items) {
+        if (!cJSON_IsString(item) || (item->valuestring == NULL)) continue;
+
+        UA_NodeId *n = lookup_item( session, results, item->valuestring, error );
+        if (*error) goto on_error;
+
+        if (!n) continue;
+
+        if(*maxAge >= 0 && lookup_value_cache( cache, n, *maxAge, &cached )){
+            add_item_value(results, item->valuestring, &cached);
+            UA_DataValue_clear( &cached );
+        }else{
+            (*nodeId)[(*valid)++] = n;
+        }
+    }
+
+    return;
+
+on_error:
+    if (*nodeId) free(*nodeId);
+    *nodeId = NULL;
+    clear_item_results( results );
+}
+
+static void complete_read(opcua_connection *connection, item_results *results, size_t size, UA_NodeId **nodeId, UA_DataValue *values, UA_DateTime maxAge){
+    opcua_cache *cache = connection_cache(connection);
+    for(size_t i=0; i<size; i++){
+
+        char *path = lookup_nodeId2path_cache(cache, nodeId[i]);
+
+        add_item_value(results, path, &values[i]);
+
+        // The caller accepts cached values, keep the fresh one for the next time
+        if (maxAge >= 0) update_value_cache(cache, nodeId[i], &values[i], false);
+    }
+}
+
+static cJSON* opcua_client_read_items(client_session *session, cJSON* args, char **error){
     LOGTRACE("read items");
     cJSON *response = NULL;
-    cJSON *item = NULL;
+    item_results results = {0};
 
     UA_NodeId **nodeId = NULL;
     UA_DataValue *values = NULL;
     size_t valid = 0;
+    UA_DateTime maxAge;
 
-    if (!is_started()){
+    if (!is_started(session->connection)){
         *error = "no connection";
         goto on_clear;
     }
 
-    //-----------validate the arguments-----------------------
-    if ( !cJSON_IsArray(args) ) {
-        *error = "invalid read arguments";
-        goto on_clear;
+    prepare_read(session, args, &results, &nodeId, &valid, &maxAge, error);
+    if (*error) goto on_clear;
+
+    if (valid){
+        *error = read_values(session->connection, valid, nodeId, &values);
+        if (*error) goto on_clear;
+
+        complete_read(session->connection, &results, valid, nodeId, values, maxAge);
     }
 
-    size_t size = cJSON_GetArraySize( args );
+    response = take_item_results(&results, error);
 
-    nodeId = malloc( size * sizeof(UA_NodeId *));
-    if(!nodeId){
-        *error = "out of memory";
+on_clear:
+    if(nodeId) free(nodeId);
+    if(values) UA_Array_delete(values, valid, &UA_TYPES[UA_TYPES_DATAVALUE]);
+    clear_item_results(&results);
+
+    return response;
+}
+
+// The packed items are decoded first to resolve their paths in one go
+static void prepare_packed_write(client_session *session, char *base64, item_results *results, UA_NodeId ***nodeId, UA_Variant ***values, size_t *valid, char **error){
+    UA_ByteString *data = NULL;
+    char **paths = NULL;
+    UA_Variant **decoded = NULL;
+    size_t size = 0;
+
+    data = parse_base64( base64 );
+    if (!data){
+        *error = "invalid packed items";
         goto on_clear;
     }
 
-    response = cJSON_CreateObject();
-    if (!response){
-        *error = "unable to create response object";
+    // The shortest item is the empty path with the Boolean
+    size_t maxSize = data->length / 4 + 1;
+    paths = malloc( maxSize * sizeof(char *) );
+    decoded = malloc( maxSize * sizeof(UA_Variant *) );
+    *nodeId = malloc( maxSize * sizeof(UA_NodeId *) );
+    *values = malloc( maxSize * sizeof(UA_Variant *) );
+    if (!paths || !decoded || !*nodeId || !*values){
+        *error = "out of memory";
         goto on_clear;
     }
 
-    cJSON_ArrayForEach(item, args) {
-        UA_NodeId *n = lookup_path2nodeId_cache( item->valuestring );
-        if (!n){
-            *error = add_browse_queue( item->valuestring );
-            if (*error) goto on_clear;
-
-            cJSON_AddStringToObject(response, item->valuestring, "invalid node");
-        }else{
-            nodeId[valid++] = n;
-        }
+    size_t offset = 0;
+    while (offset < data->length){
+        *error = unpack_item(data, &offset, &paths[size], &decoded[size]);
+        if (*error) goto on_clear;
+        size++;
     }
 
-    if (!valid) goto on_clear;
+    *error = resolve_unknown_paths(session, size, paths);
+    if (*error) goto on_clear;
 
-    *error = read_values(valid, nodeId, &values);
+    *error = init_item_results(results, true);
     if (*error) goto on_clear;
 
-    for(size_t i=0; i<valid; i++){
+    for (size_t i = 0; i < size; i++){
+        UA_NodeId *n = lookup_item( session, results, paths[i], error );
+        if (*error) goto on_clear;
 
-        char *path = lookup_nodeId2path_cache(nodeId[i]);
+        if (!n){
+            UA_Variant_delete( decoded[i] );
+            decoded[i] = NULL;
+            continue;
+        }
 
-        cJSON_AddItemToObject(response, path, item_read_result(values[i]));
-        
+        (*nodeId)[*valid] = n;
+        (*values)[(*valid)++] = decoded[i];
+        // The value is taken by the request
+        decoded[i] = NULL;
     }
 
 on_clear:
-    if(nodeId) free(nodeId);
-    if(values) UA_Array_delete(values, valid, &UA_TYPES[UA_TYPES_DATAVALUE]);
-
-    if(!*error) return response;
-
-    cJSON_Delete( response );
-    return NULL;
+    for (size_t i = 0; i < size; i++){
+        free( paths[i] );
+        if (decoded[i]) UA_Variant_delete( decoded[i] );
+    }
+    if (paths) free( paths );
+    if (decoded) free( decoded );
+    if (data) UA_ByteString_delete( data );
+
+    if (!*error) return;
+
+    if (*nodeId) free(*nodeId);
+    if (*values) free(*values);
+    *nodeId = NULL;
+    *values = NULL;
+    *valid = 0;
+    clear_item_results( results );
 }
 
-static cJSON* opcua_client_write_items(cJSON* args, char **error){
-    LOGTRACE("write items");
-    cJSON *response = NULL;
+// The arguments are the map of paths to the typed values:
+//     {
+//         "path1": {"type":"Double","value":1.0},
+//         ...
+//     }
+// or the base64 string of the packed items, then the results are packed too.
+// The results are filled in with the items not written to the server
+static void prepare_write(client_session *session, cJSON* args, item_results *results, UA_NodeId ***nodeId, UA_Variant ***values, size_t *valid, char **error){
     cJSON *item = NULL;
 
-    UA_NodeId **nodeId = NULL;
-    UA_Variant **values = NULL;
-    char **results = NULL;
-    size_t valid = 0;
+    *nodeId = NULL;
+    *values = NULL;
+    *valid = 0;
 
-    if (!is_started()){
-        *error = "no connection";
-        goto on_clear;
+    //-----------validate the arguments-----------------------
+    if ( cJSON_IsString(args) && args->valuestring != NULL ){
+        prepare_packed_write(session, args->valuestring, results, nodeId, values, valid, error);
+        return;
     }
 
-    //-----------validate the arguments-----------------------
     if ( !cJSON_IsObject(args) ) {
         *error = "invalid write_items arguments";
-        goto on_clear;
+        goto on_error;
     }
 
+    *error = resolve_unknown_items(session, args, true);
+    if (*error) goto on_error;
+
     // cJSON can handle objects as arrays
     size_t size = cJSON_GetArraySize( args );
 
-    nodeId = malloc( size * sizeof(UA_NodeId *));
-    if(!nodeId){
+    *nodeId = malloc( size * sizeof(UA_NodeId *) + 1 );
+    if(!*nodeId){
         *error = "out of memory";
-        goto on_clear;
+        goto on_error;
     }
 
-    values = malloc( size * sizeof(UA_Variant *));
-    if(!values){
+    *values = malloc( size * sizeof(UA_Variant *) + 1 );
+    if(!*values){
         *error = "out of memory";
-        goto on_clear;
+        goto on_error;
     }
 
-    response = cJSON_CreateObject();
-    if (!response){
-        *error = "unable to create response object";
-        goto on_clear;
-    }
+    *error = init_item_results(results, false);
+    if (*error) goto on_error;
 
     cJSON_ArrayForEach(item, args) {
         if (!cJSON_IsObject(item)){
-            cJSON_AddStringToObject(response, item->string, "invalid arguments");
+            add_item_status(results, item->string, "invalid arguments");
             continue;
         }
 
         cJSON *type = cJSON_GetObjectItemCaseSensitive(item, "type");
         if (!cJSON_IsString(type) || (type->valuestring == NULL)){
-            cJSON_AddStringToObject(response, item->string, "type not provided");
+            add_item_status(results, item->string, "type not provided");
             continue;
         }
 
         cJSON *value = cJSON_GetObjectItemCaseSensitive(item, "value");
         if (!value){
-            cJSON_AddStringToObject(response, item->string, "value not provided");
+            add_item_status(results, item->string, "value not provided");
             continue;
         }
 
-        UA_NodeId *n = lookup_path2nodeId_cache( item->string );
-        if (!n){
-            *error = add_browse_queue( item->valuestring );
-            if (*error) goto on_clear;
+        UA_NodeId *n = lookup_item( session, results, item->string, error );
+        if (*error) goto on_error;
+
+        if (!n) continue;
 
-            cJSON_AddStringToObject(response, item->string, "invalid node");
-            continue;
-        }
         const UA_DataType *ua_type = type2ua( type->valuestring );
         if(!ua_type){
-            cJSON_AddStringToObject(response, item->string, "unsupported type");
+            add_item_status(results, item->string, "unsupported type");
             continue;
         }
         UA_Variant *ua_value = json2ua(ua_type, value);
         if (!ua_value){
-            cJSON_AddStringToObject(response, item->string, "invalid value");
+            add_item_status(results, item->string, "invalid value");
             continue;
 
         }
 
-        nodeId[valid] = n;
-        values[valid++] = ua_value;
+        (*nodeId)[*valid] = n;
+        (*values)[(*valid)++] = ua_value;
     }
 
-    if(!valid) goto on_clear;
+    return;
 
-    *error = write_values(valid, nodeId, values, &results);
-    if (*error) goto on_clear;
+on_error:
+    if (*nodeId) free(*nodeId);
+    if (*values) free(*values);
+    *nodeId = NULL;
+    *values = NULL;
+    clear_item_results( results );
+}
 
-    for(size_t i=0; i<valid; i++){
+static void complete_write(opcua_connection *connection, item_results *results, size_t size, UA_NodeId **nodeId, char **writeResults){
+    for(size_t i=0; i<size; i++){
 
-        char *path = lookup_nodeId2path_cache(nodeId[i]);
+        char *path = lookup_nodeId2path_cache(connection_cache(connection), nodeId[i]);
 
-        if (results[i]){
-            cJSON_AddStringToObject(response, path, results[i]);
+        if (writeResults[i]){
+            add_item_status(results, path, writeResults[i]);
         }else{
-            cJSON_AddStringToObject(response, path, "ok");
+            add_item_status(results, path, "ok");
         }
     }
+}
+
+static cJSON* opcua_client_write_items(client_session *session, cJSON* args, char **error){
+    LOGTRACE("write items");
+    cJSON *response = NULL;
+    item_results results = {0};
+
+    UA_NodeId **nodeId = NULL;
+    UA_Variant **values = NULL;
+    char **writeResults = NULL;
+    size_t valid = 0;
+
+    if (!is_started(session->connection)){
+        *error = "no connection";
+        goto on_clear;
+    }
+
+    prepare_write(session, args, &results, &nodeId, &values, &valid, error);
+    if (*error) goto on_clear;
+
+    if(valid){
+        *error = write_values(session->connection, valid, nodeId, values, &writeResults);
+        if (*error) goto on_clear;
+
+        complete_write(session->connection, &results, valid, nodeId, writeResults);
+    }
+
+    response = take_item_results(&results, error);
 
 on_clear:
     if(nodeId) free(nodeId);
     if(values) free(values);
-    if(results) free(results);
-
-    if(!*error) return response;
+    if(writeResults) free(writeResults);
+    clear_item_results(&results);
 
-    cJSON_Delete( response );
-    return NULL;
+    return response;
 }
 
-static cJSON* opcua_client_search(cJSON* args, char **error){
-    cJSON *response = NULL;
-    opcua_item *items = NULL;
+//-----------------------------------------------------
+//  Asynchronous read and write
+//-----------------------------------------------------
+// read_items_async and write_items_async take the same arguments as
+// read_items and write_items but return the id of the request at once.
+// The results are taken by async_results later, in the order the server answers.
+// Many requests may be in flight at the same time
+// Ids are unique within the session
+struct async_request{
+  int id;
+  // The results of the items not sent to the server
+  item_results results;
+  // The whole request failed
+  char *error;
+  UA_DateTime maxAge;
+  bool done;
+  UT_hash_handle hh;
+};
+
+// The request takes the results
+static cJSON* add_async_request(client_session *session, item_results *results, UA_DateTime maxAge, bool done, char **error){
+    async_request *request = malloc( sizeof(async_request) );
+    if (!request){
+        *error = "out of memory";
+        clear_item_results( results );
+        return NULL;
+    }
+    request->id = session->asyncId;
+    request->results = *results;
+    request->error = NULL;
+    request->maxAge = maxAge;
+    request->done = done;
+    HASH_ADD_INT(session->asyncRequests, id, request);
+
+    return cJSON_CreateNumber( request->id );
+}
 
-    if (!is_started()){
-        *error = "no connection";
-        goto on_error;
+static void purge_async_requests(client_session *session){
+    async_request *request, *tmp;
+    HASH_ITER(hh, session->asyncRequests, request, tmp) {
+        HASH_DEL(session->asyncRequests, request);
+        clear_item_results( &request->results );
+        free( request );
     }
+    session->asyncRequests = NULL;
+    if (session->connection) purge_completions( connection_completions(session->connection) );
+}
 
-    if (!cJSON_IsString(args) || (args->valuestring == NULL)){
-        *error = "undefined search string";
+// The results of the asynchronous requests are not packed
+static cJSON* opcua_client_read_items_async(client_session *session, cJSON* args, char **error){
+    LOGTRACE("read items async");
+    item_results results = {0};
+
+    UA_NodeId **nodeId = NULL;
+    size_t valid = 0;
+    UA_DateTime maxAge;
+
+    if (!is_started(session->connection)){
+        *error = "no connection";
         goto on_error;
     }
 
-    char *search = args->valuestring;;
+    prepare_read(session, args, &results, &nodeId, &valid, &maxAge, error);
+    if (*error) goto on_error;
 
-    response = cJSON_CreateObject();
-    if (!response){
-        *error = "unable to create result set";
+    if (results.packed){
+        *error = "packed results are not supported by asynchronous requests";
         goto on_error;
     }
 
-    size_t size = 0;
-    items = get_all_cache_items(&size);
-    for (int i = 0; i<size; i++){
-        if (strstr(items[i].path, search)){
-            if (!cJSON_AddNumberToObject(response,items[i].path, items[i].nodeClass)){
-                *error = "unable to add an item to the result";
-                goto on_error;
-            }
-        }
+    // The id is taken by the request when it is sent
+    session->asyncId = session->asyncId == INT32_MAX ? 1 : session->asyncId + 1;
+    if (valid){
+        *error = read_values_async(session->connection, (UA_UInt32)session->asyncId, valid, nodeId);
+        if (*error) goto on_error;
     }
-    free(items);
+    free(nodeId);
 
-    return response;
+    return add_async_request(session, &results, maxAge, !valid, error);
 
 on_error:
-    if (items) free(items);
-    cJSON_Delete( response );
+    if(nodeId) free(nodeId);
+    clear_item_results(&results);
     return NULL;
 }
 
-//-----------------------------------------------------
-//  eport_c request routing
-//-----------------------------------------------------
+static cJSON* opcua_client_write_items_async(client_session *session, cJSON* args, char **error){
+    LOGTRACE("write items async");
+    item_results results = {0};
+
+    UA_NodeId **nodeId = NULL;
+    UA_Variant **values = NULL;
+    size_t valid = 0;
+
+    if (!is_started(session->connection)){
+        *error = "no connection";
+        goto on_error;
+    }
+
+    prepare_write(session, args, &results, &nodeId, &values, &valid, error);
+    if (*error) goto on_error;
+
+    if (results.packed){
+        *error = "packed results are not supported by asynchronous requests";
+        goto on_error;
+    }
+
+    session->asyncId = session->asyncId == INT32_MAX ? 1 : session->asyncId + 1;
+    if (valid){
+        *error = write_values_async(session->connection, (UA_UInt32)session->asyncId, valid, nodeId, values);
+        if (*error) goto on_error;
+    }
+    free(nodeId);
+    free(values);
+
+    return add_async_request(session, &results, -1, !valid, error);
+
+on_error:
+    if(nodeId) free(nodeId);
+    if(values) free(values);
+    clear_item_results(&results);
+    return NULL;
+}
+
+// Returns the results of the finished requests by their ids:
+//  {"1":{"path1":{"type":"Double","value":1.0},...},"2":"BadTimeout",...}
+static cJSON* opcua_client_async_results(client_session *session, cJSON* args, char **error){
+    cJSON *response = NULL;
+    size_t size = 0;
+    opcua_completion *completions = NULL;
+
+    response = cJSON_CreateObject();
+    if (!response){
+        *error = "unable to create response object";
+        goto on_clear;
+    }
+
+    completions = get_completions(connection_completions(session->connection), &size);
+    for(size_t i=0; i<size; i++){
+        int id = (int)completions[i].id;
+        async_request *request = NULL;
+        HASH_FIND_INT(session->asyncRequests, &id, request);
+        if (!request) continue;
+
+        if (completions[i].error){
+            request->error = completions[i].error;
+        }else if (completions[i].values){
+            complete_read(session->connection, &request->results, completions[i].size, completions[i].nodeId, completions[i].values, request->maxAge);
+        }else if (completions[i].results){
+            complete_write(session->connection, &request->results, completions[i].size, completions[i].nodeId, completions[i].results);
+        }
+        request->done = true;
+    }
+
+    async_request *request, *tmp;
+    HASH_ITER(hh, session->asyncRequests, request, tmp) {
+        if (!request->done) continue;
+
+        char key[16];
+        snprintf(key, sizeof(key), "%d", request->id);
+        if (request->error){
+            cJSON_AddStringToObject(response, key, request->error);
+        }else{
+            char *_error = NULL;
+            cJSON *result = take_item_results(&request->results, &_error);
+            if (_error){
+                cJSON_AddStringToObject(response, key, _error);
+            }else{
+                cJSON_AddItemToObject(response, key, result);
+            }
+        }
+
+        HASH_DEL(session->asyncRequests, request);
+        clear_item_results( &request->results );
+        free( request );
+    }
+
+on_clear:
+    free_completions(completions, size);
+
+    if(!*error) return response;
+
+    cJSON_Delete( response );
+    return NULL;
+}
+
+//-----------------------------------------------------
+//  Item sets
+//-----------------------------------------------------
+// The caller registers the list of paths once and then reads it by the id.
+// The results are columnar in the order of the paths, see pack_columns,
+// so the paths are not repeated in every response.
+// The read request of the resolved paths is prebuilt by the update loop
+// and the nodes are registered on the server, the plain read does no lookups.
+// The set is built again only when the browse cache changes, the unknown
+// paths wait for the update loop or stay in the negative cache meanwhile
+struct item_set{
+  int id;
+  size_t size;
+  char **paths;
+  opcua_read_set *reads;
+  // The positions of the paths in the prebuilt read
+  size_t *index;
+  size_t resolved;
+  // The generation of the cache the read is built from
+  uint64_t generation;
+  UT_hash_handle hh;
+};
+
+static void free_item_set(client_session *session, item_set *set){
+    delete_read_set( session->connection, set->reads );
+    for (size_t i = 0; i < set->size; i++) free( set->paths[i] );
+    if (set->paths) free( set->paths );
+    if (set->index) free( set->index );
+    free( set );
+}
+
+static void purge_item_sets(client_session *session){
+    item_set *set, *tmp;
+    HASH_ITER(hh, session->itemSets, set, tmp) {
+        HASH_DEL(session->itemSets, set);
+        free_item_set( session, set );
+    }
+    session->itemSets = NULL;
+}
+
+static item_set *find_item_set(client_session *session, cJSON *id){
+    if (!cJSON_IsNumber(id)) return NULL;
+
+    item_set *set = NULL;
+    int _id = id->valueint;
+    HASH_FIND_INT(session->itemSets, &_id, set);
+    return set;
+}
+
+// The read is built again if the cache is changed since the last build
+static char *prepare_item_set(client_session *session, item_set *set){
+    char *error = NULL;
+    UA_NodeId **nodeId = NULL;
+    size_t *index = NULL;
+    size_t resolved = 0;
+    opcua_read_set *reads = NULL;
+
+    opcua_cache *cache = connection_cache(session->connection);
+    // Taken before the lookups, a change during them causes one more build
+    uint64_t generation = get_cache_generation( cache );
+    if (set->reads && set->generation == generation) return NULL;
+
+    error = resolve_unknown_paths(session, set->size, set->paths);
+    if (error) goto on_clear;
+
+    nodeId = malloc( set->size * sizeof(UA_NodeId *) + 1 );
+    index = malloc( set->size * sizeof(size_t) + 1 );
+    if (!nodeId || !index){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    for (size_t i = 0; i < set->size; i++){
+        UA_NodeId *n = lookup_path2nodeId_cache( cache, set->paths[i] );
+        if (!n){
+            error = unknown_path( session, set->paths[i] );
+            if (error) goto on_clear;
+            continue;
+        }
+        nodeId[resolved] = n;
+        index[resolved++] = i;
+    }
+
+    error = create_read_set(resolved, nodeId, &reads);
+    if (error) goto on_clear;
+
+    delete_read_set( session->connection, set->reads );
+    if (set->index) free( set->index );
+    set->reads = reads;
+    set->index = index;
+    set->resolved = resolved;
+    set->generation = generation;
+    index = NULL;
+
+on_clear:
+    if (nodeId) free( nodeId );
+    if (index) free( index );
+    return error;
+}
+
+// ["path1","path2",...] -> the id of the set
+static cJSON* opcua_client_register_items(client_session *session, cJSON* args, char **error){
+    cJSON *item = NULL;
+
+    if ( !cJSON_IsArray(args) ) {
+        *error = "invalid register_items arguments";
+        return NULL;
+    }
+
+    item_set *set = calloc(1, sizeof(item_set));
+    if (!set){
+        *error = "out of memory";
+        return NULL;
+    }
+    set->paths = malloc( cJSON_GetArraySize( args ) * sizeof(char *) + 1 );
+    if (!set->paths){
+        *error = "out of memory";
+        goto on_error;
+    }
+
+    cJSON_ArrayForEach(item, args) {
+        if (!cJSON_IsString(item) || (item->valuestring == NULL)){
+            *error = "invalid path";
+            goto on_error;
+        }
+        set->paths[set->size] = strdup( item->valuestring );
+        if (!set->paths[set->size]){
+            *error = "out of memory";
+            goto on_error;
+        }
+        set->size++;
+    }
+
+    // The read is prepared before the first read, otherwise by the first read
+    if (is_started(session->connection)){
+        *error = prepare_item_set(session, set);
+        if (*error) goto on_error;
+    }
+
+    session->itemSetId = session->itemSetId == INT32_MAX ? 1 : session->itemSetId + 1;
+    set->id = session->itemSetId;
+    HASH_ADD_INT(session->itemSets, id, set);
+
+    return cJSON_CreateNumber( set->id );
+
+on_error:
+    free_item_set( session, set );
+    return NULL;
+}
+
+static cJSON* opcua_client_unregister_items(client_session *session, cJSON* args, char **error){
+    item_set *set = find_item_set(session, args);
+    if (!set){
+        *error = "invalid item set";
+        return NULL;
+    }
+
+    HASH_DEL(session->itemSets, set);
+    free_item_set( session, set );
+
+    return cJSON_CreateString("ok");
+}
+
+// The values not older than maxAge are taken from the cache, the rest are read
+static char *read_item_set_cached(client_session *session, item_set *set, UA_DateTime maxAge, UA_DataValue *values){
+    char *error = NULL;
+    UA_DataValue *readValues = NULL;
+    UA_NodeId **nodeId = NULL;
+    size_t *index = NULL;
+    size_t valid = 0;
+
+    error = resolve_unknown_paths(session, set->size, set->paths);
+    if (error) goto on_clear;
+
+    nodeId = malloc( set->size * sizeof(UA_NodeId *) + 1 );
+    index = malloc( set->size * sizeof(size_t) + 1 );
+    if (!nodeId || !index){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    opcua_cache *cache = connection_cache(session->connection);
+    for (size_t i = 0; i < set->size; i++){
+        UA_NodeId *n = lookup_path2nodeId_cache( cache, set->paths[i] );
+        if (!n){
+            error = unknown_path( session, set->paths[i] );
+            if (error) goto on_clear;
+            values[i].status = UA_STATUSCODE_BADNODEIDUNKNOWN;
+            continue;
+        }
+        if (lookup_value_cache( cache, n, maxAge, &values[i] )) continue;
+
+        nodeId[valid] = n;
+        index[valid++] = i;
+    }
+
+    if (valid){
+        error = read_values(session->connection, valid, nodeId, &readValues);
+        if (error) goto on_clear;
+
+        for (size_t i = 0; i < valid; i++){
+            update_value_cache(cache, nodeId[i], &readValues[i], false);
+            // Take the value, the emptied one is released with the array
+            values[ index[i] ] = readValues[i];
+            UA_DataValue_init( &readValues[i] );
+        }
+    }
+
+on_clear:
+    if (readValues) UA_Array_delete(readValues, valid, &UA_TYPES[UA_TYPES_DATAVALUE]);
+    if (nodeId) free( nodeId );
+    if (index) free( index );
+    return error;
+}
+
+// The argument is the id of the set or an object:
+//     {
+//         "set": 1,
+//         ----optional---------
+//         "max_age": 1000
+//     }
+// The unknown items have the BadNodeIdUnknown status
+static cJSON* opcua_client_read_item_set(client_session *session, cJSON* args, char **error){
+    LOGTRACE("read item set");
+    cJSON *response = NULL;
+    packed_buffer buffer;
+
+    UA_DataValue *values = NULL;
+    UA_DataValue *readValues = NULL;
+    size_t size = 0;
+    size_t readSize = 0;
+    UA_DateTime maxAge = -1;
+
+    init_packed( &buffer );
+
+    if (!is_started(session->connection)){
+        *error = "no connection";
+        goto on_clear;
+    }
+
+    cJSON *id = args;
+    if (cJSON_IsObject(args)){
+        id = cJSON_GetObjectItemCaseSensitive(args, "set");
+
+        cJSON *max_age = cJSON_GetObjectItemCaseSensitive(args, "max_age");
+        if (cJSON_IsNumber(max_age)){
+            maxAge = (UA_DateTime)max_age->valueint * UA_DATETIME_MSEC;
+        }
+    }
+
+    item_set *set = find_item_set(session, id);
+    if (!set){
+        *error = "invalid item set";
+        goto on_clear;
+    }
+
+    if (maxAge >= 0){
+        values = calloc( set->size + 1, sizeof(UA_DataValue) );
+        if (!values){
+            *error = "out of memory";
+            goto on_clear;
+        }
+        size = set->size;
+
+        *error = read_item_set_cached(session, set, maxAge, values);
+        if (*error) goto on_clear;
+
+        pack_columns( &buffer, size, values );
+        response = packed2json( &buffer, error );
+        goto on_clear;
+    }
+
+    *error = prepare_item_set(session, set);
+    if (*error) goto on_clear;
+
+    if (set->resolved){
+        *error = read_set_values(session->connection, set->reads, &readValues);
+        if (*error) goto on_clear;
+        readSize = set->resolved;
+    }
+
+    if (set->resolved == set->size){
+        // All the paths are known, the values are packed as they are read
+        pack_columns( &buffer, readSize, readValues );
+    }else{
+        values = calloc( set->size + 1, sizeof(UA_DataValue) );
+        if (!values){
+            *error = "out of memory";
+            goto on_clear;
+        }
+        size = set->size;
+
+        for (size_t i = 0; i < size; i++) values[i].status = UA_STATUSCODE_BADNODEIDUNKNOWN;
+        for (size_t i = 0; i < readSize; i++){
+            // Take the value, the emptied one is released with the array
+            values[ set->index[i] ] = readValues[i];
+            UA_DataValue_init( &readValues[i] );
+        }
+        pack_columns( &buffer, size, values );
+    }
+    response = packed2json( &buffer, error );
+
+on_clear:
+    if (values){
+        for (size_t i = 0; i < size; i++) UA_DataValue_clear( &values[i] );
+        free( values );
+    }
+    if (readValues) UA_Array_delete(readValues, readSize, &UA_TYPES[UA_TYPES_DATAVALUE]);
+    clear_packed( &buffer );
+
+    return response;
+}
+
+// Subscribe and unsubscribe share the same arguments and the response format:
+//  ["path1","path2",...] -> {"path1":"ok","path2":"invalid node",...}
+typedef char *(*subscription_handler)(opcua_connection *connection, size_t size, UA_NodeId **nodeId, char ***results);
+
+static cJSON* subscription_request(client_session *session, cJSON* args, subscription_handler handler, char **error){
+    cJSON *response = NULL;
+    cJSON *item = NULL;
+
+    UA_NodeId **nodeId = NULL;
+    char **results = NULL;
+    size_t valid = 0;
+
+    if (!is_started(session->connection)){
+        *error = "no connection";
+        goto on_clear;
+    }
+
+    //-----------validate the arguments-----------------------
+    if ( !cJSON_IsArray(args) ) {
+        *error = "invalid subscription arguments";
+        goto on_clear;
+    }
+
+    *error = resolve_unknown_items(session, args, false);
+    if (*error) goto on_clear;
+
+    size_t size = cJSON_GetArraySize( args );
+
+    nodeId = malloc( size * sizeof(UA_NodeId *));
+    if(!nodeId){
+        *error = "out of memory";
+        goto on_clear;
+    }
+
+    response = cJSON_CreateObject();
+    if (!response){
+        *error = "unable to create response object";
+        goto on_clear;
+    }
+
+    cJSON_ArrayForEach(item, args) {
+        if (!cJSON_IsString(item) || (item->valuestring == NULL)) continue;
+
+        UA_NodeId *n = lookup_path2nodeId_cache( connection_cache(session->connection), item->valuestring );
+        if (!n){
+            *error = unknown_path( session, item->valuestring );
+            if (*error) goto on_clear;
+
+            cJSON_AddStringToObject(response, item->valuestring, "invalid node");
+        }else{
+            nodeId[valid++] = n;
+        }
+    }
+
+    if (!valid) goto on_clear;
+
+    *error = handler(session->connection, valid, nodeId, &results);
+    if (*error) goto on_clear;
+
+    for(size_t i=0; i<valid; i++){
+
+        char *path = lookup_nodeId2path_cache(connection_cache(session->connection), nodeId[i]);
+
+        if (results[i]){
+            cJSON_AddStringToObject(response, path, results[i]);
+        }else{
+            cJSON_AddStringToObject(response, path, "ok");
+        }
+    }
+
+on_clear:
+    if(nodeId) free(nodeId);
+    if(results) free(results);
+
+    if(!*error) return response;
+
+    cJSON_Delete( response );
+    return NULL;
+}
+
+static cJSON* opcua_client_subscribe(client_session *session, cJSON* args, char **error){
+    LOGTRACE("subscribe items");
+    return subscription_request(session, args, &subscribe_values, error);
+}
+
+static cJSON* opcua_client_unsubscribe(client_session *session, cJSON* args, char **error){
+    LOGTRACE("unsubscribe items");
+    return subscription_request(session, args, &unsubscribe_values, error);
+}
+
+// Returns values changed since the previous call:
+//  {"path1":{"type":"Double","value":1.0},"path2":"BadNodeIdUnknown",...}
+// With {"packed":true} the values are packed
+static cJSON* opcua_client_notifications(client_session *session, cJSON* args, char **error){
+    cJSON *response = NULL;
+    item_results results = {0};
+    size_t size = 0;
+    opcua_notification *notifications = NULL;
+
+    if (!is_started(session->connection)){
+        *error = "no connection";
+        goto on_clear;
+    }
+
+    bool packed = cJSON_IsObject(args) && cJSON_IsTrue( cJSON_GetObjectItemCaseSensitive(args, "packed") );
+    *error = init_item_results(&results, packed);
+    if (*error) goto on_clear;
+
+    notifications = get_notifications(connection_subscriptions(session->connection), &size);
+    for(size_t i=0; i<size; i++){
+        char *path = lookup_nodeId2path_cache(connection_cache(session->connection), notifications[i].nodeId);
+        add_item_value(&results, path, &notifications[i].value);
+    }
+
+    response = take_item_results(&results, error);
+
+on_clear:
+    free_notifications(notifications, size);
+    clear_item_results(&results);
+
+    if(!*error) return response;
+
+    cJSON_Delete( response );
+    return NULL;
+}
+
+// The argument is either a substring of the path or an object
+// with one of the search modes:
+//     {"prefix": "Plant1/Line3/"}
+//     {"regex": "Line[0-9]+/Temp$"}
+//     {"glob": "Plant1/*/Temp*"}
+static cJSON* opcua_client_search(client_session *session, cJSON* args, char **error){
+    cJSON *response = NULL;
+    UA_NodeId **nodeIds = NULL;
+    size_t size = 0;
+    opcua_cache *cache = connection_cache(session->connection);
+
+    if (!is_started(session->connection)){
+        *error = "no connection";
+        goto on_error;
+    }
+
+    if (cJSON_IsString(args) && (args->valuestring != NULL)){
+        *error = search_substring_cache(cache, args->valuestring, &nodeIds, &size);
+    }else if (cJSON_IsObject(args)){
+        cJSON *prefix = cJSON_GetObjectItemCaseSensitive(args, "prefix");
+        cJSON *regex = cJSON_GetObjectItemCaseSensitive(args, "regex");
+        cJSON *glob = cJSON_GetObjectItemCaseSensitive(args, "glob");
+        if (cJSON_IsString(prefix) && (prefix->valuestring != NULL)){
+            *error = search_prefix_cache(cache, prefix->valuestring, &nodeIds, &size);
+        }else if (cJSON_IsString(regex) && (regex->valuestring != NULL)){
+            *error = search_regex_cache(cache, regex->valuestring, &nodeIds, &size);
+        }else if (cJSON_IsString(glob) && (glob->valuestring != NULL)){
+            *error = search_glob_cache(cache, glob->valuestring, &nodeIds, &size);
+        }else{
+            *error = "undefined search mode";
+        }
+    }else{
+        *error = "undefined search string";
+    }
+    if (*error) goto on_error;
+
+    response = cJSON_CreateObject();
+    if (!response){
+        *error = "unable to create result set";
+        goto on_error;
+    }
+
+    for (size_t i = 0; i<size; i++){
+        char *path = lookup_nodeId2path_cache(cache, nodeIds[i]);
+        if (!path || !cJSON_AddNumberToObject(response, path, lookup_nodeClass_cache(cache, nodeIds[i]))){
+            *error = "unable to add an item to the result";
+            goto on_error;
+        }
+    }
+
+    free( nodeIds );
+    return response;
+
+on_error:
+    if (nodeIds) free( nodeIds );
+    cJSON_Delete( response );
+    return NULL;
+}
+
+static cJSON* opcua_client_disconnect(client_session *session, cJSON* args, char **error){
+    LOGINFO("disconnect the session %d", session->handle);
+    remove_session( session );
+    return cJSON_CreateString("ok");
+}
+
+//-----------------------------------------------------
+//  eport_c request routing
+//-----------------------------------------------------
+typedef cJSON* (*session_request)(client_session *session, cJSON* args, char **error);
+
+// The request to a session other than 0 is wrapped into:
+//     {
+//         "connection": 1,
+//         "args": <the arguments of the method>
+//     }
+static cJSON* on_session_request( session_request handler, bool create, cJSON *args, char **error ){
+    int handle = 0;
+
+    cJSON *connection = cJSON_GetObjectItemCaseSensitive(args, "connection");
+    cJSON *sessionArgs = cJSON_GetObjectItemCaseSensitive(args, "args");
+    if (cJSON_IsObject(args) && cJSON_IsNumber(connection) && sessionArgs){
+        handle = connection->valueint;
+        args = sessionArgs;
+    }
+
+    client_session *session = find_session( handle );
+    if (!session){
+        if (!create){
+            *error = "no connection";
+            return NULL;
+        }
+        session = add_session( handle, error );
+        if (!session) return NULL;
+    }
+
+    // The handler holds NodeIds of the cache
+    pin_caches();
+    cJSON *response = handler( session, args, error );
+    unpin_caches();
+
+    return response;
+}
+
 static cJSON* on_request( char *method, cJSON *args, char **error ){
     
     cJSON *response = NULL;
@@ -429,13 +1525,33 @@ static cJSON* on_request( char *method, cJSON *args, char **error ){
     if (strcmp(method, "browse_servers") == 0){
         response = opcua_client_browse_servers( args, error );
     }else if( strcmp(method, "connect") == 0){
-        response = opcua_client_connect( args, error );
+        response = on_session_request( opcua_client_connect, true, args, error );
+    }else if( strcmp(method, "disconnect") == 0){
+        response = on_session_request( opcua_client_disconnect, false, args, error );
     }else if (strcmp(method, "read_items") == 0){
-        response = opcua_client_read_items( args, error );
+        response = on_session_request( opcua_client_read_items, false, args, error );
     }else if (strcmp(method, "write_items") == 0){
-        response = opcua_client_write_items( args, error );
+        response = on_session_request( opcua_client_write_items, false, args, error );
+    }else if (strcmp(method, "read_items_async") == 0){
+        response = on_session_request( opcua_client_read_items_async, false, args, error );
+    }else if (strcmp(method, "write_items_async") == 0){
+        response = on_session_request( opcua_client_write_items_async, false, args, error );
+    }else if (strcmp(method, "async_results") == 0){
+        response = on_session_request( opcua_client_async_results, false, args, error );
     }else if (strcmp(method, "search") == 0){
-        response = opcua_client_search( args, error );
+        response = on_session_request( opcua_client_search, false, args, error );
+    }else if (strcmp(method, "subscribe") == 0){
+        response = on_session_request( opcua_client_subscribe, false, args, error );
+    }else if (strcmp(method, "unsubscribe") == 0){
+        response = on_session_request( opcua_client_unsubscribe, false, args, error );
+    }else if (strcmp(method, "notifications") == 0){
+        response = on_session_request( opcua_client_notifications, false, args, error );
+    }else if (strcmp(method, "register_items") == 0){
+        response = on_session_request( opcua_client_register_items, false, args, error );
+    }else if (strcmp(method, "unregister_items") == 0){
+        response = on_session_request( opcua_client_unregister_items, false, args, error );
+    }else if (strcmp(method, "read_item_set") == 0){
+        response = on_session_request( opcua_client_read_item_set, false, args, error );
     } else{
         *error = "invalid method";
     }
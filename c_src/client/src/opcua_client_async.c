@@ -0,0 +1,115 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+#include <pthread.h>
+
+#include <open62541/types_generated_handling.h>
+
+#include "opcua_client_async.h"
+//-----------------------------------------------------
+//  Completions mailbox
+//-----------------------------------------------------
+// Completions arrive from the update loop thread and are taken
+// by the eport thread in the order of arrival
+struct opcua_completions{
+  opcua_completion *array;
+  size_t used;
+  size_t size;
+  pthread_mutex_t lock;
+};
+
+opcua_completions *new_completions(){
+    opcua_completions *completions = calloc(1, sizeof(opcua_completions));
+    if (!completions) return NULL;
+
+    pthread_mutex_init(&completions->lock, NULL);
+    return completions;
+}
+
+void delete_completions(opcua_completions *completions){
+    if (!completions) return;
+
+    purge_completions( completions );
+    pthread_mutex_destroy(&completions->lock);
+    free( completions );
+}
+
+static void clear_completion(opcua_completion *completion){
+    if (completion->values) UA_Array_delete(completion->values, completion->size, &UA_TYPES[UA_TYPES_DATAVALUE]);
+    if (completion->results) free( completion->results );
+    if (completion->nodeId) free( completion->nodeId );
+}
+
+char *add_completion(opcua_completions *completions, opcua_completion *completion){
+    char *error = NULL;
+
+    pthread_mutex_lock(&completions->lock);
+
+    if (completions->used == completions->size){
+        size_t size = completions->size ? completions->size * 2 : 16;
+        opcua_completion *array = realloc(completions->array, size * sizeof(opcua_completion));
+        if (!array){
+            clear_completion( completion );
+            error = "out of memory";
+            goto on_clear;
+        }
+        completions->array = array;
+        completions->size = size;
+    }
+
+    // The data is moved, not copied
+    completions->array[completions->used++] = *completion;
+
+on_clear:
+    pthread_mutex_unlock(&completions->lock);
+    return error;
+}
+
+opcua_completion *get_completions(opcua_completions *completions, size_t *size){
+
+    // Take the whole mailbox at once to keep the lock short
+    pthread_mutex_lock(&completions->lock);
+    opcua_completion *array = completions->array;
+    *size = completions->used;
+    completions->array = NULL;
+    completions->used = 0;
+    completions->size = 0;
+    pthread_mutex_unlock(&completions->lock);
+
+    return array;
+}
+
+void free_completions(opcua_completion *completions, size_t size){
+    if (!completions) return;
+    for (size_t i = 0; i < size; i++){
+        clear_completion( &completions[i] );
+    }
+    free( completions );
+}
+
+void purge_completions(opcua_completions *completions){
+    size_t size;
+    opcua_completion *array = get_completions(completions, &size);
+    free_completions(array, size);
+}
+
+bool has_completions(opcua_completions *completions){
+    pthread_mutex_lock(&completions->lock);
+    bool has = completions->used > 0;
+    pthread_mutex_unlock(&completions->lock);
+    return has;
+}
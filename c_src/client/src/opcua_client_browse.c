@@ -21,6 +21,10 @@
 
 #include <eport_c_log.h>
 
+#include <open62541/client_highlevel_async.h>
+
+#include <uthash.h>
+
 #include "opcua_client_browse_cache.h"
 #include "opcua_client_browse.h"
 #include "opcua_client_loop.h"
@@ -30,7 +34,6 @@
 //-----------------------------------------------------
 typedef struct{
   UA_NodeId *nodeId;
-  char *name;
   int nodeClass;
 } RefArrayEntry;
 
@@ -50,7 +53,7 @@ static char *initRefArray(RefArray *a, size_t initialSize) {
     return NULL;
 }
 
-static char *insertRefArray(RefArray *a, char *name, UA_NodeId *nodeId, int nodeClass) {
+static char *insertRefArray(RefArray *a, UA_NodeId *nodeId, int nodeClass) {
     if (a->used >= a->size) {
         a->size += a->step;
         a->array = realloc(a->array, a->size * sizeof(RefArrayEntry));
@@ -58,7 +61,6 @@ static char *insertRefArray(RefArray *a, char *name, UA_NodeId *nodeId, int node
     }
 
     a->array[a->used].nodeId = nodeId;
-    a->array[a->used].name = strdup(name);
     a->array[a->used].nodeClass = nodeClass;
 
     a->used++;
@@ -66,173 +68,628 @@ static char *insertRefArray(RefArray *a, char *name, UA_NodeId *nodeId, int node
     return NULL;
 }
 
+// Drop the first n entries
+static void shiftRefArray(RefArray *a, size_t n){
+    memmove(a->array, a->array + n, (a->used - n) * sizeof(RefArrayEntry));
+    a->used -= n;
+}
+
 static void freeRefArray(RefArray *a){
-    for (int i = 0; i < a->used; i++){
-        free(a->array[i].name);
-    }
     free(a->array);
     a->array = NULL;
     a->size = 0;
     a->used = 0;
 }
 
-static char *getNodePath(UA_NodeId *folder, char *name, char **path){
-    UA_NodeId root = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
-    if (UA_NodeId_equal(folder, &root)){
-        // This is the 'Objects' folder
-        *path = strdup( name );
-        return NULL;
-    }
+//-----------------------------------------------------
+//  Continuation points
+//-----------------------------------------------------
+typedef struct{
+  UA_ByteString continuationPoint;
+  RefArrayEntry folder;
+} ContinuationEntry;
+
+typedef struct{
+  ContinuationEntry *array;
+  size_t used;
+  size_t size;
+} ContinuationArray;
 
-    char *context = lookup_nodeId2path_cache( folder );
-    if (!context) {
-        return "unable to find path by nodeId";
+static char *insertContinuationArray(ContinuationArray *a, UA_ByteString *continuationPoint, RefArrayEntry *folder) {
+    if (a->used >= a->size) {
+        a->size = a->size ? a->size * 2 : 16;
+        a->array = realloc(a->array, a->size * sizeof(ContinuationEntry));
+        if (!a->array) return "out of memory";
     }
 
-    size_t length = strlen(context) + 1 + strlen(name);
-    *path = malloc(length + 1);
-    if (!*path) return "out of memory";
+    // The continuation point is moved from the response
+    a->array[a->used].continuationPoint = *continuationPoint;
+    UA_ByteString_init( continuationPoint );
+    a->array[a->used].folder = *folder;
 
-    sprintf(*path,"%s/%s",context, name);
-    (*path)[length] = '\0';
+    a->used++;
+
+    return NULL;
+}
+
+static void freeContinuationArray(ContinuationArray *a){
+    for (size_t i = 0; i < a->used; i++){
+        UA_ByteString_clear( &a->array[i].continuationPoint );
+    }
+    free(a->array);
+    a->array = NULL;
+    a->size = 0;
+    a->used = 0;
+}
 
+//-----------------------------------------------------
+//  Seen nodes
+//-----------------------------------------------------
+// Cached nodes found by a refresh, everything else under the refreshed
+// folder is gone from the server
+typedef struct{
+  UA_NodeId *nodeId;
+  UT_hash_handle hh;
+} SeenEntry;
+
+static char *insertSeen(SeenEntry **seen, UA_NodeId *nodeId){
+    SeenEntry *entry = malloc( sizeof(SeenEntry) );
+    if (!entry) return "out of memory";
+    entry->nodeId = nodeId;
+    HASH_ADD_PTR(*seen, nodeId, entry);
     return NULL;
 }
 
+static bool isSeen(SeenEntry *seen, UA_NodeId *nodeId){
+    SeenEntry *entry = NULL;
+    HASH_FIND_PTR(seen, &nodeId, entry);
+    return entry != NULL;
+}
+
+static void freeSeen(SeenEntry **seen){
+    SeenEntry *entry, *tmp;
+    HASH_ITER(hh, *seen, entry, tmp) {
+        HASH_DEL(*seen, entry);
+        free( entry );
+    }
+    *seen = NULL;
+}
+
 //---------------------------------------------------------------------------
 //  Build Browse Cache
 //---------------------------------------------------------------------------
-static char *build_browse_cache_inner(UA_Client *client, RefArray *folders, size_t maxNodesPerBrowse){
+// The address space is crawled breadth-first. Folders waiting to be browsed
+// are kept in the queue, up to maxRequests Browse requests are in flight at
+// the same time, children found in the responses are added to the cache and
+// to the tail of the queue. If the server returns a continuation point for
+// a large folder the rest of its references is requested with BrowseNext.
+typedef struct{
+  // The 'Objects' folder, its children are top level items
+  UA_NodeId root;
+  RefArray queue;
+  ContinuationArray continuations;
+  size_t inflight;
+  // Continuation points held by the server, including the ones in flight
+  size_t heldContinuations;
+  size_t maxNodesPerBrowse;
+  size_t maxRequests;
+  UA_UInt32 maxReferencesPerNode;
+  // Refresh mode, known nodes are browsed again and marked as seen
+  bool refresh;
+  SeenEntry *seen;
+  // Known paths that point to another node now
+  size_t replaced;
+  // Folders browsed again after a transient error
+  size_t retries;
+  char *error;
+  opcua_cache *cache;
+  // Waits for the responses instead of the client if defined
+  crawl_wait_handler wait;
+  void *context;
+  // The crawler has been abandoned with requests in flight,
+  // the last response frees it
+  bool orphan;
+} BrowseCrawler;
 
-    char *error = NULL;
+typedef struct{
+  BrowseCrawler *crawler;
+  // BrowseNext releases continuation points it was sent with
+  bool isNext;
+  size_t size;
+  RefArrayEntry folders[];
+} BrowseBatch;
+
+static void freeCrawler(BrowseCrawler *crawler){
+    freeRefArray( &crawler->queue );
+    freeContinuationArray( &crawler->continuations );
+    freeSeen( &crawler->seen );
+    free( crawler );
+}
 
-    // Build the request
-    UA_BrowseRequest request;
-    UA_BrowseResponse response;
+// A folder failed with a transient status is browsed again, the limit
+// stops the crawl if the server does not recover
+#define MAX_BROWSE_RETRIES 16
+
+static bool is_transient_status(UA_StatusCode sc){
+    return sc == UA_STATUSCODE_BADNOCONTINUATIONPOINTS
+        || sc == UA_STATUSCODE_BADCONTINUATIONPOINTINVALID
+        || sc == UA_STATUSCODE_BADTOOMANYOPERATIONS
+        || sc == UA_STATUSCODE_BADTIMEOUT
+        || sc == UA_STATUSCODE_BADRESOURCEUNAVAILABLE
+        || sc == UA_STATUSCODE_BADOUTOFMEMORY;
+}
 
-    UA_BrowseRequest_init(&request);
-    UA_BrowseResponse_init(&response);
+static char *folder_path(BrowseCrawler *crawler, RefArrayEntry *folder){
+    if (folder->nodeId == &crawler->root) return "Objects";
+    char *path = lookup_nodeId2path_cache( crawler->cache, folder->nodeId );
+    return path ? path : "unknown folder";
+}
 
-    // Found subfolders
-    RefArray subfolders; subfolders.used = 0;
-    error = initRefArray(&subfolders, 500);
-    if (error) goto on_clear;
+// The refresh has not browsed the folder, its cached subtree is kept
+// as it is instead of being swept as gone
+static char *keep_subtree(BrowseCrawler *crawler, RefArrayEntry *folder){
+    char *error = NULL;
+    UA_NodeId *folderId = folder->nodeId == &crawler->root ? NULL : folder->nodeId;
+
+    size_t size = get_cache_size(crawler->cache);
+    opcua_item item;
+    for (size_t i = 0; i < size; i++){
+        if (!get_cache_item(crawler->cache, i, &item)) continue;
+        if (item.nodeId == folderId || isSeen(crawler->seen, item.nodeId)) continue;
+        if (!in_subtree_cache(crawler->cache, folderId, item.nodeId)) continue;
+        error = insertSeen(&crawler->seen, item.nodeId);
+        if (error) return error;
+    }
+    return NULL;
+}
 
-    // Set the limit
-    size_t limit = maxNodesPerBrowse;
-    if (limit == 0 || folders->used < limit) limit = folders->used;
-
-    //----------------Folders cycle----------------------------------
-    for (size_t shift = 0; shift < folders->used; shift += limit){
-        // TODO. The limit can be defined at the server, we have to handle it
-        request.requestedMaxReferencesPerNode = 0;
-
-        // Configure the request
-        size_t size = folders->used - shift;
-        if (size > limit) size = limit;
-
-        request.nodesToBrowse = UA_Array_new(size, &UA_TYPES[UA_TYPES_BROWSEDESCRIPTION]);
-        request.nodesToBrowseSize = size;
-
-        for(size_t i = 0; i < size; ++i) {
-            // Take only folders and variables
-            request.nodesToBrowse[i].nodeClassMask = UA_NODECLASS_OBJECT | UA_NODECLASS_VARIABLE;
-            request.nodesToBrowse[i].includeSubtypes = true;
-            request.nodesToBrowse[i].referenceTypeId = UA_NODEID_NUMERIC(0, UA_NS0ID_HIERARCHICALREFERENCES);
-            UA_NodeId_copy(folders->array[i + shift].nodeId, &request.nodesToBrowse[i].nodeId);
-            request.nodesToBrowse[i].resultMask = UA_BROWSERESULTMASK_BROWSENAME | UA_BROWSERESULTMASK_NODECLASS;
+// The folder with the bad result has not returned all its references,
+// it is either browsed again or the crawl fails
+static char *handle_browse_status(BrowseCrawler *crawler, RefArrayEntry *folder, UA_StatusCode sc){
+    char *status = (char*)UA_StatusCode_name( sc );
+
+    if (sc == UA_STATUSCODE_BADNOCONTINUATIONPOINTS && crawler->heldContinuations){
+        // The server is out of continuation points, try the folder again
+        // when the points in use are released
+        LOGDEBUG("no continuation points for %s, browse the folder later", folder_path(crawler, folder));
+        return insertRefArray(&crawler->queue, folder->nodeId, folder->nodeClass);
+    }
+
+    if (is_transient_status(sc)){
+        if (crawler->retries >= MAX_BROWSE_RETRIES){
+            LOGERROR("unable to browse %s: %s", folder_path(crawler, folder), status);
+            return status;
         }
+        crawler->retries++;
+        LOGWARNING("browse %s again: %s", folder_path(crawler, folder), status);
+        return insertRefArray(&crawler->queue, folder->nodeId, folder->nodeClass);
+    }
+
+    // The folder is gone or not available to the user
+    LOGWARNING("unable to browse %s: %s", folder_path(crawler, folder), status);
+    return crawler->refresh ? keep_subtree(crawler, folder) : NULL;
+}
+
+static char *handle_browse_results(BrowseCrawler *crawler, BrowseBatch *batch, UA_ResponseHeader *header, size_t resultsSize, UA_BrowseResult *results){
+    char *error = NULL;
+
+    if (header->serviceResult != UA_STATUSCODE_GOOD){
+        return (char*)UA_StatusCode_name( header->serviceResult );
+    }
+    if (resultsSize != batch->size){
+        return "invalid response results size";
+    }
 
-        // Trigger the request
-        response = UA_Client_Service_browse(client, request);
-        if (response.responseHeader.serviceResult != UA_STATUSCODE_GOOD){
-            error = (char*)UA_StatusCode_name( response.responseHeader.serviceResult );
-            goto on_clear;
+    //---------------results cycle------------------------------
+    for(size_t i = 0; i < resultsSize; ++i) {
+        RefArrayEntry *folder = &batch->folders[i];
+        UA_BrowseResult *result = &results[i];
+
+        if (result->statusCode != UA_STATUSCODE_GOOD){
+            error = handle_browse_status(crawler, folder, result->statusCode);
+            if (error) return error;
+            continue;
         }
 
-        //---------------results cycle------------------------------
-        for(size_t i = 0; i < response.resultsSize; ++i) {
-            for(size_t j = 0; j < response.results[i].referencesSize; ++j) {
+        for(size_t j = 0; j < result->referencesSize; ++j) {
 
-                UA_ReferenceDescription *ref = &response.results[i].references[j];
-                
-                // Should we shows objects inside variables? 
-                if (ref->nodeClass == UA_NODECLASS_OBJECT && folders->array[i + shift].nodeClass == UA_NODECLASS_VARIABLE)
-                    continue;
+            UA_ReferenceDescription *ref = &result->references[j];
+
+            // Should we shows objects inside variables?
+            if (ref->nodeClass == UA_NODECLASS_OBJECT && folder->nodeClass == UA_NODECLASS_VARIABLE)
+                continue;
+
+            // The browse name is not null terminated
+            char name[ref->browseName.name.length + 1];
+            memcpy(name, ref->browseName.name.data, ref->browseName.name.length);
+            name[ref->browseName.name.length] = '\0';
+
+            UA_NodeId *parent = folder->nodeId == &crawler->root ? NULL : folder->nodeId;
 
-                char *name = (char *)ref->browseName.name.data;
-                char *path = NULL;
-                error = getNodePath(folders->array[i + shift].nodeId, name, &path);
-                if (error) goto on_clear;
-                
-                // Check if the node already in
-                UA_NodeId *exists = lookup_path2nodeId_cache( path );
-                if(exists) continue;
-
-                UA_NodeId *nodeIdCopy = UA_NodeId_new();
-                UA_StatusCode sc = UA_NodeId_copy(&ref->nodeId.nodeId, nodeIdCopy);
-                if (sc != UA_STATUSCODE_GOOD){
-                    error = (char*)UA_StatusCode_name( sc );
-                    goto on_clear;
+            // Check if the node already in
+            UA_NodeId *exists = lookup_child_cache( crawler->cache, parent, name );
+            if(exists && !crawler->refresh) continue;
+
+            if(exists){
+                // A loop in the hierarchy or the replaced node, its old subtree
+                // is not marked as seen and it is added again by the next pass
+                if (isSeen(crawler->seen, exists)) continue;
+                if (!UA_NodeId_equal(exists, &ref->nodeId.nodeId)){
+                    crawler->replaced++;
+                    continue;
                 }
 
-                error = add_cache(path, nodeIdCopy, ref->nodeClass);
-                if (error) goto on_clear; 
+                error = insertSeen(&crawler->seen, exists);
+                if (error) return error;
+
+                // Look for changes deeper
+                error = insertRefArray(&crawler->queue, exists, ref->nodeClass);
+                if (error) return error;
+                continue;
+            }
+
+            UA_NodeId *cached = NULL;
+            error = add_cache(crawler->cache, parent, name, &ref->nodeId.nodeId, ref->nodeClass, &cached);
+            if (error) return error;
 
-                // Add children recursively
-                error = insertRefArray(&subfolders, name, nodeIdCopy, ref->nodeClass);
-                if (error) goto on_clear;
+            if (crawler->refresh){
+                LOGDEBUG("new node %s", lookup_nodeId2path_cache( crawler->cache, cached ));
+                error = insertSeen(&crawler->seen, cached);
+                if (error) return error;
             }
-        }   
-        //---------------results cycle end------------------------------
 
-        // Prepare fro the next step
-        UA_BrowseRequest_clear(&request);
-        UA_BrowseResponse_clear(&response);
-        UA_BrowseRequest_init(&request);
-        UA_BrowseResponse_init(&response);
+            // Browse children later
+            error = insertRefArray(&crawler->queue, cached, ref->nodeClass);
+            if (error) return error;
+        }
+
+        // The folder has more references
+        if (result->continuationPoint.length){
+            error = insertContinuationArray(&crawler->continuations, &result->continuationPoint, folder);
+            if (error) return error;
+            crawler->heldContinuations++;
+        }
     }
-    //---------------folders cycle end------------------------------
+    //---------------results cycle end------------------------------
+
+    return NULL;
+}
 
-    if (subfolders.used){
-        error = build_browse_cache_inner(client, &subfolders, maxNodesPerBrowse );
-        if (error) goto on_clear;
+static void on_browse_batch_done(BrowseCrawler *crawler, BrowseBatch *batch){
+    crawler->inflight--;
+    if (batch->isNext) crawler->heldContinuations -= batch->size;
+    free( batch );
+
+    if (crawler->orphan && !crawler->inflight){
+        freeCrawler( crawler );
     }
+}
+
+static void on_browse_response(UA_Client *client, void *userdata, UA_UInt32 requestId, UA_BrowseResponse *response){
+    BrowseBatch *batch = (BrowseBatch *)userdata;
+    BrowseCrawler *crawler = batch->crawler;
+
+    if (!crawler->error){
+        crawler->error = handle_browse_results(crawler, batch, &response->responseHeader, response->resultsSize, response->results);
+    }
+    on_browse_batch_done(crawler, batch);
+}
+
+static void on_browse_next_response(UA_Client *client, void *userdata, UA_UInt32 requestId, void *r){
+    UA_BrowseNextResponse *response = (UA_BrowseNextResponse *)r;
+    BrowseBatch *batch = (BrowseBatch *)userdata;
+    BrowseCrawler *crawler = batch->crawler;
+
+    if (!crawler->error){
+        crawler->error = handle_browse_results(crawler, batch, &response->responseHeader, response->resultsSize, response->results);
+    }
+    on_browse_batch_done(crawler, batch);
+}
+
+static BrowseBatch *new_browse_batch(BrowseCrawler *crawler, size_t size, bool isNext){
+    BrowseBatch *batch = malloc( sizeof(BrowseBatch) + size * sizeof(RefArrayEntry) );
+    if (!batch) return NULL;
+    batch->crawler = crawler;
+    batch->isNext = isNext;
+    batch->size = size;
+    return batch;
+}
+
+static size_t browse_batch_size(BrowseCrawler *crawler, size_t pending){
+    size_t size = pending;
+    if (crawler->maxNodesPerBrowse){
+        if (size > crawler->maxNodesPerBrowse) size = crawler->maxNodesPerBrowse;
+    }else{
+        // No limit, share the pending nodes between free request slots
+        size_t slots = crawler->maxRequests - crawler->inflight;
+        size = (size + slots - 1) / slots;
+    }
+    return size;
+}
+
+static char *send_browse_request(UA_Client *client, BrowseCrawler *crawler){
+    char *error = NULL;
+
+    UA_BrowseRequest request;
+    UA_BrowseRequest_init(&request);
+
+    // Configure the request
+    size_t size = browse_batch_size(crawler, crawler->queue.used);
+
+    BrowseBatch *batch = new_browse_batch(crawler, size, false);
+    if (!batch) return "out of memory";
+    memcpy(batch->folders, crawler->queue.array, size * sizeof(RefArrayEntry));
+
+    // 0 lets the server decide, if a folder has more references
+    // the server returns a continuation point
+    request.requestedMaxReferencesPerNode = crawler->maxReferencesPerNode;
+
+    request.nodesToBrowse = UA_Array_new(size, &UA_TYPES[UA_TYPES_BROWSEDESCRIPTION]);
+    if (!request.nodesToBrowse){
+        error = "out of memory";
+        goto on_error;
+    }
+    request.nodesToBrowseSize = size;
+
+    for(size_t i = 0; i < size; ++i) {
+        // Take only folders and variables
+        request.nodesToBrowse[i].nodeClassMask = UA_NODECLASS_OBJECT | UA_NODECLASS_VARIABLE;
+        request.nodesToBrowse[i].includeSubtypes = true;
+        request.nodesToBrowse[i].referenceTypeId = UA_NODEID_NUMERIC(0, UA_NS0ID_HIERARCHICALREFERENCES);
+        UA_NodeId_copy(batch->folders[i].nodeId, &request.nodesToBrowse[i].nodeId);
+        request.nodesToBrowse[i].resultMask = UA_BROWSERESULTMASK_BROWSENAME | UA_BROWSERESULTMASK_NODECLASS;
+    }
+
+    // Trigger the request
+    UA_StatusCode sc = UA_Client_sendAsyncBrowseRequest(client, &request, on_browse_response, batch, NULL);
+    if (sc != UA_STATUSCODE_GOOD){
+        error = (char*)UA_StatusCode_name( sc );
+        goto on_error;
+    }
+
+    crawler->inflight++;
+    shiftRefArray(&crawler->queue, size);
 
-on_clear:
-    // Clear the main request/response
     UA_BrowseRequest_clear(&request);
-    UA_BrowseResponse_clear(&response);
-    freeRefArray( &subfolders );
+    return NULL;
+
+on_error:
+    UA_BrowseRequest_clear(&request);
+    free( batch );
     return error;
 }
 
+static char *send_browse_next_request(UA_Client *client, BrowseCrawler *crawler){
+    char *error = NULL;
+
+    UA_BrowseNextRequest request;
+    UA_BrowseNextRequest_init(&request);
+
+    ContinuationArray *continuations = &crawler->continuations;
+    size_t size = browse_batch_size(crawler, continuations->used);
+
+    BrowseBatch *batch = new_browse_batch(crawler, size, true);
+    if (!batch) return "out of memory";
+
+    request.continuationPoints = UA_Array_new(size, &UA_TYPES[UA_TYPES_BYTESTRING]);
+    if (!request.continuationPoints){
+        error = "out of memory";
+        goto on_error;
+    }
+    request.continuationPointsSize = size;
+    request.releaseContinuationPoints = false;
+
+    // Take the points from the tail, the request owns them from now on
+    for(size_t i = 0; i < size; ++i) {
+        ContinuationEntry *entry = &continuations->array[continuations->used - size + i];
+        request.continuationPoints[i] = entry->continuationPoint;
+        batch->folders[i] = entry->folder;
+    }
+    continuations->used -= size;
+
+    UA_StatusCode sc = __UA_Client_AsyncService(client, &request, &UA_TYPES[UA_TYPES_BROWSENEXTREQUEST],
+        on_browse_next_response, &UA_TYPES[UA_TYPES_BROWSENEXTRESPONSE], batch, NULL);
+    if (sc != UA_STATUSCODE_GOOD){
+        error = (char*)UA_StatusCode_name( sc );
+        goto on_error;
+    }
+
+    crawler->inflight++;
+
+    UA_BrowseNextRequest_clear(&request);
+    return NULL;
+
+on_error:
+    UA_BrowseNextRequest_clear(&request);
+    free( batch );
+    return error;
+}
+
+// The server operation limits are read once on connect,
+// 0 stays for no limit
+size_t read_browse_limits(UA_Client *client){
+    UA_UInt32 limit = 0;
+
+    UA_Variant value;
+    UA_Variant_init(&value);
+    UA_StatusCode sc = UA_Client_readValueAttribute(client,
+        UA_NODEID_NUMERIC(0, UA_NS0ID_SERVER_SERVERCAPABILITIES_OPERATIONLIMITS_MAXNODESPERBROWSE),
+        &value);
+
+    if (sc == UA_STATUSCODE_GOOD && UA_Variant_hasScalarType(&value, &UA_TYPES[UA_TYPES_UINT32])){
+        limit = *(UA_UInt32 *)value.data;
+    }
+    UA_Variant_clear(&value);
+
+    LOGDEBUG("server MaxNodesPerBrowse %u", limit);
+    return limit;
+}
+
+static BrowseCrawler *new_crawler(UA_Client *client, opcua_cache *cache, size_t maxNodesPerBrowse, size_t maxRequests, size_t maxReferencesPerNode){
+
+    BrowseCrawler *crawler = malloc( sizeof(BrowseCrawler) );
+    if (!crawler) return NULL;
+
+    crawler->continuations.array = NULL;
+    crawler->continuations.used = 0;
+    crawler->continuations.size = 0;
+    crawler->root = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
+    crawler->inflight = 0;
+    crawler->heldContinuations = 0;
+    crawler->maxNodesPerBrowse = maxNodesPerBrowse;
+    crawler->maxRequests = maxRequests ? maxRequests : 1;
+    crawler->maxReferencesPerNode = (UA_UInt32)maxReferencesPerNode;
+    crawler->refresh = false;
+    crawler->seen = NULL;
+    crawler->replaced = 0;
+    crawler->retries = 0;
+    crawler->error = NULL;
+    crawler->orphan = false;
+    crawler->cache = cache;
+    crawler->wait = NULL;
+    crawler->context = NULL;
+
+    if (initRefArray(&crawler->queue, 500)){
+        free( crawler );
+        return NULL;
+    }
+
+    return crawler;
+}
+
+// Crawl from the folders in the queue until there is nothing to browse
+static char *run_crawler(UA_Client *client, BrowseCrawler *crawler){
+    char *error = NULL;
+
+    //----------------Crawler cycle----------------------------------
+    while ( crawler->queue.used || crawler->continuations.used || crawler->inflight ){
+
+        // Keep the pipeline full, continuation points go first
+        // to release the server resources as soon as possible
+        while (crawler->inflight < crawler->maxRequests){
+            if (crawler->continuations.used){
+                error = send_browse_next_request(client, crawler);
+            }else if (crawler->queue.used){
+                error = send_browse_request(client, crawler);
+            }else{
+                break;
+            }
+            if (error) return error;
+        }
+
+        // Wait for responses
+        UA_StatusCode sc;
+        if (crawler->wait){
+            error = crawler->wait( crawler->context );
+            if (error) return error;
+            sc = UA_Client_run_iterate(client, 0);
+        }else{
+            sc = UA_Client_run_iterate(client, 100);
+        }
+        if (sc != UA_STATUSCODE_GOOD){
+            return (char*)UA_StatusCode_name( sc );
+        }
+
+        if (crawler->error) return crawler->error;
+    }
+    //---------------crawler cycle end------------------------------
+
+    return NULL;
+}
+
+static void release_crawler(BrowseCrawler *crawler, char *error){
+    if (crawler->inflight){
+        // Responses may still come, the crawler is released by the last one
+        crawler->error = error;
+        crawler->orphan = true;
+    }else{
+        freeCrawler( crawler );
+    }
+}
+
+// Remove the nodes under the folder that are not seen by the refresh,
+// NULL folder stays for 'Objects'
+static void sweep_subtree(opcua_cache *cache, UA_NodeId *folder, SeenEntry *seen, bool withFolder, remove_cache_handler remove, void *context){
+    size_t size = get_cache_size(cache);
+    opcua_item item;
+    for (size_t i = 0; i < size; i++){
+        if (!get_cache_item(cache, i, &item)) continue;
+        if (item.nodeId == folder && !withFolder) continue;
+        if (!in_subtree_cache(cache, folder, item.nodeId) || isSeen(seen, item.nodeId)) continue;
+        LOGDEBUG("node %s is removed", lookup_nodeId2path_cache( cache, item.nodeId ));
+        remove( context, item.nodeId );
+    }
+}
+
 //---------------------------------------------------------------------------
 //  API
 //---------------------------------------------------------------------------
-char *build_browse_cache(UA_Client *client, size_t maxNodesPerBrowse){
-    char *error;
+char *build_browse_cache(UA_Client *client, opcua_cache *cache, size_t maxNodesPerBrowse, size_t maxRequests, size_t maxReferencesPerNode){
+    char *error = NULL;
+
+    BrowseCrawler *crawler = new_crawler(client, cache, maxNodesPerBrowse, maxRequests, maxReferencesPerNode);
+    if (!crawler) return "out of memory";
 
-    // Init folders array with 'Objects' folder
-    RefArray folders;
-    error = initRefArray(&folders, 1);
+    // Init the queue with 'Objects' folder
+    error = insertRefArray(&crawler->queue, &crawler->root, UA_NODECLASS_OBJECT);
     if(error) goto on_clear;
-    UA_NodeId root = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
-    error = insertRefArray(&folders, "", &root, UA_NODECLASS_OBJECT);
+
+    error = run_crawler(client, crawler);
+
+on_clear:
+    release_crawler(crawler, error);
+    return error;
+}
+
+// Browse the folder subtree again. New nodes are added to the cache,
+// the nodes that are gone are passed to the remove handler.
+// The failed crawl removes nothing, the subtrees of the folders
+// that are not browsed are not swept. NULL folder refreshes the whole cache
+char *refresh_browse_cache(UA_Client *client, opcua_cache *cache, UA_NodeId *folder, size_t maxNodesPerBrowse, size_t maxRequests, size_t maxReferencesPerNode, remove_cache_handler remove, crawl_wait_handler wait, void *context){
+    char *error = NULL;
+
+    BrowseCrawler *crawler = new_crawler(client, cache, maxNodesPerBrowse, maxRequests, maxReferencesPerNode);
+    if (!crawler) return "out of memory";
+    crawler->refresh = true;
+    crawler->wait = wait;
+    crawler->context = context;
+
+    // The folder must be owned by the cache to resolve the children paths
+    UA_NodeId *folderId = folder ? folder : &crawler->root;
+    int folderClass = folder ? lookup_nodeClass_cache( cache, folder ) : UA_NODECLASS_OBJECT;
+
+    error = insertRefArray(&crawler->queue, folderId, folderClass);
     if(error) goto on_clear;
 
-    error = build_browse_cache_inner(client, &folders, maxNodesPerBrowse);
+    error = run_crawler(client, crawler);
     if (error) goto on_clear;
 
+    sweep_subtree(cache, folder, crawler->seen, false, remove, context);
+
+    if (crawler->replaced){
+        // Replaced nodes are removed by the sweep, now they can be added again
+        LOGDEBUG("%zu nodes are replaced, browse again", crawler->replaced);
+        freeSeen( &crawler->seen );
+        crawler->replaced = 0;
+        error = insertRefArray(&crawler->queue, folderId, folderClass);
+        if(error) goto on_clear;
+        error = run_crawler(client, crawler);
+    }
+
 on_clear:
-    freeRefArray( &folders );
+    release_crawler(crawler, error);
     return error;
 }
 
+// Remove the node and its subtree from the cache
+void drop_browse_cache(opcua_cache *cache, UA_NodeId *folder, remove_cache_handler remove, void *context){
+    sweep_subtree(cache, folder, NULL, true, remove, context);
+}
+
 // Lookup nodeId by its path
-char *path2nodeId( char *path, UA_NodeId *nodeId ){
+char *path2nodeId( opcua_cache *cache, char *path, UA_NodeId *nodeId ){
     // Cached version
-    UA_NodeId *cached = lookup_path2nodeId_cache( path );
+    UA_NodeId *cached = lookup_path2nodeId_cache( cache, path );
     if (!cached){
         return "invalid node";
     }
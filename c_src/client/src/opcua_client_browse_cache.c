@@ -15,122 +15,1154 @@
 * specific language governing permissions and limitations
 * under the License.
 ----------------------------------------------------------------*/
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <regex.h>
 
 #include <uthash.h>
 #include <open62541/types_generated_handling.h>
 
 #include "opcua_client_browse_cache.h"
+//-----------------------------------------------------
+//  Arena
+//-----------------------------------------------------
+// Entries, names and NodeId identifiers are allocated from big blocks
+// released all at once by purge_cache. Entry chunks never move, so pointers
+// returned by lookups are valid until the purge. Names and identifiers
+// have their own arena that compact_cache builds again without the removed entries
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct arena_block{
+  struct arena_block *next;
+  size_t used;
+  size_t size;
+  char data[];
+} arena_block;
+
+
+static void *arena_alloc(arena_block **arena, size_t size){
+    size = (size + 7) & ~(size_t)7;
+
+    if (!*arena || (*arena)->used + size > (*arena)->size){
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block *block = malloc( sizeof(arena_block) + blockSize );
+        if (!block) return NULL;
+        block->next = *arena;
+        block->used = 0;
+        block->size = blockSize;
+        *arena = block;
+    }
+
+    void *p = (*arena)->data + (*arena)->used;
+    (*arena)->used += size;
+    return p;
+}
+
+static void *arena_copy(arena_block **arena, const void *data, size_t size){
+    void *p = arena_alloc(arena, size);
+    if (p) memcpy(p, data, size);
+    return p;
+}
+
+static void arena_reset(arena_block **arena){
+    while (*arena){
+        arena_block *next = (*arena)->next;
+        free( *arena );
+        *arena = next;
+    }
+}
+
 //-----------------------------------------------------
 //  Cache
 //-----------------------------------------------------
-typedef struct {
-  char *path;
-  UA_NodeId *nodeId;
-  int nodeClass;
-  UT_hash_handle hh;
-} opcua_client_path2nodeId_cache;
+// The path of an entry is not stored, it is the path of the parent
+// and the name. Entries are kept in chunks to never move them.
+// Children are linked to their parent, that makes a path trie
+// to walk subtrees without looking at the rest of the cache
+#define ENTRIES_CHUNK 4096
+#define NO_PARENT UINT32_MAX
+#define NO_ENTRY UINT32_MAX
 
 typedef struct {
-  UA_NodeId *nodeId;
-  char *path;
+  UA_NodeId nodeId;
+  uint32_t index;
+  uint32_t parent;
+  uint32_t firstChild;
+  uint32_t nextSibling;
+  // FNV-1a of the full path
+  uint32_t hash;
+  uint32_t nodeIdHash;
+  char *name;
+  // The last known value
+  UA_DataValue *value;
+  UA_DateTime updated;
+  UA_Byte nodeClass;
+  bool monitored;
+  bool removed;
+} cache_entry;
+
+#define NODEID_ENTRY(p) ((cache_entry *)((char *)(p) - offsetof(cache_entry, nodeId)))
+
+typedef struct trigram_entry trigram_entry;
+
+struct opcua_cache{
+  arena_block *arena;
+  arena_block *names;
+  cache_entry **chunks;
+  size_t chunksSize;
+  uint32_t count;
+  // Top level entries, including the ones with unknown parents
+  uint32_t firstRoot;
+  // Open addressing tables of entry indexes + 1 by the path hash
+  // and by the NodeId hash, 0 is a free slot. Both have the same size
+  uint32_t *paths;
+  uint32_t *nodeIds;
+  size_t pathsSize;
+  trigram_entry *trigrams;
+  // Removed entries since the last compaction
+  uint32_t removed;
+  // Reclaimed slots in the ascending order, the last one is reused first
+  uint32_t *slots;
+  uint32_t slotsUsed;
+  // The update loop thread changes the indexes when the server reports
+  // model changes while the eport thread looks them up
+  pthread_rwlock_t lock;
+  // Changed with every added, removed or purged entry
+  uint64_t generation;
+  // Values are updated by the update loop thread and read by the eport thread
+  pthread_mutex_t valuesLock;
+  // The last time the subscription was known to be alive
+  UA_DateTime valuesAlive;
+};
+
+// Paths are built on demand in a per thread buffer
+static __thread char *__path_buffer = NULL;
+static __thread size_t __path_capacity = 0;
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+static uint32_t hash_continue(uint32_t hash, const char *s){
+    for (; *s; s++){
+        hash ^= (unsigned char)*s;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static inline cache_entry *entry_at(opcua_cache *cache, uint32_t index){
+    return &cache->chunks[index / ENTRIES_CHUNK][index % ENTRIES_CHUNK];
+}
+
+// Compare the entry path to the string from the tail
+static bool entry_equal(opcua_cache *cache, cache_entry *entry, const char *path, size_t length){
+    size_t end = length;
+    for(;;){
+        size_t n = strlen(entry->name);
+        if (n > end || memcmp(path + end - n, entry->name, n)) return false;
+        end -= n;
+        if (entry->parent == NO_PARENT) return end == 0;
+        if (end == 0 || path[end - 1] != '/') return false;
+        end--;
+        entry = entry_at(cache, entry->parent);
+    }
+}
+
+// The caller must hold the lock
+static cache_entry *find_path(opcua_cache *cache, const char *path){
+    if (!cache->pathsSize) return NULL;
+
+    uint32_t hash = hash_continue(FNV_OFFSET, path);
+    size_t length = strlen(path);
+    size_t mask = cache->pathsSize - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask){
+        uint32_t slot = cache->paths[i];
+        if (!slot) return NULL;
+        cache_entry *entry = entry_at(cache, slot - 1);
+        if (entry->hash == hash && !entry->removed && entry_equal(cache, entry, path, length)) return entry;
+    }
+}
+
+// The caller must hold the lock
+static cache_entry *find_nodeId(opcua_cache *cache, const UA_NodeId *nodeId){
+    if (!cache->pathsSize) return NULL;
+
+    uint32_t hash = UA_NodeId_hash( nodeId );
+    size_t mask = cache->pathsSize - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask){
+        uint32_t slot = cache->nodeIds[i];
+        if (!slot) return NULL;
+        cache_entry *entry = entry_at(cache, slot - 1);
+        if (entry->nodeIdHash == hash && !entry->removed && UA_NodeId_equal(&entry->nodeId, nodeId)) return entry;
+    }
+}
+
+static void insert_slot(uint32_t *table, size_t size, uint32_t hash, cache_entry *entry){
+    size_t mask = size - 1;
+    size_t i = hash & mask;
+    while (table[i]) i = (i + 1) & mask;
+    table[i] = entry->index + 1;
+}
+
+// Keep the tables at most half full, removed entries are dropped on the way.
+// The caller must hold the lock
+static char *grow_indexes(opcua_cache *cache){
+    if ((size_t)(cache->count + 1) * 2 <= cache->pathsSize) return NULL;
+
+    size_t size = cache->pathsSize ? cache->pathsSize * 2 : 1024;
+    uint32_t *paths = calloc(size, sizeof(uint32_t));
+    uint32_t *nodeIds = calloc(size, sizeof(uint32_t));
+    if (!paths || !nodeIds){
+        free( paths );
+        free( nodeIds );
+        return "out of memory";
+    }
+
+    for (uint32_t i = 0; i < cache->count; i++){
+        cache_entry *entry = entry_at(cache, i);
+        if (entry->removed) continue;
+        insert_slot(paths, size, entry->hash, entry);
+        insert_slot(nodeIds, size, entry->nodeIdHash, entry);
+    }
+
+    free( cache->paths );
+    free( cache->nodeIds );
+    cache->paths = paths;
+    cache->nodeIds = nodeIds;
+    cache->pathsSize = size;
+    return NULL;
+}
+
+// The path of the entry followed by the name, both are optional.
+// The caller must hold the lock
+static char *build_path(opcua_cache *cache, cache_entry *entry, const char *name){
+    size_t nameLength = name ? strlen(name) : 0;
+    size_t length = nameLength;
+    for (cache_entry *e = entry; e; e = e->parent == NO_PARENT ? NULL : entry_at(cache, e->parent)){
+        length += strlen(e->name) + 1;
+    }
+    if (!name && length) length--;
+
+    if (length + 1 > __path_capacity){
+        size_t capacity = __path_capacity ? __path_capacity : 256;
+        while (capacity < length + 1) capacity *= 2;
+        char *buffer = realloc(__path_buffer, capacity);
+        if (!buffer) return NULL;
+        __path_buffer = buffer;
+        __path_capacity = capacity;
+    }
+
+    char *tail = __path_buffer + length;
+    *tail = '\0';
+    if (name){
+        tail -= nameLength;
+        memcpy(tail, name, nameLength);
+        if (entry) *(--tail) = '/';
+    }
+    for (cache_entry *e = entry; e; e = e->parent == NO_PARENT ? NULL : entry_at(cache, e->parent)){
+        size_t n = strlen(e->name);
+        tail -= n;
+        memcpy(tail, e->name, n);
+        if (e->parent != NO_PARENT) *(--tail) = '/';
+    }
+
+    return __path_buffer;
+}
+
+static bool has_string_identifier(const UA_NodeId *nodeId){
+    return (nodeId->identifierType == UA_NODEIDTYPE_STRING || nodeId->identifierType == UA_NODEIDTYPE_BYTESTRING)
+        && nodeId->identifier.string.length;
+}
+
+// The identifier is copied to the arena too
+static char *copy_nodeId(opcua_cache *cache, const UA_NodeId *src, UA_NodeId *dst){
+    *dst = *src;
+    if (has_string_identifier(src)){
+        dst->identifier.string.data = arena_copy(&cache->names, src->identifier.string.data, src->identifier.string.length);
+        if (!dst->identifier.string.data) return "out of memory";
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------
+//  Trigram index
+//-----------------------------------------------------
+// Every entry is indexed by the trigrams of its segment, that is the name
+// preceded by the slash and the last two characters of the parent path.
+// A substring first appears in the path of some entry, so its tail up
+// to two characters before its last slash is within the segment of that entry.
+// Postings are sorted, an entry in a reused slot is inserted before the later ones
+struct trigram_entry{
+  uint32_t trigram;
+  uint32_t *postings;
+  uint32_t used;
+  uint32_t size;
   UT_hash_handle hh;
-} opcua_client_nodeId2path_cache;
+};
+
+#define TRIGRAM(s) (((uint32_t)(unsigned char)(s)[0] << 16) | ((uint32_t)(unsigned char)(s)[1] << 8) | (unsigned char)(s)[2])
+
+// The first posting not less than the index
+static uint32_t posting_position(trigram_entry *entry, uint32_t index){
+    uint32_t low = 0, high = entry->used;
+    while (low < high){
+        uint32_t middle = low + (high - low) / 2;
+        if (entry->postings[middle] < index){
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    return low;
+}
 
+static char *add_posting(opcua_cache *cache, uint32_t trigram, uint32_t index){
+    trigram_entry *entry = NULL;
+    HASH_FIND_INT(cache->trigrams, &trigram, entry);
+    if (!entry){
+        entry = calloc(1, sizeof(trigram_entry));
+        if (!entry) return "out of memory";
+        entry->trigram = trigram;
+        HASH_ADD_INT(cache->trigrams, trigram, entry);
+    }
+
+    // New entries mostly go last
+    uint32_t at = entry->used && entry->postings[entry->used - 1] >= index
+        ? posting_position(entry, index)
+        : entry->used;
+
+    // The same trigram repeats within the segment
+    if (at < entry->used && entry->postings[at] == index) return NULL;
+
+    if (entry->used == entry->size){
+        uint32_t size = entry->size ? entry->size * 2 : 4;
+        uint32_t *postings = realloc(entry->postings, size * sizeof(uint32_t));
+        if (!postings) return "out of memory";
+        entry->postings = postings;
+        entry->size = size;
+    }
+    memmove(entry->postings + at + 1, entry->postings + at, (entry->used - at) * sizeof(uint32_t));
+    entry->postings[at] = index;
+    entry->used++;
+    return NULL;
+}
+
+// The caller must hold the lock
+static char *index_entry(opcua_cache *cache, cache_entry *entry){
+    size_t nameLength = strlen(entry->name);
+    char segment[nameLength + 4];
+    size_t length = 0;
+
+    if (entry->parent != NO_PARENT){
+        // The last two characters of the parent path
+        char tail[2];
+        size_t n = 0;
+        for (cache_entry *e = entry_at(cache, entry->parent); e && n < 2; e = e->parent == NO_PARENT ? NULL : entry_at(cache, e->parent)){
+            for (size_t i = strlen(e->name); i && n < 2;) tail[n++] = e->name[--i];
+            if (n < 2 && e->parent != NO_PARENT) tail[n++] = '/';
+        }
+        while (n) segment[length++] = tail[--n];
+        segment[length++] = '/';
+    }
+    memcpy(segment + length, entry->name, nameLength);
+    length += nameLength;
+
+    for (size_t i = 0; i + 3 <= length; i++){
+        char *error = add_posting(cache, TRIGRAM(segment + i), entry->index);
+        if (error) return error;
+    }
+    return NULL;
+}
+
+static void purge_trigrams(trigram_entry **trigrams){
+    trigram_entry *entry, *tmp;
+    HASH_ITER(hh, *trigrams, entry, tmp) {
+        HASH_DEL(*trigrams, entry);
+        free( entry->postings );
+        free( entry );
+    }
+    *trigrams = NULL;
+}
+
+static bool has_posting(trigram_entry *entry, uint32_t index){
+    uint32_t low = posting_position(entry, index);
+    return low < entry->used && entry->postings[low] == index;
+}
+
+char *add_cache(opcua_cache *cache, UA_NodeId *parent, char *name, const UA_NodeId *nodeId, int nodeClass, UA_NodeId **cached){
+    char *error = NULL;
+
+    cache_entry *entry = NULL;
+
+    pthread_rwlock_wrlock(&cache->lock);
+
+    // A reclaimed slot is reused if it keeps the parent before the child
+    uint32_t index = cache->count;
+    if (cache->slotsUsed){
+        uint32_t slot = cache->slots[cache->slotsUsed - 1];
+        if (!parent || slot > NODEID_ENTRY(parent)->index) index = slot;
+    }
+
+    if (index == NO_PARENT){
+        error = "the cache is full";
+        goto on_clear;
+    }
+
+    error = grow_indexes(cache);
+    if (error) goto on_clear;
+
+    // Start a new chunk
+    if (index == cache->count && cache->count % ENTRIES_CHUNK == 0){
+        size_t chunk = cache->count / ENTRIES_CHUNK;
+        if (chunk >= cache->chunksSize){
+            size_t size = cache->chunksSize ? cache->chunksSize * 2 : 16;
+            cache_entry **chunks = realloc(cache->chunks, size * sizeof(cache_entry *));
+            if (!chunks){
+                error = "out of memory";
+                goto on_clear;
+            }
+            cache->chunks = chunks;
+            cache->chunksSize = size;
+        }
+        cache->chunks[chunk] = arena_alloc(&cache->arena, ENTRIES_CHUNK * sizeof(cache_entry));
+        if (!cache->chunks[chunk]){
+            error = "out of memory";
+            goto on_clear;
+        }
+    }
+
+    entry = entry_at(cache, index);
+    memset(entry, 0, sizeof(cache_entry));
+    entry->index = index;
+    // The slot is taken only when the entry is complete
+    entry->removed = true;
+
+    entry->name = arena_copy(&cache->names, name, strlen(name) + 1);
+    if (!entry->name){
+        error = "out of memory";
+        goto on_clear;
+    }
+    error = copy_nodeId(cache, nodeId, &entry->nodeId);
+    if (error) goto on_clear;
+
+    entry->nodeIdHash = UA_NodeId_hash( nodeId );
+    entry->nodeClass = (UA_Byte)nodeClass;
+    entry->firstChild = NO_ENTRY;
+    if (parent){
+        cache_entry *parentEntry = NODEID_ENTRY(parent);
+        entry->parent = parentEntry->index;
+        entry->hash = hash_continue(hash_continue(parentEntry->hash, "/"), name);
+        entry->nextSibling = parentEntry->firstChild;
+        parentEntry->firstChild = entry->index;
+    }else{
+        entry->parent = NO_PARENT;
+        entry->hash = hash_continue(FNV_OFFSET, name);
+        entry->nextSibling = cache->firstRoot;
+        cache->firstRoot = entry->index;
+    }
+
+    error = index_entry(cache, entry);
+    if (error){
+        // Undo the linking, the slot stays free
+        if (parent){
+            NODEID_ENTRY(parent)->firstChild = entry->nextSibling;
+        }else{
+            cache->firstRoot = entry->nextSibling;
+        }
+        goto on_clear;
+    }
+
+    entry->removed = false;
+    insert_slot(cache->paths, cache->pathsSize, entry->hash, entry);
+    insert_slot(cache->nodeIds, cache->pathsSize, entry->nodeIdHash, entry);
+    if (index == cache->count){
+        cache->count++;
+    }else{
+        cache->slotsUsed--;
+    }
+
+    cache->generation++;
+
+    if (cached) *cached = &entry->nodeId;
+
+on_clear:
+    pthread_rwlock_unlock(&cache->lock);
+    return error;
+}
+
+void remove_cache(opcua_cache *cache, UA_NodeId *nodeId){
+    pthread_rwlock_wrlock(&cache->lock);
+    cache_entry *entry = NODEID_ENTRY(nodeId);
+    if (!entry->removed){
+        entry->removed = true;
+        cache->removed++;
+    }
+    cache->generation++;
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+uint64_t get_cache_generation(opcua_cache *cache){
+    pthread_rwlock_rdlock(&cache->lock);
+    uint64_t generation = cache->generation;
+    pthread_rwlock_unlock(&cache->lock);
+    return generation;
+}
+
+UA_NodeId *lookup_path2nodeId_cache(opcua_cache *cache, char *path){
+    pthread_rwlock_rdlock(&cache->lock);
+    cache_entry *entry = find_path(cache, path);
+    pthread_rwlock_unlock(&cache->lock);
+    return entry ? &entry->nodeId : NULL;
+}
+
+UA_NodeId *lookup_child_cache(opcua_cache *cache, UA_NodeId *parent, char *name){
+    cache_entry *entry = NULL;
 
-opcua_client_path2nodeId_cache *__path2nodeId_cache = NULL;
-opcua_client_nodeId2path_cache *__nodeId2path_cache = NULL;
+    pthread_rwlock_rdlock(&cache->lock);
+    char *path = build_path(cache, parent ? NODEID_ENTRY(parent) : NULL, name);
+    if (path) entry = find_path(cache, path);
+    pthread_rwlock_unlock(&cache->lock);
 
-char *add_cache(char *path, UA_NodeId *nodeId, int nodeClass){
+    return entry ? &entry->nodeId : NULL;
+}
+
+int lookup_nodeClass_cache(opcua_cache *cache, UA_NodeId *nodeId){
+    return NODEID_ENTRY(nodeId)->nodeClass;
+}
+
+char *lookup_nodeId2path_cache(opcua_cache *cache, UA_NodeId *nodeId){
+    pthread_rwlock_rdlock(&cache->lock);
+    char *path = build_path(cache, NODEID_ENTRY(nodeId), NULL);
+    pthread_rwlock_unlock(&cache->lock);
+    return path;
+}
+
+// NodeIds coming from the server are looked up by the value,
+// the node referenced from several folders is found by its first path
+UA_NodeId *find_nodeId_cache(opcua_cache *cache, const UA_NodeId *nodeId){
+    pthread_rwlock_rdlock(&cache->lock);
+    cache_entry *entry = find_nodeId(cache, nodeId);
+    pthread_rwlock_unlock(&cache->lock);
+    return entry ? &entry->nodeId : NULL;
+}
+
+bool in_subtree_cache(opcua_cache *cache, UA_NodeId *folder, UA_NodeId *nodeId){
+    if (!folder) return true;
+
+    bool inside = false;
+    uint32_t index = NODEID_ENTRY(folder)->index;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    for (cache_entry *e = NODEID_ENTRY(nodeId); e; e = e->parent == NO_PARENT ? NULL : entry_at(cache, e->parent)){
+        if (e->index == index){
+            inside = true;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    return inside;
+}
+
+//-----------------------------------------------------
+//  Values
+//-----------------------------------------------------
+char *update_value_cache(opcua_cache *cache, UA_NodeId *nodeId, const UA_DataValue *value, bool monitored){
     char *error = NULL;
+    cache_entry *entry = NODEID_ENTRY(nodeId);
 
-    opcua_client_path2nodeId_cache *path2NodeId = NULL;
-    opcua_client_nodeId2path_cache *nodeId2path = NULL;
+    pthread_mutex_lock(&cache->valuesLock);
 
-    // Build path2nodeId index
-    path2NodeId = (opcua_client_path2nodeId_cache *)malloc( sizeof(opcua_client_path2nodeId_cache) );
-    if (!path2NodeId){
-        error = "unable to allocate the memory for a cache entry";
-        goto on_error;
+    if (!entry->value){
+        entry->value = UA_DataValue_new();
+        if (!entry->value){
+            error = "out of memory";
+            goto on_clear;
+        }
     }
-    path2NodeId->nodeId = nodeId;
-    path2NodeId->path = path;
-    path2NodeId->nodeClass = nodeClass;
 
-    // Build nodeId2path index
-    nodeId2path = (opcua_client_nodeId2path_cache *)malloc( sizeof(opcua_client_nodeId2path_cache) );
-    if (!nodeId2path){
-        error = "unable to allocate the memory for a cache entry";
-        goto on_error;
+    UA_DataValue_clear( entry->value );
+    UA_StatusCode sc = UA_DataValue_copy(value, entry->value);
+    if (sc != UA_STATUSCODE_GOOD){
+        error = (char*)UA_StatusCode_name( sc );
+        goto on_clear;
     }
-    nodeId2path->nodeId = nodeId;
-    nodeId2path->path = path;
+    entry->updated = UA_DateTime_now();
+    if (monitored) entry->monitored = true;
 
-    HASH_ADD_STR(__path2nodeId_cache, path, path2NodeId);
-    HASH_ADD_PTR(__nodeId2path_cache, nodeId, nodeId2path);
+on_clear:
+    pthread_mutex_unlock(&cache->valuesLock);
+    return error;
+}
 
+void release_value_cache(opcua_cache *cache, UA_NodeId *nodeId){
+    pthread_mutex_lock(&cache->valuesLock);
+    NODEID_ENTRY(nodeId)->monitored = false;
+    pthread_mutex_unlock(&cache->valuesLock);
+}
+
+void touch_value_cache(opcua_cache *cache){
+    pthread_mutex_lock(&cache->valuesLock);
+    cache->valuesAlive = UA_DateTime_now();
+    pthread_mutex_unlock(&cache->valuesLock);
+}
+
+bool lookup_value_cache(opcua_cache *cache, UA_NodeId *nodeId, UA_DateTime maxAge, UA_DataValue *value){
+    bool found = false;
+    cache_entry *entry = NODEID_ENTRY(nodeId);
+
+    pthread_mutex_lock(&cache->valuesLock);
+
+    if (!entry->updated) goto on_clear;
+
+    // The server reports every change of a monitored item, so its value
+    // is as fresh as the subscription itself
+    UA_DateTime updated = entry->updated;
+    if (entry->monitored && cache->valuesAlive > updated) updated = cache->valuesAlive;
+
+    if (UA_DateTime_now() - updated > maxAge) goto on_clear;
+
+    found = UA_DataValue_copy(entry->value, value) == UA_STATUSCODE_GOOD;
+
+on_clear:
+    pthread_mutex_unlock(&cache->valuesLock);
+    return found;
+}
+
+//-----------------------------------------------------
+//  Items
+//-----------------------------------------------------
+// Items are indexed in the order they are added, a parent goes before its children
+size_t get_cache_size(opcua_cache *cache){
+    pthread_rwlock_rdlock(&cache->lock);
+    size_t size = cache->count;
+    pthread_rwlock_unlock(&cache->lock);
+    return size;
+}
+
+bool get_cache_item(opcua_cache *cache, size_t index, opcua_item *item){
+    bool found = false;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    if (index >= cache->count) goto on_clear;
+
+    cache_entry *entry = entry_at(cache, (uint32_t)index);
+    if (entry->removed) goto on_clear;
+
+    item->nodeId = &entry->nodeId;
+    item->parent = entry->parent == NO_PARENT ? CACHE_NO_PARENT : entry->parent;
+    item->name = entry->name;
+    item->nodeClass = entry->nodeClass;
+    found = true;
+
+on_clear:
+    pthread_rwlock_unlock(&cache->lock);
+    return found;
+}
+
+//-----------------------------------------------------
+//  Search
+//-----------------------------------------------------
+typedef struct {
+  UA_NodeId **array;
+  size_t used;
+  size_t size;
+} search_result;
+
+// Paths are tested by the pattern, no matcher takes all of them
+typedef bool (*path_matcher)(const char *path, void *context);
+
+static char *add_search_result(search_result *result, cache_entry *entry){
+    if (result->used >= result->size){
+        size_t size = result->size ? result->size * 2 : 64;
+        UA_NodeId **array = realloc(result->array, size * sizeof(UA_NodeId *));
+        if (!array) return "out of memory";
+        result->array = array;
+        result->size = size;
+    }
+    result->array[result->used++] = &entry->nodeId;
     return NULL;
+}
 
-on_error:
-  if (path2NodeId) free(path2NodeId);
-  if (nodeId2path) free(nodeId2path);
-  return error;
+static char *match_search_result(opcua_cache *cache, search_result *result, cache_entry *entry, path_matcher matcher, void *context){
+    if (matcher){
+        char *path = build_path(cache, entry, NULL);
+        if (!path) return "out of memory";
+        if (!matcher(path, context)) return NULL;
+    }
+    return add_search_result(result, entry);
 }
 
-UA_NodeId *lookup_path2nodeId_cache(char *path){
-    opcua_client_path2nodeId_cache *path2NodeId = NULL;
-    HASH_FIND_STR(__path2nodeId_cache, path, path2NodeId);
-    if (path2NodeId == NULL){
-        return NULL;
-    }else{
-       return path2NodeId->nodeId;
+// The entry and its subtree in pre-order, removed subtrees are skipped.
+// The caller must hold the lock
+static char *add_search_subtree(opcua_cache *cache, search_result *result, cache_entry *top, path_matcher matcher, void *context){
+    if (top->removed) return NULL;
+
+    char *error = match_search_result(cache, result, top, matcher, context);
+    if (error) return error;
+
+    cache_entry *entry = top;
+    for(;;){
+        if (entry->firstChild != NO_ENTRY && !entry->removed){
+            entry = entry_at(cache, entry->firstChild);
+        }else{
+            // Climb up to the first parent with the next sibling
+            while (entry != top && entry->nextSibling == NO_ENTRY){
+                entry = entry_at(cache, entry->parent);
+            }
+            if (entry == top) return NULL;
+            entry = entry_at(cache, entry->nextSibling);
+        }
+        if (entry->removed) continue;
+
+        error = match_search_result(cache, result, entry, matcher, context);
+        if (error) return error;
+    }
+}
+
+// All the live entries, for patterns the index cannot narrow.
+// The caller must hold the lock
+static char *scan_search(opcua_cache *cache, search_result *result, path_matcher matcher, void *context){
+    for (uint32_t i = 0; i < cache->count; i++){
+        cache_entry *entry = entry_at(cache, i);
+        if (entry->removed) continue;
+        char *error = match_search_result(cache, result, entry, matcher, context);
+        if (error) return error;
     }
+    return NULL;
 }
 
-char *lookup_nodeId2path_cache(UA_NodeId *nodeId){
-    opcua_client_nodeId2path_cache *nodeId2path = NULL;
+static bool substring_matcher(const char *path, void *context){
+    return strstr(path, (const char *)context) != NULL;
+}
 
-    HASH_FIND_PTR(__nodeId2path_cache, &nodeId, nodeId2path);
-    if (nodeId2path == NULL){
-        return NULL;
-    }else{
-       return nodeId2path->path;
+// The entries where the literal first appears in the path, every path
+// containing the literal is in the subtree of one of them.
+// The literal is at least 3 characters long. The caller must hold the lock
+static char *literal_search(opcua_cache *cache, search_result *result, const char *literal, path_matcher matcher, void *context){
+    char *error = NULL;
+
+    // The part of the literal within the segment of the entry
+    const char *segment = literal;
+    const char *slash = strrchr(literal, '/');
+    if (slash) segment = slash - literal >= 2 ? slash - 2 : literal;
+    size_t length = strlen(segment);
+    if (length < 3) return scan_search(cache, result, substring_matcher, (void *)literal);
+
+    // Start from the shortest postings list
+    size_t count = length - 2;
+    trigram_entry *lists[count];
+    trigram_entry *shortest = NULL;
+    for (size_t i = 0; i < count; i++){
+        uint32_t trigram = TRIGRAM(segment + i);
+        HASH_FIND_INT(cache->trigrams, &trigram, lists[i]);
+        if (!lists[i]) return NULL;
+        if (!shortest || lists[i]->used < shortest->used) shortest = lists[i];
+    }
+
+    for (uint32_t p = 0; p < shortest->used; p++){
+        uint32_t index = shortest->postings[p];
+        if (index >= cache->count) continue;
+
+        size_t i = 0;
+        for (; i < count; i++){
+            if (lists[i] != shortest && !has_posting(lists[i], index)) break;
+        }
+        if (i < count) continue;
+
+        cache_entry *entry = entry_at(cache, index);
+        if (entry->removed) continue;
+
+        // Trigrams may come from different places of the segment
+        char *path = build_path(cache, entry, NULL);
+        if (!path) return "out of memory";
+        if (!strstr(path, literal)) continue;
+
+        // The literal is already in the parent path, the entry is in another subtree
+        if (entry->parent != NO_PARENT){
+            path = build_path(cache, entry_at(cache, entry->parent), NULL);
+            if (!path) return "out of memory";
+            if (strstr(path, literal)) continue;
+        }
+
+        error = add_search_subtree(cache, result, entry, matcher, context);
+        if (error) return error;
     }
+
+    return NULL;
 }
 
-opcua_item *get_all_cache_items(size_t *size){
+static char *return_search_result(search_result *result, char *error, UA_NodeId ***nodeIds, size_t *size){
+    if (error){
+        free( result->array );
+        return error;
+    }
 
-    *size = HASH_CNT(hh, __path2nodeId_cache);
-    opcua_item *items = (opcua_item *)malloc( sizeof(opcua_item) * (*size) );
+    *nodeIds = result->array;
+    *size = result->used;
+    return NULL;
+}
+
+// Items which paths start with the prefix. The folder part of the prefix
+// is found by the path index, only its matching children are walked
+char *search_prefix_cache(opcua_cache *cache, char *prefix, UA_NodeId ***nodeIds, size_t *size){
+    char *error = NULL;
+    search_result result = {NULL, 0, 0};
+
+    char *slash = strrchr(prefix, '/');
+    char *fragment = slash ? slash + 1 : prefix;
+    size_t fragmentLength = strlen(fragment);
+
+    pthread_rwlock_rdlock(&cache->lock);
+
+    uint32_t first = cache->firstRoot;
+    if (slash){
+        char folderPath[slash - prefix + 1];
+        memcpy(folderPath, prefix, slash - prefix);
+        folderPath[slash - prefix] = '\0';
+
+        cache_entry *folder = find_path(cache, folderPath);
+        first = folder ? folder->firstChild : NO_ENTRY;
+    }
 
-    opcua_client_path2nodeId_cache *path2NodeId; size_t i = 0;
-    for (path2NodeId= __path2nodeId_cache; path2NodeId != NULL; path2NodeId = path2NodeId->hh.next) {
-        items[i].path = path2NodeId->path;
-        items[i].nodeId = path2NodeId->nodeId;
-        items[i].nodeClass = path2NodeId->nodeClass;
-        i++;
+    for (uint32_t i = first; i != NO_ENTRY; i = entry_at(cache, i)->nextSibling){
+        cache_entry *entry = entry_at(cache, i);
+        if (strncmp(entry->name, fragment, fragmentLength)) continue;
+        error = add_search_subtree(cache, &result, entry, NULL, NULL);
+        if (error) goto on_clear;
     }
 
-    return items;
+    // Items with unknown parents keep the whole path as the name
+    if (slash){
+        size_t prefixLength = strlen(prefix);
+        for (uint32_t i = cache->firstRoot; i != NO_ENTRY; i = entry_at(cache, i)->nextSibling){
+            cache_entry *entry = entry_at(cache, i);
+            if (!strchr(entry->name, '/') || strncmp(entry->name, prefix, prefixLength)) continue;
+            error = add_search_subtree(cache, &result, entry, NULL, NULL);
+            if (error) goto on_clear;
+        }
+    }
+
+on_clear:
+    pthread_rwlock_unlock(&cache->lock);
+    return return_search_result(&result, error, nodeIds, size);
+}
+
+// Items which paths contain the string, short strings scan the whole cache
+char *search_substring_cache(opcua_cache *cache, char *search, UA_NodeId ***nodeIds, size_t *size){
+    search_result result = {NULL, 0, 0};
+
+    pthread_rwlock_rdlock(&cache->lock);
+    char *error = literal_search(cache, &result, search, NULL, NULL);
+    pthread_rwlock_unlock(&cache->lock);
+
+    return return_search_result(&result, error, nodeIds, size);
 }
 
-void purge_cache(){
+static bool regex_matcher(const char *path, void *context){
+    return regexec((regex_t *)context, path, 0, NULL, 0) == 0;
+}
 
-    // Purge path2nodeId index
-    opcua_client_path2nodeId_cache *path2NodeId;
-    for (path2NodeId= __path2nodeId_cache; path2NodeId != NULL; path2NodeId = path2NodeId->hh.next) {
-        free( path2NodeId->path );
-        HASH_DEL(__path2nodeId_cache, path2NodeId);
-        // MEMORY LEAK! We have to free nodeId but it causes 
-        //      malloc_consolidate(): invalid chunk size
-        //UA_NodeId_delete( path2NodeId->nodeId );
-        free( path2NodeId );
+static bool glob_matcher(const char *path, void *context){
+    return fnmatch((const char *)context, path, FNM_PATHNAME) == 0;
+}
+
+// The closing bracket of the expression opened at c, NULL if there is none.
+// A leading ] is a member after the optional negation, so are the ]
+// of [:class:], [=equivalence=] and [.collating.] and the escaped one of globs
+static const char *bracket_end(const char *c, bool regex){
+    c++;
+    if (*c == '^' || (!regex && *c == '!')) c++;
+    if (*c == ']') c++;
+    for (; *c; c++){
+        if (*c == ']') return c;
+        if (!regex && *c == '\\' && c[1]){
+            c++;
+        }else if (*c == '[' && c[1] && strchr(":=.", c[1])){
+            const char *end = c + 2;
+            while (*end && !(end[0] == c[1] && end[1] == ']')) end++;
+            if (!*end) return NULL;
+            c = end + 1;
+        }
     }
+    return NULL;
+}
+
+// The longest run of plain characters every match must contain.
+// Alternatives and optional characters make the pattern give up
+static size_t pattern_literal(const char *pattern, bool regex, char *literal){
+    const char *best = NULL;
+    size_t bestLength = 0;
+
+    if (regex && strpbrk(pattern, "|(")) return 0;
 
-    // Purge nodeId2path index
-    opcua_client_nodeId2path_cache *nodeId2path;
-    for (nodeId2path= __nodeId2path_cache; nodeId2path != NULL; nodeId2path = nodeId2path->hh.next) {
-        HASH_DEL(__nodeId2path_cache, nodeId2path);
-        free( nodeId2path );
+    const char *run = pattern;
+    for (const char *c = pattern;; c++){
+        bool plain = *c && !strchr(regex ? ".[]{}*+?^$\\" : "*?[\\", *c);
+        // The character before a quantifier may be absent
+        if (plain && regex && c[1] && strchr("*?{", c[1])) plain = false;
+        if (plain) continue;
+
+        if ((size_t)(c - run) > bestLength){
+            best = run;
+            bestLength = c - run;
+        }
+        if (!*c) break;
+
+        // Skip the escaped character and the bracket expression
+        if (*c == '\\' && c[1]){
+            c++;
+        }else if (*c == '['){
+            const char *end = bracket_end(c, regex);
+            if (!end) return 0;
+            c = end;
+        }
+        run = c + 1;
     }
+
+    if (bestLength) memcpy(literal, best, bestLength);
+    literal[bestLength] = '\0';
+    return bestLength;
+}
+
+static char *pattern_search(opcua_cache *cache, char *pattern, bool regex, path_matcher matcher, void *context, UA_NodeId ***nodeIds, size_t *size){
+    search_result result = {NULL, 0, 0};
+
+    char literal[strlen(pattern) + 1];
+    size_t length = pattern_literal(pattern, regex, literal);
+
+    pthread_rwlock_rdlock(&cache->lock);
+    char *error = length >= 3
+        ? literal_search(cache, &result, literal, matcher, context)
+        : scan_search(cache, &result, matcher, context);
+    pthread_rwlock_unlock(&cache->lock);
+
+    return return_search_result(&result, error, nodeIds, size);
 }
 
+// POSIX extended regular expression over the whole path
+char *search_regex_cache(opcua_cache *cache, char *regex, UA_NodeId ***nodeIds, size_t *size){
+    regex_t compiled;
+    if (regcomp(&compiled, regex, REG_EXTENDED | REG_NOSUB)) return "invalid regular expression";
+
+    char *error = pattern_search(cache, regex, true, regex_matcher, &compiled, nodeIds, size);
+
+    regfree(&compiled);
+    return error;
+}
+
+// Shell wildcards, * and ? do not match the slash
+char *search_glob_cache(opcua_cache *cache, char *glob, UA_NodeId ***nodeIds, size_t *size){
+    return pattern_search(cache, glob, false, glob_matcher, glob, nodeIds, size);
+}
+
+//-----------------------------------------------------
+//  Compaction
+//-----------------------------------------------------
+// Removed entries keep their slots, names, postings and index slots until
+// enough of them pile up. Then their slots go to new entries and the names
+// arena and the indexes are built again of what is left. Live entries
+// do not move, their NodeIds stay valid
+#define COMPACT_MIN_REMOVED 4096
+
+// The eport thread holds NodeIds of the caches for the time of a request
+static pthread_rwlock_t __pins = PTHREAD_RWLOCK_INITIALIZER;
+
+void pin_caches(void){
+    pthread_rwlock_rdlock(&__pins);
+}
+
+void unpin_caches(void){
+    pthread_rwlock_unlock(&__pins);
+}
+
+static bool compact_due(opcua_cache *cache){
+    pthread_rwlock_rdlock(&cache->lock);
+    bool due = cache->removed >= COMPACT_MIN_REMOVED && (size_t)cache->removed * 4 >= cache->count;
+    pthread_rwlock_unlock(&cache->lock);
+    return due;
+}
+
+bool compact_cache(opcua_cache *cache){
+    bool compacted = false;
+    bool *keep = NULL;
+    char **names = NULL;
+    UA_Byte **identifiers = NULL;
+    uint32_t *slots = NULL;
+    arena_block *arena = NULL;
+    trigram_entry *trigrams = NULL;
+
+    if (!compact_due(cache)) return false;
+
+    // A request of the eport thread may hold NodeIds of removed entries
+    if (pthread_rwlock_trywrlock(&__pins)) return false;
+    pthread_rwlock_wrlock(&cache->lock);
+
+    uint32_t count = cache->count;
+    keep = calloc(count, sizeof(bool));
+    names = malloc(count * sizeof(char *));
+    identifiers = malloc(count * sizeof(UA_Byte *));
+    slots = malloc(count * sizeof(uint32_t));
+    if (!keep || !names || !identifiers || !slots) goto on_clear;
+
+    // A removed entry stays while it is a part of a live path
+    for (uint32_t i = 0; i < count; i++){
+        cache_entry *entry = entry_at(cache, i);
+        if (entry->removed) continue;
+        for (cache_entry *e = entry; e && !keep[e->index]; e = e->parent == NO_PARENT ? NULL : entry_at(cache, e->parent)){
+            keep[e->index] = true;
+        }
+    }
+
+    // Nothing is changed until everything is allocated
+    for (uint32_t i = 0; i < count; i++){
+        if (!keep[i]) continue;
+        cache_entry *entry = entry_at(cache, i);
+        names[i] = arena_copy(&arena, entry->name, strlen(entry->name) + 1);
+        if (!names[i]) goto on_clear;
+        if (has_string_identifier(&entry->nodeId)){
+            identifiers[i] = arena_copy(&arena, entry->nodeId.identifier.string.data, entry->nodeId.identifier.string.length);
+            if (!identifiers[i]) goto on_clear;
+        }
+    }
+
+    trigrams = cache->trigrams;
+    cache->trigrams = NULL;
+    for (uint32_t i = 0; i < count; i++){
+        cache_entry *entry = entry_at(cache, i);
+        if (!keep[i] || entry->removed) continue;
+        if (index_entry(cache, entry)){
+            purge_trigrams(&cache->trigrams);
+            cache->trigrams = trigrams;
+            trigrams = NULL;
+            goto on_clear;
+        }
+    }
+
+    memset(cache->paths, 0, cache->pathsSize * sizeof(uint32_t));
+    memset(cache->nodeIds, 0, cache->pathsSize * sizeof(uint32_t));
+
+    pthread_mutex_lock(&cache->valuesLock);
+
+    uint32_t slotsUsed = 0;
+    cache->firstRoot = NO_ENTRY;
+    for (uint32_t i = 0; i < count; i++){
+        cache_entry *entry = entry_at(cache, i);
+        if (!keep[i]){
+            if (entry->value) UA_DataValue_delete( entry->value );
+            memset(entry, 0, sizeof(cache_entry));
+            entry->index = i;
+            entry->parent = NO_PARENT;
+            entry->firstChild = NO_ENTRY;
+            entry->nextSibling = NO_ENTRY;
+            entry->name = "";
+            entry->removed = true;
+            slots[slotsUsed++] = i;
+            continue;
+        }
+
+        entry->name = names[i];
+        if (has_string_identifier(&entry->nodeId)) entry->nodeId.identifier.string.data = identifiers[i];
+
+        // The parent goes before the child, its list is already reset
+        entry->firstChild = NO_ENTRY;
+        if (entry->parent == NO_PARENT){
+            entry->nextSibling = cache->firstRoot;
+            cache->firstRoot = i;
+        }else{
+            cache_entry *parent = entry_at(cache, entry->parent);
+            entry->nextSibling = parent->firstChild;
+            parent->firstChild = i;
+        }
+
+        if (entry->removed) continue;
+        insert_slot(cache->paths, cache->pathsSize, entry->hash, entry);
+        insert_slot(cache->nodeIds, cache->pathsSize, entry->nodeIdHash, entry);
+    }
+
+    pthread_mutex_unlock(&cache->valuesLock);
+
+    free( cache->slots );
+    cache->slots = slots;
+    cache->slotsUsed = slotsUsed;
+    slots = NULL;
+
+    arena_reset(&cache->names);
+    cache->names = arena;
+    arena = NULL;
+
+    // trigrams holds the old index now
+    cache->removed = 0;
+    cache->generation++;
+    compacted = true;
+
+on_clear:
+    pthread_rwlock_unlock(&cache->lock);
+    pthread_rwlock_unlock(&__pins);
+
+    purge_trigrams(&trigrams);
+    arena_reset(&arena);
+    free( keep );
+    free( names );
+    free( identifiers );
+    free( slots );
+    return compacted;
+}
+
+void purge_cache(opcua_cache *cache){
+    pthread_rwlock_wrlock(&cache->lock);
+
+    // Values are the only thing out of the arena
+    for (uint32_t i = 0; i < cache->count; i++){
+        cache_entry *entry = entry_at(cache, i);
+        if (entry->value) UA_DataValue_delete( entry->value );
+    }
+
+    arena_reset(&cache->arena);
+    arena_reset(&cache->names);
+
+    free( cache->chunks );
+    cache->chunks = NULL;
+    cache->chunksSize = 0;
+    cache->count = 0;
+    cache->firstRoot = NO_ENTRY;
+
+    free( cache->paths );
+    free( cache->nodeIds );
+    cache->paths = NULL;
+    cache->nodeIds = NULL;
+    cache->pathsSize = 0;
+
+    purge_trigrams(&cache->trigrams);
+
+    free( cache->slots );
+    cache->slots = NULL;
+    cache->slotsUsed = 0;
+    cache->removed = 0;
+
+    cache->valuesAlive = 0;
+    cache->generation++;
+
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+opcua_cache *new_cache(void){
+    opcua_cache *cache = calloc(1, sizeof(opcua_cache));
+    if (!cache) return NULL;
+
+    cache->firstRoot = NO_ENTRY;
+    pthread_rwlock_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->valuesLock, NULL);
+    return cache;
+}
+
+void delete_cache(opcua_cache *cache){
+    if (!cache) return;
+
+    purge_cache(cache);
+    pthread_rwlock_destroy(&cache->lock);
+    pthread_mutex_destroy(&cache->valuesLock);
+    free( cache );
+}
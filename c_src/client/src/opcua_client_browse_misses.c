@@ -0,0 +1,240 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <uthash.h>
+#include <open62541/types.h>
+
+#include "opcua_client_browse_misses.h"
+//-----------------------------------------------------
+//  Bloom filter
+//-----------------------------------------------------
+// Most of the looked up paths are not misses. The filter answers that
+// without the lock and the hash lookup. Bits are never cleared while
+// the filter is in use, it is rebuilt when too many entries are gone
+#define BLOOM_BITS_PER_ENTRY 16
+#define BLOOM_HASHES 4
+
+typedef struct{
+  _Atomic uint64_t *bits;
+  size_t size;
+} bloom_filter;
+
+static uint64_t bloom_hash(char *path){
+    uint64_t hash = 14695981039346656037ULL;
+    for (char *c = path; *c; c++){
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The bit indexes are derived from the halves of one hash
+#define BLOOM_BIT(filter, hash, i) \
+    (((uint32_t)(hash) + (i) * (((hash) >> 32) | 1)) % ((filter)->size * 64))
+
+static void bloom_add(bloom_filter *filter, uint64_t hash){
+    for (uint64_t i = 0; i < BLOOM_HASHES; i++){
+        size_t bit = BLOOM_BIT(filter, hash, i);
+        atomic_fetch_or_explicit(&filter->bits[bit / 64], 1ULL << (bit % 64), memory_order_relaxed);
+    }
+}
+
+static bool bloom_check(bloom_filter *filter, uint64_t hash){
+    for (uint64_t i = 0; i < BLOOM_HASHES; i++){
+        size_t bit = BLOOM_BIT(filter, hash, i);
+        if (!(atomic_load_explicit(&filter->bits[bit / 64], memory_order_relaxed) & (1ULL << (bit % 64)))) return false;
+    }
+    return true;
+}
+
+static void bloom_clear(bloom_filter *filter){
+    for (size_t i = 0; i < filter->size; i++) atomic_store_explicit(&filter->bits[i], 0, memory_order_relaxed);
+}
+
+//-----------------------------------------------------
+//  Negative cache
+//-----------------------------------------------------
+// Misses are added by the update loop and looked up by the eport thread.
+// Entries are kept in the order they expire, the expired and the oldest
+// ones are dropped from the head
+#define BROWSE_MISSES_MAX_SIZE 10000
+#define BROWSE_MISS_TTL 10000
+
+typedef struct {
+  char *path;
+  uint64_t hash;
+  UA_DateTime expires;
+  UT_hash_handle hh;
+} browse_miss_entry;
+
+struct opcua_browse_misses{
+  browse_miss_entry *entries;
+  size_t maxSize;
+  UA_DateTime ttl;
+  bloom_filter filter;
+  // Entries removed since the filter was built
+  size_t removed;
+  pthread_mutex_t lock;
+};
+
+opcua_browse_misses *new_browse_misses(){
+    opcua_browse_misses *misses = calloc(1, sizeof(opcua_browse_misses));
+    if (!misses) return NULL;
+
+    pthread_mutex_init(&misses->lock, NULL);
+    if (configure_browse_misses(misses, 0, 0)){
+        delete_browse_misses( misses );
+        return NULL;
+    }
+    return misses;
+}
+
+void delete_browse_misses(opcua_browse_misses *misses){
+    if (!misses) return;
+
+    purge_browse_misses( misses );
+    pthread_mutex_destroy(&misses->lock);
+    if (misses->filter.bits) free( misses->filter.bits );
+    free( misses );
+}
+
+// Called while nobody looks up the cache
+char *configure_browse_misses(opcua_browse_misses *misses, size_t maxSize, int ttl){
+    maxSize = maxSize ? maxSize : BROWSE_MISSES_MAX_SIZE;
+    size_t size = (maxSize * BLOOM_BITS_PER_ENTRY + 63) / 64;
+
+    _Atomic uint64_t *bits = calloc(size, sizeof(uint64_t));
+    if (!bits) return "out of memory";
+
+    purge_browse_misses( misses );
+
+    pthread_mutex_lock(&misses->lock);
+    if (misses->filter.bits) free( misses->filter.bits );
+    misses->filter.bits = bits;
+    misses->filter.size = size;
+    misses->maxSize = maxSize;
+    misses->ttl = (UA_DateTime)(ttl > 0 ? ttl : BROWSE_MISS_TTL) * UA_DATETIME_MSEC;
+    pthread_mutex_unlock(&misses->lock);
+
+    return NULL;
+}
+
+static void remove_entry(opcua_browse_misses *misses, browse_miss_entry *entry){
+    HASH_DEL(misses->entries, entry);
+    free( entry->path );
+    free( entry );
+    misses->removed++;
+}
+
+// A reader may miss an entry while the filter is rebuilt,
+// then the path is asked from the server once more
+static void rebuild_filter(opcua_browse_misses *misses){
+    bloom_clear( &misses->filter );
+
+    browse_miss_entry *entry;
+    for (entry = misses->entries; entry != NULL; entry = entry->hh.next) {
+        bloom_add( &misses->filter, entry->hash );
+    }
+    misses->removed = 0;
+}
+
+static void expire_entries(opcua_browse_misses *misses, UA_DateTime now){
+    browse_miss_entry *entry, *tmp;
+    HASH_ITER(hh, misses->entries, entry, tmp) {
+        if (entry->expires > now && HASH_CNT(hh, misses->entries) < misses->maxSize) break;
+        remove_entry(misses, entry);
+    }
+
+    // Stale bits make the filter useless
+    if (misses->removed > misses->maxSize / 2) rebuild_filter(misses);
+}
+
+char *add_browse_miss(opcua_browse_misses *misses, char *path){
+    char *error = NULL;
+    UA_DateTime now = UA_DateTime_nowMonotonic();
+
+    pthread_mutex_lock(&misses->lock);
+
+    browse_miss_entry *entry = NULL;
+    HASH_FIND_STR(misses->entries, path, entry);
+    if (entry){
+        // Move the entry to the tail to keep the order
+        HASH_DEL(misses->entries, entry);
+    }else{
+        expire_entries(misses, now);
+
+        entry = (browse_miss_entry *)malloc( sizeof(browse_miss_entry) );
+        if (!entry){
+            error = "out of memory";
+            goto on_clear;
+        }
+        entry->path = strdup( path );
+        if (!entry->path){
+            free( entry );
+            error = "out of memory";
+            goto on_clear;
+        }
+        entry->hash = bloom_hash( path );
+        bloom_add( &misses->filter, entry->hash );
+    }
+    entry->expires = now + misses->ttl;
+
+    HASH_ADD_STR(misses->entries, path, entry);
+
+on_clear:
+    pthread_mutex_unlock(&misses->lock);
+    return error;
+}
+
+bool lookup_browse_miss(opcua_browse_misses *misses, char *path){
+    bool found = false;
+
+    if (!bloom_check( &misses->filter, bloom_hash( path ) )) return false;
+
+    pthread_mutex_lock(&misses->lock);
+
+    browse_miss_entry *entry = NULL;
+    HASH_FIND_STR(misses->entries, path, entry);
+    if (entry){
+        // The node could appear on the server, ask it again
+        if (entry->expires > UA_DateTime_nowMonotonic()){
+            found = true;
+        }else{
+            remove_entry(misses, entry);
+        }
+    }
+
+    pthread_mutex_unlock(&misses->lock);
+    return found;
+}
+
+void purge_browse_misses(opcua_browse_misses *misses){
+    pthread_mutex_lock(&misses->lock);
+
+    browse_miss_entry *entry, *tmp;
+    HASH_ITER(hh, misses->entries, entry, tmp) {
+        remove_entry(misses, entry);
+    }
+    misses->entries = NULL;
+    if (misses->filter.bits) rebuild_filter(misses);
+
+    pthread_mutex_unlock(&misses->lock);
+}
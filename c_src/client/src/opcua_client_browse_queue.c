@@ -27,13 +27,25 @@ typedef struct {
   UT_hash_handle hh;
 } browse_queue_entry;
 
+struct opcua_browse_queue{
+  browse_queue_entry *entries;
+};
 
-browse_queue_entry *__browse_queue = NULL;
+opcua_browse_queue *new_browse_queue(){
+    return calloc(1, sizeof(opcua_browse_queue));
+}
+
+void delete_browse_queue(opcua_browse_queue *queue){
+    if (!queue) return;
+
+    purge_browse_queue( queue );
+    free( queue );
+}
 
-char *add_browse_queue(char *path){
+char *add_browse_queue(opcua_browse_queue *queue, char *path){
 
     browse_queue_entry *entry = NULL;
-    HASH_FIND_STR(__browse_queue, path, entry);
+    HASH_FIND_STR(queue->entries, path, entry);
     if (entry) return NULL;
 
     entry = (browse_queue_entry *)malloc( sizeof(browse_queue_entry));
@@ -41,37 +53,34 @@ char *add_browse_queue(char *path){
 
     entry->path = strdup( path );
 
-    HASH_ADD_STR(__browse_queue, path, entry);
+    HASH_ADD_STR(queue->entries, path, entry);
 
     return NULL;
 }
 
-char **get_browse_queue(size_t *size){
+char **get_browse_queue(opcua_browse_queue *queue, size_t *size){
 
-    *size = HASH_CNT(hh, __browse_queue);
+    *size = HASH_CNT(hh, queue->entries);
     char **entries = (char **)malloc( sizeof(char *) * (*size) );
 
     if(!entries) return NULL;
 
     browse_queue_entry *entry; size_t i = 0;
-    for (entry= __browse_queue; entry != NULL; entry = entry->hh.next) {
+    for (entry= queue->entries; entry != NULL; entry = entry->hh.next) {
         entries[i++] = entry->path;
     }
 
     return entries;
 }
 
-void purge_browse_queue(){
+void purge_browse_queue(opcua_browse_queue *queue){
 
-    browse_queue_entry *entry;
-    for (entry= __browse_queue; entry != NULL; entry = entry->hh.next) {
+    browse_queue_entry *entry, *tmp;
+    HASH_ITER(hh, queue->entries, entry, tmp) {
         free( entry->path );
-        HASH_DEL(__browse_queue, entry);
+        HASH_DEL(queue->entries, entry);
         free( entry );
     }
 
-    __browse_queue = NULL;
+    queue->entries = NULL;
 }
-
-
-
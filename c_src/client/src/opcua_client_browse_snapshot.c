@@ -0,0 +1,328 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <open62541/types.h>
+#include <open62541/types_generated_handling.h>
+
+#include <eport_c_log.h>
+
+#include "opcua_client_browse_cache.h"
+#include "opcua_client_browse_snapshot.h"
+
+//-----------------------------------------------------
+//  Snapshot file format
+//-----------------------------------------------------
+// The file is mapped to the memory as is:
+//      header | entries[count] | pool
+// The pool starts with the server url and the null terminated namespace
+// uris of the server followed by the null terminated names and binary
+// encoded NodeIds referenced by the entries.
+// A parent always goes before its children
+#define SNAPSHOT_MAGIC "EOPCUABC"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_NO_PARENT UINT32_MAX
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint32_t urlLength;
+  uint32_t namespacesLength;
+  uint64_t poolSize;
+  int64_t startTime;
+} snapshot_header;
+
+typedef struct {
+  uint32_t parent;
+  uint32_t name;
+  uint32_t nodeId;
+  uint32_t nodeIdLength;
+  int32_t nodeClass;
+} snapshot_entry;
+
+// The snapshot file name is the hash of the server url
+static void snapshot_file(char *dir, char *url, char *file, size_t size){
+    uint64_t hash = 14695981039346656037ULL;
+    for (char *c = url; *c; c++){
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    snprintf(file, size, "%s/%016llx.cache", dir, (unsigned long long)hash);
+}
+
+static size_t namespaces_length(const server_identity *identity){
+    size_t length = 0;
+    for (size_t i = 0; i < identity->namespacesSize; i++) length += identity->namespaces[i].length + 1;
+    return length;
+}
+
+static void write_namespaces(const server_identity *identity, UA_Byte *data){
+    for (size_t i = 0; i < identity->namespacesSize; i++){
+        if (identity->namespaces[i].length) memcpy(data, identity->namespaces[i].data, identity->namespaces[i].length);
+        data += identity->namespaces[i].length;
+        *data++ = '\0';
+    }
+}
+
+//-----------------------------------------------------
+//  API
+//-----------------------------------------------------
+void clear_server_identity(server_identity *identity){
+    if (identity->namespaces) UA_Array_delete(identity->namespaces, identity->namespacesSize, &UA_TYPES[UA_TYPES_STRING]);
+    identity->namespaces = NULL;
+    identity->namespacesSize = 0;
+    identity->startTime = 0;
+}
+
+char *save_browse_snapshot(opcua_cache *cache, char *dir, char *url, const server_identity *identity){
+    char *error = NULL;
+
+    opcua_item *items = NULL;
+    uint32_t *indexes = NULL;
+    snapshot_entry *entries = NULL;
+    UA_Byte *pool = NULL;
+    FILE *fp = NULL;
+
+    // Write to a temporary file first not to break the previous snapshot
+    char file[strlen(dir) + 32];
+    snapshot_file(dir, url, file, sizeof(file));
+    char tmp[sizeof(file) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+    // Take the live items, removed ones leave gaps in the cache indexes
+    size_t cacheSize = get_cache_size(cache);
+    items = malloc( cacheSize * sizeof(opcua_item) + 1 );
+    indexes = malloc( cacheSize * sizeof(uint32_t) + 1 );
+    if (!items || !indexes){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < cacheSize; i++){
+        indexes[i] = SNAPSHOT_NO_PARENT;
+        if (!get_cache_item(cache, i, &items[size])) continue;
+        indexes[i] = (uint32_t)size++;
+    }
+
+    // Calculate the pool size
+    size_t urlLength = strlen(url);
+    size_t namespacesLength = namespaces_length(identity);
+    size_t poolSize = urlLength + namespacesLength;
+    for (size_t i = 0; i < size; i++){
+        poolSize += strlen(items[i].name) + 1;
+        poolSize += UA_calcSizeBinary(items[i].nodeId, &UA_TYPES[UA_TYPES_NODEID]);
+    }
+    if (poolSize > UINT32_MAX){
+        error = "the cache is too big for the snapshot";
+        goto on_clear;
+    }
+
+    entries = malloc( size * sizeof(snapshot_entry) + 1 );
+    pool = malloc( poolSize + 1 );
+    if (!entries || !pool){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    // Fill in the pool
+    memcpy(pool, url, urlLength);
+    write_namespaces(identity, pool + urlLength);
+    size_t offset = urlLength + namespacesLength;
+    for (size_t i = 0; i < size; i++){
+        size_t length = strlen(items[i].name) + 1;
+        memcpy(pool + offset, items[i].name, length);
+        entries[i].name = (uint32_t)offset;
+        offset += length;
+
+        UA_ByteString buffer;
+        buffer.length = poolSize - offset;
+        buffer.data = pool + offset;
+        UA_StatusCode sc = UA_encodeBinary(items[i].nodeId, &UA_TYPES[UA_TYPES_NODEID], &buffer);
+        if (sc != UA_STATUSCODE_GOOD){
+            error = (char*)UA_StatusCode_name( sc );
+            goto on_clear;
+        }
+        entries[i].nodeId = (uint32_t)offset;
+        entries[i].nodeIdLength = (uint32_t)buffer.length;
+        offset += buffer.length;
+
+        entries[i].parent = items[i].parent == CACHE_NO_PARENT ? SNAPSHOT_NO_PARENT : indexes[items[i].parent];
+        entries[i].nodeClass = items[i].nodeClass;
+    }
+
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.count = (uint32_t)size;
+    header.urlLength = (uint32_t)urlLength;
+    header.namespacesLength = (uint32_t)namespacesLength;
+    header.startTime = identity->startTime;
+    header.poolSize = offset;
+
+    fp = fopen(tmp, "wb");
+    if (!fp){
+        error = "unable to create the snapshot file";
+        goto on_clear;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1
+        || (size && fwrite(entries, sizeof(snapshot_entry), size, fp) != size)
+        || fwrite(pool, 1, offset, fp) != offset){
+        error = "unable to write the snapshot file";
+        goto on_clear;
+    }
+
+    if (fclose(fp)){
+        fp = NULL;
+        error = "unable to write the snapshot file";
+        goto on_clear;
+    }
+    fp = NULL;
+
+    if (rename(tmp, file)){
+        error = "unable to replace the snapshot file";
+        goto on_clear;
+    }
+
+    LOGDEBUG("browse cache snapshot %s saved, %zu items", file, size);
+
+on_clear:
+    if (fp){
+        fclose(fp);
+        unlink(tmp);
+    }
+    if (items) free(items);
+    if (indexes) free(indexes);
+    if (entries) free(entries);
+    if (pool) free(pool);
+    return error;
+}
+
+char *load_browse_snapshot(opcua_cache *cache, char *dir, char *url, const server_identity *identity){
+    char *error = NULL;
+    UA_NodeId **loaded = NULL;
+    UA_Byte *namespaces = NULL;
+
+    char file[strlen(dir) + 32];
+    snapshot_file(dir, url, file, sizeof(file));
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return "no snapshot";
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(snapshot_header)){
+        close(fd);
+        return "invalid snapshot";
+    }
+    size_t fileSize = (size_t)st.st_size;
+
+    UA_Byte *data = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return "unable to map the snapshot";
+
+    //-----------validate the snapshot-----------------------
+    snapshot_header *header = (snapshot_header *)data;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) || header->version != SNAPSHOT_VERSION){
+        error = "invalid snapshot";
+        goto on_clear;
+    }
+
+    snapshot_entry *entries = (snapshot_entry *)(data + sizeof(snapshot_header));
+    UA_Byte *pool = (UA_Byte *)(entries + header->count);
+    size_t poolSize = header->poolSize;
+    if ((size_t)(pool - data) + poolSize != fileSize || (size_t)header->urlLength + header->namespacesLength > poolSize){
+        error = "invalid snapshot";
+        goto on_clear;
+    }
+
+    // Hash collision or a different server behind the same name
+    if (header->urlLength != strlen(url) || memcmp(pool, url, header->urlLength)){
+        error = "the snapshot belongs to another server";
+        goto on_clear;
+    }
+
+    // The server is restarted or its namespaces are changed since the snapshot
+    size_t namespacesLength = namespaces_length(identity);
+    namespaces = malloc( namespacesLength + 1 );
+    if (!namespaces){
+        error = "out of memory";
+        goto on_clear;
+    }
+    write_namespaces(identity, namespaces);
+    if (header->startTime != identity->startTime || header->namespacesLength != namespacesLength
+        || memcmp(pool + header->urlLength, namespaces, namespacesLength)){
+        error = "the snapshot is outdated";
+        goto on_clear;
+    }
+
+    // Cache NodeIds of the loaded entries to link the children
+    loaded = malloc( header->count * sizeof(UA_NodeId *) + 1 );
+    if (!loaded){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    //-----------fill in the cache-----------------------
+    for (uint32_t i = 0; i < header->count; i++){
+        snapshot_entry *entry = &entries[i];
+
+        if (entry->name >= poolSize || !memchr(pool + entry->name, '\0', poolSize - entry->name)
+            || (size_t)entry->nodeId + entry->nodeIdLength > poolSize
+            || (entry->parent != SNAPSHOT_NO_PARENT && entry->parent >= i)){
+            error = "invalid snapshot";
+            goto on_clear;
+        }
+
+        UA_ByteString buffer;
+        buffer.length = entry->nodeIdLength;
+        buffer.data = pool + entry->nodeId;
+
+        UA_NodeId nodeId;
+        size_t offset = 0;
+        UA_StatusCode sc = UA_decodeBinary(&buffer, &offset, &nodeId, &UA_TYPES[UA_TYPES_NODEID], NULL);
+        if (sc != UA_STATUSCODE_GOOD){
+            error = "invalid snapshot";
+            goto on_clear;
+        }
+
+        UA_NodeId *parent = entry->parent == SNAPSHOT_NO_PARENT ? NULL : loaded[entry->parent];
+        error = add_cache(cache, parent, (char *)(pool + entry->name), &nodeId, entry->nodeClass, &loaded[i]);
+        UA_NodeId_clear( &nodeId );
+        if (error) goto on_clear;
+    }
+
+    LOGDEBUG("browse cache snapshot %s loaded, %u items", file, header->count);
+
+on_clear:
+    munmap(data, fileSize);
+    if (loaded) free(loaded);
+    if (namespaces) free(namespaces);
+
+    // Do not leave a half loaded cache
+    if (error) purge_cache(cache);
+
+    return error;
+}
@@ -0,0 +1,82 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "opcua_client_job_queue.h"
+//-----------------------------------------------------
+//  Jobs queue
+//-----------------------------------------------------
+// Intrusive multiple producers single consumer queue. Producers only swap
+// the head, the consumer owns the tail. The stub keeps the queue never empty
+struct client_job_queue{
+  client_job stub;
+  client_job *_Atomic head;
+  client_job *tail;
+};
+
+client_job_queue *new_job_queue(){
+    client_job_queue *queue = calloc(1, sizeof(client_job_queue));
+    if (!queue) return NULL;
+
+    atomic_init(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+    return queue;
+}
+
+// The queue must be empty, jobs are owned by their producers
+void delete_job_queue(client_job_queue *queue){
+    free( queue );
+}
+
+void push_job(client_job_queue *queue, client_job *job){
+    atomic_store_explicit(&job->next, NULL, memory_order_relaxed);
+    client_job *prev = atomic_exchange_explicit(&queue->head, job, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, job, memory_order_release);
+}
+
+// NULL if the queue is empty or a producer is in the middle of the push,
+// the producer wakes up the consumer after the push anyway
+client_job *pop_job(client_job_queue *queue){
+    client_job *tail = queue->tail;
+    client_job *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &queue->stub){
+        if (!next) return NULL;
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next){
+        queue->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) return NULL;
+
+    // The last job, put the stub behind it to take it out
+    push_job(queue, &queue->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next){
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
@@ -17,27 +17,141 @@
 ----------------------------------------------------------------*/
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include <open62541/types.h>
 #include <open62541/client_config_default.h>
 #include <open62541/client_highlevel.h>
+#include <open62541/client_highlevel_async.h>
 #include <open62541/client_subscriptions.h>
+#include <open62541/network_tcp.h>
 
 #include "utilities.h"
 #include "opcua_client_browse.h"
 #include "opcua_client_browse_queue.h"
+#include "opcua_client_browse_snapshot.h"
+#include "opcua_client_job_queue.h"
+#include "opcua_client_async.h"
+#include "opcua_client_subscription.h"
+#include "opcua_client_browse_misses.h"
 #include "opcua_client_loop.h"
 
-struct OPCUA_CLIENT {
+// Model changes, see below
+typedef struct{
+  UA_NodeId affected;
+  UA_Byte verb;
+} ModelChange;
+
+struct opcua_connection{
   UA_Client *client;
+  // The longest wait for the socket in ms, client timers are checked at least that often
   int cycle;
-  pthread_mutex_t lock;
-  bool run;
-} opcua_client;
+  // The connection of the client to wait for its socket
+  UA_Connection *uaConnection;
+  // The self pipes to wake up the update loop and the waiting caller,
+  // they live as long as the connection object not to signal a closed descriptor
+  int wakeup[2];
+  int completion[2];
+  // The update loop thread is the only owner of the client, the others pass it jobs
+  pthread_t thread;
+  bool hasThread;
+  atomic_bool exited;
+  client_job_queue *jobs;
+  // The TranslateBrowsePaths request for the queued paths is in flight
+  bool translating;
+  opcua_browse_queue *browseQueue;
+  UA_Double publishingInterval;
+  UA_UInt32 subscriptionId;
+  // The subscription publishes, the monitored values in the cache are actual.
+  // It is cleared when the subscription stops publishing or is deleted
+  bool publishing;
+  // Browse limits to refresh the cache on model changes
+  size_t maxNodesPerBrowse;
+  size_t maxBrowseRequests;
+  size_t maxReferencesPerNode;
+  // The browse cache snapshot is saved to cacheDir under the url key
+  char *url;
+  char *cacheDir;
+  // The snapshot is valid for this start of the server only
+  server_identity identity;
+  // The update loop thread stops it, the eport thread checks it
+  atomic_bool run;
+  // The session is lost, the update loop reconnects with a growing delay
+  bool connected;
+  UA_DateTime reconnectAt;
+  int reconnectDelay;
+  // Sent asynchronous requests not answered yet, they refer to NodeIds of the cache
+  size_t asyncPending;
+  // Counts new sessions, the registered nodes of the read sets are registered again
+  UA_UInt32 epoch;
+  // The server reports model changes
+  bool modelEvents;
+  // Every connection has its own address space
+  opcua_cache *cache;
+  opcua_browse_misses *misses;
+  opcua_subscriptions *subscriptions;
+  opcua_completions *completions;
+  struct{
+    ModelChange *array;
+    size_t used;
+    size_t size;
+    // The change is not specified, the whole cache is to be checked
+    bool all;
+  } modelChanges;
+};
+
+static char *subscribe_model_changes(opcua_connection *connection);
+static void handle_model_changes(opcua_connection *connection);
+static void on_subscription_inactive(UA_Client *client, UA_UInt32 subId, void *subContext);
+static void purge_model_changes(opcua_connection *connection);
+
+// Reconnect, see below
+static void connection_lost(opcua_connection *connection, UA_StatusCode sc);
+static void reconnect(opcua_connection *connection);
 
 //-----------------------------------------------------
 //  Internal utilities
 //-----------------------------------------------------
+static char *read_server_identity(UA_Client *client, server_identity *identity){
+    char *error = NULL;
+    UA_Variant value;
+
+    clear_server_identity( identity );
+
+    UA_Variant_init(&value);
+    UA_StatusCode sc = UA_Client_readValueAttribute(client, UA_NODEID_NUMERIC(0, UA_NS0ID_SERVER_SERVERSTATUS_STARTTIME), &value);
+    if (sc != UA_STATUSCODE_GOOD){
+        error = (char*)UA_StatusCode_name( sc );
+        goto on_clear;
+    }
+    if (!UA_Variant_hasScalarType(&value, &UA_TYPES[UA_TYPES_DATETIME])){
+        error = "invalid server start time";
+        goto on_clear;
+    }
+    identity->startTime = *(UA_DateTime *)value.data;
+    UA_Variant_clear(&value);
+
+    sc = UA_Client_readValueAttribute(client, UA_NODEID_NUMERIC(0, UA_NS0ID_SERVER_NAMESPACEARRAY), &value);
+    if (sc != UA_STATUSCODE_GOOD){
+        error = (char*)UA_StatusCode_name( sc );
+        goto on_clear;
+    }
+    if (!UA_Variant_hasArrayType(&value, &UA_TYPES[UA_TYPES_STRING])){
+        error = "invalid server namespace array";
+        goto on_clear;
+    }
+    // Take the array from the variant
+    identity->namespaces = (UA_String *)value.data;
+    identity->namespacesSize = value.arrayLength;
+    UA_Variant_init(&value);
+
+on_clear:
+    UA_Variant_clear(&value);
+    if (error) clear_server_identity( identity );
+    return error;
+}
+
 static void browse_item(char *path, UA_BrowsePath *browsePath){
 
     char **tokens = str_split( path, '/');
@@ -62,16 +176,110 @@ static void browse_item(char *path, UA_BrowsePath *browsePath){
     str_split_destroy( tokens );
 }
 
-static char *handle_browse_queue(){
+typedef struct{
+  char **paths;
+  size_t size;
+} translate_context;
+
+static void free_translate_context(translate_context *context){
+    for (size_t i=0; i < context->size; i++) free(context->paths[i]);
+    free(context->paths);
+    free(context);
+}
+
+// The found item is added to the cache
+static char *cache_browse_result(opcua_connection *connection, char *path, UA_BrowsePathResult *result){
+    if (result->statusCode != UA_STATUSCODE_GOOD) return (char *)UA_StatusCode_name( result->statusCode );
+    if (!result->targetsSize) return "no targets";
+
+    // The item could be found by the model changes meanwhile
+    if (lookup_path2nodeId_cache( connection->cache, path )) return NULL;
+
+    // The parents are not known, the whole path is the name of the item
+    return add_cache( connection->cache, NULL, path, &result->targets[result->targetsSize - 1].targetId.nodeId, UA_NODECLASS_VARIABLE, NULL );
+}
+
+// Only these statuses mean the path does not exist and go to the negative
+// cache. Others, like timeouts or server limits, pass and the path is tried again
+static bool is_path_missing(UA_StatusCode sc){
+    return sc == UA_STATUSCODE_BADNOMATCH
+        || sc == UA_STATUSCODE_BADNODEIDUNKNOWN
+        || sc == UA_STATUSCODE_BADBROWSENAMEINVALID;
+}
+
+static void on_translate_response(UA_Client *client, void *userdata, UA_UInt32 requestId, void *r){
+    translate_context *context = (translate_context *)userdata;
+    UA_TranslateBrowsePathsToNodeIdsResponse *response = (UA_TranslateBrowsePathsToNodeIdsResponse *)r;
+    opcua_connection *connection = UA_Client_getContext(client);
+
+    connection->translating = false;
+
+    if (response->responseHeader.serviceResult != UA_STATUSCODE_GOOD){
+        LOGERROR("translate browse paths error %s", UA_StatusCode_name( response->responseHeader.serviceResult ));
+        goto on_clear;
+    }
+
+    if (response->resultsSize != context->size){
+        LOGERROR("translate browse paths error: unexpected response size");
+        goto on_clear;
+    }
+
+    for (size_t i=0; i<context->size; i++){
+        UA_BrowsePathResult *result = &response->results[i];
+        if (result->statusCode != UA_STATUSCODE_GOOD && !is_path_missing( result->statusCode )){
+            // The path is queued again by the next request
+            LOGWARNING("unable to translate %s: %s", context->paths[i], UA_StatusCode_name( result->statusCode ));
+            continue;
+        }
+        char *error = result->statusCode == UA_STATUSCODE_GOOD
+            ? cache_browse_result( connection, context->paths[i], result )
+            // Do not queue the path again until the miss expires
+            : add_browse_miss( connection->misses, context->paths[i] );
+        if (error) LOGERROR("unable to cache the browse result of %s: %s", context->paths[i], error);
+    }
+
+on_clear:
+    free_translate_context( context );
+}
+
+// Queued paths are translated in background not to hold the update loop,
+// the next request is sent when the previous one is answered
+static char *handle_browse_queue(opcua_connection *connection){
     char *error = NULL;
+
+    if (connection->translating) return NULL;
+
     size_t size;
-    char **queue = get_browse_queue(&size);
+    char **queue = get_browse_queue(connection->browseQueue, &size);
 
     if (size && queue == NULL) return "out of memory";
     if (!size) return NULL;
 
-    UA_BrowsePath *browsePath = (UA_BrowsePath*)UA_Array_new(size, &UA_TYPES[UA_TYPES_BROWSEPATH]);
-    if (!browsePath) return "out of memory";
+    UA_BrowsePath *browsePath = NULL;
+    translate_context *context = calloc(1, sizeof(translate_context));
+    if (!context){
+        error = "out of memory";
+        goto on_clear;
+    }
+    context->paths = calloc(size, sizeof(char *));
+    if (!context->paths){
+        error = "out of memory";
+        goto on_clear;
+    }
+    for (size_t i=0; i < size; i++){
+        context->paths[i] = strdup( queue[i] );
+        if (!context->paths[i]){
+            error = "out of memory";
+            goto on_clear;
+        }
+        context->size++;
+    }
+
+    browsePath = (UA_BrowsePath*)UA_Array_new(size, &UA_TYPES[UA_TYPES_BROWSEPATH]);
+    if (!browsePath){
+        error = "out of memory";
+        goto on_clear;
+    }
 
     for (size_t i=0; i< size; i++) browse_item( queue[i], &browsePath[i]);
 
@@ -80,112 +288,274 @@ static char *handle_browse_queue(){
     request.browsePaths = browsePath;
     request.browsePathsSize = size;
 
-    pthread_mutex_lock(&opcua_client.lock);
-    UA_TranslateBrowsePathsToNodeIdsResponse response = UA_Client_Service_translateBrowsePathsToNodeIds(opcua_client.client, request);
-    pthread_mutex_unlock(&opcua_client.lock);
-
-    if (response.responseHeader.serviceResult != UA_STATUSCODE_GOOD){
-        error = (char *)UA_StatusCode_name( response.responseHeader.serviceResult );
+    UA_StatusCode sc = __UA_Client_AsyncService(connection->client, &request, &UA_TYPES[UA_TYPES_TRANSLATEBROWSEPATHSTONODEIDSREQUEST],
+        on_translate_response, &UA_TYPES[UA_TYPES_TRANSLATEBROWSEPATHSTONODEIDSRESPONSE], context, NULL);
+    if (sc != UA_STATUSCODE_GOOD){
+        error = (char *)UA_StatusCode_name( sc );
         goto on_clear;
     }
+    // The callback owns the context now
+    context = NULL;
+    connection->translating = true;
 
-    if (response.resultsSize != size){
-        error = "unexpected response size";
-        goto on_clear;
+on_clear:
+    if (browsePath) UA_Array_delete(browsePath,size,&UA_TYPES[UA_TYPES_BROWSEPATH]);
+    if (context) free_translate_context( context );
+    free( queue );
+    purge_browse_queue(connection->browseQueue);
+    return error;
+}
+
+//-----------------------------------------------------
+//  Update loop
+//-----------------------------------------------------
+// The update loop sleeps until the server sends something, the eport thread
+// wakes it up or the cycle passes
+//
+// The poll function does not get the client context, every thread
+// polls only its own connection
+static __thread opcua_connection *__polling = NULL;
+
+static UA_StatusCode poll_connection(UA_Connection *uaConnection, UA_UInt32 timeout, const UA_Logger *logger){
+    if (__polling) __polling->uaConnection = uaConnection;
+    return UA_ClientConnectionTCP_poll(uaConnection, timeout, logger);
+}
+
+static void signal_pipe(int fd){
+    char signal = 1;
+    // The full pipe already has the signal
+    if (write(fd, &signal, 1) < 0) LOGTRACE("the pipe is already signaled");
+}
+
+static void drain_pipe(int fd){
+    char buffer[64];
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+}
+
+static void wait_update_loop(opcua_connection *connection){
+    struct pollfd fds[2];
+    nfds_t size = 0;
+
+    fds[size].fd = connection->wakeup[0];
+    fds[size++].events = POLLIN;
+
+    if (connection->uaConnection && connection->uaConnection->sockfd >= 0){
+        fds[size].fd = connection->uaConnection->sockfd;
+        fds[size++].events = POLLIN;
     }
 
-    for (size_t i=0; i<size; i++){
-        if (response.results[i].statusCode != UA_STATUSCODE_GOOD) continue;
-        size_t depth = response.results[i].targetsSize;
+    if (poll(fds, size, connection->cycle) <= 0) return;
+
+    // Signals are merged, drain the pipe
+    if (fds[0].revents) drain_pipe( connection->wakeup[0] );
+}
+
+static void wakeup_update_loop(opcua_connection *connection){
+    signal_pipe(connection->wakeup[1]);
+}
+
+//-----------------------------------------------------
+//  Jobs
+//-----------------------------------------------------
+// Only the update loop thread touches the client. The eport thread pushes
+// jobs to the lock-free queue and waits for them to be done, so requests
+// go in between the background work instead of waiting for the lock
+static void complete_job(opcua_connection *connection, client_job *job){
+    atomic_store_explicit(&job->done, true, memory_order_release);
+    signal_pipe(connection->completion[1]);
+}
 
-        UA_NodeId *nodeIdCopy = UA_NodeId_new();
-        UA_NodeId_copy(&response.results[i].targets[depth -1].targetId.nodeId, nodeIdCopy);
-        
-        add_cache( strdup(queue[i]), nodeIdCopy, UA_NODECLASS_VARIABLE );
+// The cancel error is returned to the waiting callers without running their jobs
+static void handle_jobs(opcua_connection *connection, char *cancel){
+    client_job *job;
+    while ((job = pop_job(connection->jobs))){
+        // Not waited jobs are released by the handler
+        bool wait = job->wait;
+        if (wait && cancel){
+            job->error = cancel;
+        }else{
+            job->handler( job );
+        }
+        if (wait) complete_job(connection, job);
     }
+}
 
-on_clear:
-    UA_Array_delete(browsePath,size,&UA_TYPES[UA_TYPES_BROWSEPATH]);
-    UA_TranslateBrowsePathsToNodeIdsResponse_clear(&response);
-    purge_browse_queue();
-    return error;
+static char *run_job(opcua_connection *connection, client_job *job, client_job_handler handler){
+    job->handler = handler;
+    job->wait = true;
+    job->error = NULL;
+    atomic_init(&job->done, false);
+
+    if (!atomic_load(&connection->run)) return "no connection";
+
+    push_job( connection->jobs, job );
+    wakeup_update_loop(connection);
+
+    struct pollfd fd = { .fd = connection->completion[0], .events = POLLIN };
+    while (!atomic_load_explicit(&job->done, memory_order_acquire)){
+        // The update loop is gone, nobody else takes the queue
+        if (atomic_load(&connection->exited)){
+            handle_jobs(connection, "no connection");
+            continue;
+        }
+        poll(&fd, 1, -1);
+        drain_pipe( connection->completion[0] );
+    }
+
+    return job->error;
+}
+
+typedef struct{
+  client_job job;
+  opcua_connection *connection;
+  char *path;
+} browse_path_job;
+
+static void browse_path_handler(client_job *job){
+    browse_path_job *j = (browse_path_job *)job;
+    char *error = add_browse_queue( j->connection->browseQueue, j->path );
+    if (error) LOGERROR("unable to queue %s for browsing: %s", j->path, error);
+    free( j->path );
+    free( j );
+}
+
+// The path is not in the cache, the update loop asks the server for it.
+// The caller does not wait for the result
+char *queue_browse_path(opcua_connection *connection, char *path){
+    browse_path_job *job = calloc(1, sizeof(browse_path_job));
+    if (!job) return "out of memory";
+    job->path = strdup( path );
+    if (!job->path){
+        free( job );
+        return "out of memory";
+    }
+    job->job.handler = browse_path_handler;
+    job->connection = connection;
+
+    push_job( connection->jobs, &job->job );
+    wakeup_update_loop(connection);
+    return NULL;
 }
 
 static void *update_loop_thread(void *arg) {
+    opcua_connection *connection = (opcua_connection *)arg;
     LOGINFO("starting the update loop thread");
 
     char *error;
     UA_StatusCode sc;
 
-    while(opcua_client.run){
-        // Wait for the next cycle
-        usleep( opcua_client.cycle );
+    __polling = connection;
 
-        LOGTRACE("run iterate");
-        // get the lock
-        pthread_mutex_lock(&opcua_client.lock);
+    while(atomic_load(&connection->run)){
+        // Wait for the data, the signal or the next cycle
+        wait_update_loop(connection);
+        if (!atomic_load(&connection->run)) break;
+
+        if (!connection->connected){
+            // Requests fail at once while there is no session
+            handle_jobs(connection, "no connection");
+            reconnect(connection);
+            continue;
+        }
+
+        // Requests of the eport thread go first
+        handle_jobs(connection, NULL);
+        if (!connection->connected) continue;
 
+        LOGTRACE("run iterate");
         // Do the update
-        sc = UA_Client_run_iterate(opcua_client.client, 0);
+        sc = UA_Client_run_iterate(connection->client, 0);
         if (sc != UA_STATUSCODE_GOOD){
-            error = (char *)UA_StatusCode_name( sc );
+            connection_lost(connection, sc);
+            continue;
+        }
+        if (connection->subscriptionId && connection->publishing){
+            // The server has not missed a publish yet, the monitored values are actual
+            touch_value_cache(connection->cache);
         }
-        pthread_mutex_unlock(&opcua_client.lock);
 
-        error = handle_browse_queue();
-        if (error) LOGERROR("handle browse queue error %s", error);
+        // Apply the model changes reported by the server
+        handle_model_changes(connection);
 
-        if (error){
-            LOGERROR("update loop error %s", error);
-            break;
+        // Removed nodes are reclaimed when no request refers to them
+        if (!connection->asyncPending && !has_completions(connection->completions)
+            && compact_cache(connection->cache)){
+            LOGDEBUG("the browse cache is compacted");
         }
+
+        error = handle_browse_queue(connection);
+        if (error) LOGERROR("handle browse queue error %s", error);
     }
 
     LOGINFO("exit the update loop thread");
-    opcua_client.run = false;
-    UA_Client_disconnect(opcua_client.client);
-    UA_Client_delete(opcua_client.client);
-    opcua_client.client = NULL;
-
-    pthread_mutex_destroy(&opcua_client.lock);
+    atomic_store(&connection->run, false);
+
+    // Release the callers waiting for their jobs
+    handle_jobs(connection, "no connection");
+    atomic_store(&connection->exited, true);
+    signal_pipe(connection->completion[1]);
+
+    UA_Client_disconnect(connection->client);
+    UA_Client_delete(connection->client);
+    connection->client = NULL;
+
+    connection->subscriptionId = 0;
+    connection->publishing = false;
+    connection->uaConnection = NULL;
+    connection->translating = false;
+
+    purge_subscriptions(connection->subscriptions);
+    purge_notifications(connection->subscriptions);
+    purge_model_changes(connection);
+
+    // The cache could be extended by the browse queue, keep it for the next start.
+    // Without the identity of the server the snapshot could not be loaded anyway
+    if (connection->cacheDir){
+        if (connection->identity.namespaces){
+            error = save_browse_snapshot(connection->cache, connection->cacheDir, connection->url, &connection->identity);
+            if (error) LOGERROR("unable to save the browse cache snapshot: %s", error);
+        }
+        free(connection->cacheDir);
+        connection->cacheDir = NULL;
+    }
+    clear_server_identity( &connection->identity );
+    if (connection->url){
+        free(connection->url);
+        connection->url = NULL;
+    }
 
-    purge_cache();
+    purge_cache(connection->cache);
+    purge_browse_misses(connection->misses);
 
     return NULL;
 }
 
-static char *init_update_loop(int cycle){
+static char *init_update_loop(opcua_connection *connection, int cycle){
     char *error = NULL;
 
-    opcua_client.run = true;
-    opcua_client.cycle = cycle ? cycle * 1000 : 100000; // default 100 ms
+    atomic_store(&connection->run, true);
+    connection->cycle = cycle ? cycle : 100; // default 100 ms
 
-    // As the open62541 is not thread safe we use mutex
-    if (pthread_mutex_init(&opcua_client.lock, NULL)) {
-        error = "mutex init has failed";
-        goto on_error;
-    }
+    atomic_store(&connection->exited, false);
 
-    // The server is going to run in a dedicated thread
-    pthread_t updateThread;
-
-    // Launch the client thread
-    int res = pthread_create( &updateThread, NULL, &update_loop_thread, NULL);
+    // As the open62541 is not thread safe the client runs in a dedicated thread,
+    // the others pass it jobs
+    int res = pthread_create( &connection->thread, NULL, &update_loop_thread, connection);
 
     if (res !=0 ){
         error = "unable to launch the update loop thread";
-        pthread_mutex_destroy(&opcua_client.lock);
         goto on_error;
     }
+    connection->hasThread = true;
  
    return error;
 
 on_error:
-    opcua_client.run = false;
+    atomic_store(&connection->run, false);
     return error;
 }
 
-static char* check_connected( UA_StatusCode sc ){
+static char* check_connected(opcua_connection *connection, UA_StatusCode sc ){
     if (sc != UA_STATUSCODE_BADCONNECTIONCLOSED 
     && sc != UA_STATUSCODE_BADCONNECTIONREJECTED
     && sc != UA_STATUSCODE_BADDISCONNECT
@@ -193,7 +563,7 @@ static char* check_connected( UA_StatusCode sc ){
     && sc != UA_STATUSCODE_BADSERVERNOTCONNECTED){
         return (char*)UA_StatusCode_name( sc );
     }else{
-        stop();
+        connection_lost(connection, sc);
         return "no connection";
     }
 }
@@ -201,7 +571,76 @@ static char* check_connected( UA_StatusCode sc ){
 //-----------------------------------------------------
 //  API
 //-----------------------------------------------------
-char *start(char *url, char *certificate, char *privateKey, char *login, char *pass, int cycle, size_t maxNodesPerBrowse){
+opcua_connection *new_connection(){
+    opcua_connection *connection = calloc(1, sizeof(opcua_connection));
+    if (!connection) return NULL;
+
+    connection->wakeup[0] = connection->wakeup[1] = -1;
+    connection->completion[0] = connection->completion[1] = -1;
+
+    if (pipe(connection->wakeup) || pipe(connection->completion)) goto on_error;
+    fcntl(connection->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(connection->wakeup[1], F_SETFL, O_NONBLOCK);
+    fcntl(connection->completion[0], F_SETFL, O_NONBLOCK);
+    fcntl(connection->completion[1], F_SETFL, O_NONBLOCK);
+
+    connection->jobs = new_job_queue();
+    connection->browseQueue = new_browse_queue();
+    connection->cache = new_cache();
+    connection->misses = new_browse_misses();
+    connection->subscriptions = new_subscriptions();
+    connection->completions = new_completions();
+    if (!connection->jobs || !connection->browseQueue || !connection->cache || !connection->misses
+        || !connection->subscriptions || !connection->completions) goto on_error;
+
+    return connection;
+
+on_error:
+    delete_connection( connection );
+    return NULL;
+}
+
+void delete_connection(opcua_connection *connection){
+    if (!connection) return;
+
+    // The update loop releases the client, the cache is released here
+    if (connection->hasThread){
+        stop( connection );
+        pthread_join(connection->thread, NULL);
+        connection->hasThread = false;
+    }
+
+    for (int i = 0; i < 2; i++){
+        if (connection->wakeup[i] >= 0) close(connection->wakeup[i]);
+        if (connection->completion[i] >= 0) close(connection->completion[i]);
+    }
+
+    delete_job_queue( connection->jobs );
+    delete_browse_queue( connection->browseQueue );
+    delete_cache( connection->cache );
+    delete_browse_misses( connection->misses );
+    delete_subscriptions( connection->subscriptions );
+    delete_completions( connection->completions );
+    free( connection );
+}
+
+opcua_cache *connection_cache(opcua_connection *connection){
+    return connection->cache;
+}
+
+opcua_browse_misses *connection_misses(opcua_connection *connection){
+    return connection->misses;
+}
+
+opcua_subscriptions *connection_subscriptions(opcua_connection *connection){
+    return connection->subscriptions;
+}
+
+opcua_completions *connection_completions(opcua_connection *connection){
+    return connection->completions;
+}
+
+char *start(opcua_connection *connection, char *url, char *certificate, char *privateKey, char *login, char *pass, int cycle, size_t maxNodesPerBrowse, size_t maxBrowseRequests, size_t maxReferencesPerNode, int publishingInterval, char *cacheDir){
     char *error = NULL;
     UA_StatusCode sc;
 
@@ -209,17 +648,23 @@ char *start(char *url, char *certificate, char *privateKey, char *login, char *p
     UA_ByteString *key = NULL;
     char *appURI = NULL;
     
-    if (opcua_client.client) return "already started";
+    // Wait for the previous update loop to release the connection
+    if (connection->hasThread && !atomic_load(&connection->run)){
+        pthread_join(connection->thread, NULL);
+        connection->hasThread = false;
+    }
+
+    if (connection->client) return "already started";
 
     // Create the client object
-    opcua_client.client = UA_Client_new();
-    if (!opcua_client.client){
+    connection->client = UA_Client_new();
+    if (!connection->client){
         error = "unable to allocate the connection object";
         goto on_error;
     }
 
     // get the config object
-    UA_ClientConfig *config = UA_Client_getConfig(opcua_client.client);
+    UA_ClientConfig *config = UA_Client_getConfig(connection->client);
 
     // Configure the connection
     if ( certificate ){
@@ -269,51 +714,128 @@ char *start(char *url, char *certificate, char *privateKey, char *login, char *p
         UA_ClientConfig_setDefault(config);
     }
 
+    // Keep the connection to wait for its socket in the update loop
+    config->pollConnectionFunc = poll_connection;
+    // Callbacks find their connection by the client
+    config->clientContext = connection;
+    config->subscriptionInactivityCallback = on_subscription_inactive;
+    __polling = connection;
+
     if (login){
         // Authorized access
         LOGINFO("authorized connection to %s, user %s", url,login);
-        sc = UA_Client_connectUsername(opcua_client.client, url, login, pass);
+        sc = UA_Client_connectUsername(connection->client, url, login, pass);
     }else{
         LOGINFO("anonymous connection to %s", url);
-        sc = UA_Client_connect(opcua_client.client, url);
+        sc = UA_Client_connect(connection->client, url);
     }
     if(sc != UA_STATUSCODE_GOOD) {
         error = (char*)UA_StatusCode_name( sc );
         goto on_error;
     }
 
-    LOGINFO("build browse cache...");
-    error = build_browse_cache( opcua_client.client, maxNodesPerBrowse );
-    if (error) goto on_error;
+    // If the limit is not defined by the caller it is negotiated with the server
+    if (!maxNodesPerBrowse) maxNodesPerBrowse = read_browse_limits( connection->client );
+
+    // The snapshot is bound to the start time and the namespaces of the server,
+    // the restart of the server is detected by the start time on reconnect
+    error = read_server_identity( connection->client, &connection->identity );
+    if (error){
+        LOGINFO("unable to read the server identity: %s", error);
+        error = NULL;
+    }
+
+    bool loaded = false;
+    if (cacheDir && connection->identity.namespaces){
+        LOGINFO("load browse cache snapshot...");
+        error = load_browse_snapshot( connection->cache, cacheDir, url, &connection->identity );
+        if (error){
+            LOGINFO("browse cache snapshot is not loaded: %s", error);
+            error = NULL;
+        }else{
+            loaded = true;
+        }
+    }
+
+    if (!loaded){
+        LOGINFO("build browse cache...");
+        error = build_browse_cache( connection->client, connection->cache, maxNodesPerBrowse, maxBrowseRequests ? maxBrowseRequests : 4, maxReferencesPerNode );
+        if (error) goto on_error;
+
+        if (cacheDir && connection->identity.namespaces){
+            error = save_browse_snapshot( connection->cache, cacheDir, url, &connection->identity );
+            if (error){
+                LOGERROR("unable to save the browse cache snapshot: %s", error);
+                error = NULL;
+            }
+        }
+    }
+
+    connection->subscriptionId = 0;
+    connection->publishing = false;
+    connection->publishingInterval = publishingInterval ? publishingInterval : 500; // default 500 ms
+    connection->maxNodesPerBrowse = maxNodesPerBrowse;
+    connection->maxBrowseRequests = maxBrowseRequests ? maxBrowseRequests : 4;
+    connection->maxReferencesPerNode = maxReferencesPerNode;
+
+    // The cache is kept in sync with the server address space.
+    // Not every server supports model change events, it is not an error
+    error = subscribe_model_changes(connection);
+    connection->modelEvents = !error;
+    if (error){
+        LOGINFO("model change events are not available: %s", error);
+        error = NULL;
+    }
+    // The server could change while the client was away, the loaded cache
+    // serves the requests while the update loop refreshes it
+    if (loaded) connection->modelChanges.all = true;
+    connection->connected = true;
+
+    connection->url = strdup( url );
+    connection->cacheDir = cacheDir ? strdup( cacheDir ) : NULL;
 
     LOGINFO("enter the update loop");
-    error = init_update_loop( cycle );
+    error = init_update_loop(connection, cycle);
     if (error) goto on_error;
 
+    __polling = NULL;
     return NULL;
 
 
 on_error:
-    if (opcua_client.client){
-        UA_Client_disconnect( opcua_client.client );
-        UA_Client_delete( opcua_client.client );
+    if (connection->client){
+        UA_Client_disconnect( connection->client );
+        UA_Client_delete( connection->client );
     }
-    opcua_client.client = NULL;
-    opcua_client.run = false;
+    connection->client = NULL;
+    connection->uaConnection = NULL;
+    atomic_store(&connection->run, false);
+
+    if (connection->url) free(connection->url);
+    if (connection->cacheDir) free(connection->cacheDir);
+    connection->url = NULL;
+    connection->cacheDir = NULL;
+    clear_server_identity( &connection->identity );
+
+    purge_model_changes(connection);
+    purge_cache(connection->cache);
+    purge_browse_misses(connection->misses);
 
     if (appURI)free(appURI);
     if (cert)UA_ByteString_delete( cert );
     if (key) UA_ByteString_delete( key );
 
+    __polling = NULL;
     return error;
 }
 
-void stop(){
-    opcua_client.run = false;
+void stop(opcua_connection *connection){
+    atomic_store(&connection->run, false);
+    wakeup_update_loop(connection);
 }
 
-bool is_started(){
-    return opcua_client.run;
+bool is_started(opcua_connection *connection){
+    return atomic_load(&connection->run);
 }
 
 char* browse_servers(char *host, int port, char ***urls){
@@ -395,7 +917,7 @@ on_clear:
     return error;
 }
 
-char *read_values(size_t size, UA_NodeId **nodeId, UA_DataValue **values){
+static char *service_read(opcua_connection *connection, size_t size, UA_NodeId **nodeId, UA_DataValue **values){
     char *error = NULL;
 
     UA_ReadRequest request;
@@ -413,14 +935,11 @@ char *read_values(size_t size, UA_NodeId **nodeId, UA_DataValue **values){
     }
     request.nodesToReadSize = size;    
     
-    // Get the lock
-    pthread_mutex_lock(&opcua_client.lock);
-    UA_ReadResponse response = UA_Client_Service_read(opcua_client.client, request);
-    pthread_mutex_unlock(&opcua_client.lock);
+    UA_ReadResponse response = UA_Client_Service_read(connection->client, request);
 
     UA_StatusCode sc = response.responseHeader.serviceResult;
     if(sc != UA_STATUSCODE_GOOD) {
-        error = check_connected(sc);
+        error = check_connected(connection, sc);
         goto on_clear;
     }
 
@@ -441,7 +960,7 @@ on_clear:
     return error;
 }
 
-char *write_values(size_t size, UA_NodeId **nodeId, UA_Variant **values, char ***results){
+static char *service_write(opcua_connection *connection, size_t size, UA_NodeId **nodeId, UA_Variant **values, char ***results){
     char *error = NULL;
 
     UA_WriteRequest request;
@@ -461,14 +980,11 @@ char *write_values(size_t size, UA_NodeId **nodeId, UA_Variant **values, char **
     }
     request.nodesToWriteSize = size;
 
-    // Get the lock
-    pthread_mutex_lock(&opcua_client.lock);
-    UA_WriteResponse response = UA_Client_Service_write(opcua_client.client, request);
-    pthread_mutex_unlock(&opcua_client.lock);
+    UA_WriteResponse response = UA_Client_Service_write(connection->client, request);
 
     UA_StatusCode sc = response.responseHeader.serviceResult;
     if(sc != UA_STATUSCODE_GOOD) {
-        error = check_connected(sc);
+        error = check_connected(connection, sc);
         goto on_clear;
     }
     if(response.resultsSize != size){
@@ -493,3 +1009,1191 @@ on_clear:
     return error;
 }
 
+// The paths are translated by one request. The found items go to the cache,
+// the paths the server does not know go to the negative cache
+static char *service_translate(opcua_connection *connection, size_t size, char **paths){
+    char *error = NULL;
+
+    UA_TranslateBrowsePathsToNodeIdsRequest request;
+    UA_TranslateBrowsePathsToNodeIdsRequest_init(&request);
+    UA_TranslateBrowsePathsToNodeIdsResponse response;
+    UA_TranslateBrowsePathsToNodeIdsResponse_init(&response);
+
+    request.browsePaths = (UA_BrowsePath*)UA_Array_new(size, &UA_TYPES[UA_TYPES_BROWSEPATH]);
+    if (!request.browsePaths){
+        error = "out of memory";
+        goto on_clear;
+    }
+    request.browsePathsSize = size;
+    for (size_t i=0; i < size; i++) browse_item( paths[i], &request.browsePaths[i] );
+
+    response = UA_Client_Service_translateBrowsePathsToNodeIds(connection->client, request);
+
+    UA_StatusCode sc = response.responseHeader.serviceResult;
+    if(sc != UA_STATUSCODE_GOOD) {
+        error = check_connected(connection, sc);
+        goto on_clear;
+    }
+    if(response.resultsSize != size){
+        error = "invalid response results size";
+        goto on_clear;
+    }
+
+    for (size_t i=0; i < size; i++){
+        UA_BrowsePathResult *result = &response.results[i];
+        if (result->statusCode == UA_STATUSCODE_GOOD){
+            char *_error = cache_browse_result(connection, paths[i], result);
+            if (_error) LOGERROR("unable to cache %s: %s", paths[i], _error);
+            continue;
+        }
+        if (!is_path_missing( result->statusCode )){
+            LOGWARNING("unable to translate %s: %s", paths[i], UA_StatusCode_name( result->statusCode ));
+            continue;
+        }
+        LOGDEBUG("path %s is not found: %s", paths[i], UA_StatusCode_name( result->statusCode ));
+        error = add_browse_miss(connection->misses, paths[i]);
+        if (error) goto on_clear;
+    }
+
+on_clear:
+    UA_TranslateBrowsePathsToNodeIdsRequest_clear(&request);
+    UA_TranslateBrowsePathsToNodeIdsResponse_clear(&response);
+    return error;
+}
+
+//-----------------------------------------------------
+//  Subscriptions
+//-----------------------------------------------------
+static void on_data_change(UA_Client *client, UA_UInt32 subId, void *subContext, UA_UInt32 monId, void *monContext, UA_DataValue *value){
+    opcua_connection *connection = UA_Client_getContext(client);
+    UA_NodeId *nodeId = (UA_NodeId *)monContext;
+    LOGTRACE("data change %d", monId);
+
+    // The publish response is the evidence the subscription is alive
+    connection->publishing = true;
+    touch_value_cache(connection->cache);
+
+    // The item outlives its node if the deletion failed, the node may be reclaimed
+    UA_UInt32 monitoredItemId;
+    if (!lookup_subscription(connection->subscriptions, nodeId, &monitoredItemId) || monitoredItemId != monId) return;
+
+    char *error = update_value_cache(connection->cache, nodeId, value, true);
+    if (error) LOGERROR("unable to cache the value of %s: %s", lookup_nodeId2path_cache( connection->cache, nodeId ), error);
+
+    error = add_notification(connection->subscriptions, nodeId, value);
+    if (error) LOGERROR("unable to queue notification for %s: %s", lookup_nodeId2path_cache( connection->cache, nodeId ), error);
+}
+
+// The client has not got a publish response or a keep-alive in time
+static void on_subscription_inactive(UA_Client *client, UA_UInt32 subId, void *subContext){
+    opcua_connection *connection = UA_Client_getContext(client);
+    if (subId != connection->subscriptionId) return;
+    LOGWARNING("subscription %u is inactive, the monitored values are read from the server", subId);
+    connection->publishing = false;
+}
+
+static void on_subscription_status(UA_Client *client, UA_UInt32 subId, void *subContext, UA_StatusChangeNotification *notification){
+    opcua_connection *connection = UA_Client_getContext(client);
+    if (subId != connection->subscriptionId || notification->status == UA_STATUSCODE_GOOD) return;
+    LOGWARNING("subscription %u status %s", subId, UA_StatusCode_name( notification->status ));
+    connection->publishing = false;
+}
+
+static void on_subscription_deleted(UA_Client *client, UA_UInt32 subId, void *subContext){
+    opcua_connection *connection = UA_Client_getContext(client);
+    if (subId == connection->subscriptionId) connection->publishing = false;
+}
+
+// The subscription is created on the first subscribe request.
+// Runs on the update loop thread, or in start before the thread is launched
+static char *ensure_subscription(opcua_connection *connection){
+    if (connection->subscriptionId) return NULL;
+
+    UA_CreateSubscriptionRequest request = UA_CreateSubscriptionRequest_default();
+    request.requestedPublishingInterval = connection->publishingInterval;
+
+    UA_CreateSubscriptionResponse response = UA_Client_Subscriptions_create(connection->client, request, NULL,
+        on_subscription_status, on_subscription_deleted);
+
+    UA_StatusCode sc = response.responseHeader.serviceResult;
+    if (sc == UA_STATUSCODE_GOOD){
+        connection->subscriptionId = response.subscriptionId;
+        connection->publishing = true;
+        LOGDEBUG("subscription %d created, publishing interval %f", response.subscriptionId, response.revisedPublishingInterval);
+    }
+    UA_CreateSubscriptionResponse_clear(&response);
+
+    if (sc != UA_STATUSCODE_GOOD) return check_connected(connection, sc);
+
+    return NULL;
+}
+
+static char *service_subscribe(opcua_connection *connection, size_t size, UA_NodeId **nodeId, char ***results){
+    char *error = NULL;
+    char **_results = NULL;
+
+    UA_CreateMonitoredItemsRequest request;
+    UA_CreateMonitoredItemsRequest_init(&request);
+    UA_CreateMonitoredItemsResponse response;
+    UA_CreateMonitoredItemsResponse_init(&response);
+
+    void **contexts = malloc(size * sizeof(void *));
+    UA_Client_DataChangeNotificationCallback *callbacks = malloc(size * sizeof(UA_Client_DataChangeNotificationCallback));
+    UA_Client_DeleteMonitoredItemCallback *deleteCallbacks = malloc(size * sizeof(UA_Client_DeleteMonitoredItemCallback));
+    request.itemsToCreate = UA_Array_new(size, &UA_TYPES[UA_TYPES_MONITOREDITEMCREATEREQUEST]);
+    if (!contexts || !callbacks || !deleteCallbacks || !request.itemsToCreate){
+        error = "out of memory";
+        goto on_clear;
+    }
+    request.itemsToCreateSize = size;
+
+    for (size_t i=0; i < size; i++){
+        request.itemsToCreate[i] = UA_MonitoredItemCreateRequest_default( *nodeId[i] );
+        UA_NodeId_copy(nodeId[i], &request.itemsToCreate[i].itemToMonitor.nodeId);
+        request.itemsToCreate[i].requestedParameters.samplingInterval = connection->publishingInterval;
+        contexts[i] = nodeId[i];
+        callbacks[i] = on_data_change;
+        deleteCallbacks[i] = NULL;
+    }
+
+    error = ensure_subscription(connection);
+    if (error) goto on_clear;
+
+    request.subscriptionId = connection->subscriptionId;
+    request.timestampsToReturn = UA_TIMESTAMPSTORETURN_BOTH;
+
+    response = UA_Client_MonitoredItems_createDataChanges(connection->client, request, contexts, callbacks, deleteCallbacks);
+
+    UA_StatusCode sc = response.responseHeader.serviceResult;
+    if(sc != UA_STATUSCODE_GOOD) {
+        error = check_connected(connection, sc);
+        goto on_clear;
+    }
+    if(response.resultsSize != size){
+        error = "invalid response results size";
+        goto on_clear;
+    }
+
+    _results = malloc(size * sizeof(char *));
+    if (!_results){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    for(size_t i=0; i<size; i++){
+        if(response.results[i].statusCode != UA_STATUSCODE_GOOD) {
+            _results[i] = (char *)UA_StatusCode_name( response.results[i].statusCode );
+            continue;
+        }
+        _results[i] = add_subscription( connection->subscriptions, nodeId[i], response.results[i].monitoredItemId );
+    }
+    *results = _results;
+
+on_clear:
+    if (contexts) free(contexts);
+    if (callbacks) free(callbacks);
+    if (deleteCallbacks) free(deleteCallbacks);
+    UA_CreateMonitoredItemsRequest_clear(&request);
+    UA_CreateMonitoredItemsResponse_clear(&response);
+    return error;
+}
+
+static char *service_unsubscribe(opcua_connection *connection, size_t size, UA_NodeId **nodeId, char ***results){
+    char *error = NULL;
+
+    UA_DeleteMonitoredItemsRequest request;
+    UA_DeleteMonitoredItemsRequest_init(&request);
+    UA_DeleteMonitoredItemsResponse response;
+    UA_DeleteMonitoredItemsResponse_init(&response);
+
+    char **_results = malloc(size * sizeof(char *));
+    UA_NodeId **subscribedIds = malloc(size * sizeof(UA_NodeId *));
+    request.monitoredItemIds = UA_Array_new(size, &UA_TYPES[UA_TYPES_UINT32]);
+    if (!_results || !subscribedIds || !request.monitoredItemIds){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    // Only subscribed items are sent to the server
+    size_t subscribed = 0;
+    for (size_t i=0; i < size; i++){
+        if (lookup_subscription(connection->subscriptions, nodeId[i], &request.monitoredItemIds[subscribed])){
+            subscribedIds[subscribed++] = nodeId[i];
+            _results[i] = NULL;
+        }else{
+            _results[i] = "not subscribed";
+        }
+    }
+    request.monitoredItemIdsSize = subscribed;
+    if (!subscribed) goto on_clear;
+
+    request.subscriptionId = connection->subscriptionId;
+    response = UA_Client_MonitoredItems_delete(connection->client, request);
+
+    UA_StatusCode sc = response.responseHeader.serviceResult;
+    if(sc != UA_STATUSCODE_GOOD) {
+        error = check_connected(connection, sc);
+        goto on_clear;
+    }
+    if(response.resultsSize != subscribed){
+        error = "invalid response results size";
+        goto on_clear;
+    }
+
+    // Map the results back to the requested items
+    size_t j = 0;
+    for(size_t i=0; i<size; i++){
+        if (_results[i]) continue;
+        if (response.results[j] != UA_STATUSCODE_GOOD){
+            _results[i] = (char *)UA_StatusCode_name( response.results[j] );
+        }
+        remove_subscription( connection->subscriptions, subscribedIds[j] );
+        release_value_cache( connection->cache, subscribedIds[j] );
+        j++;
+    }
+
+on_clear:
+    if (subscribedIds) free(subscribedIds);
+    UA_DeleteMonitoredItemsRequest_clear(&request);
+    UA_DeleteMonitoredItemsResponse_clear(&response);
+
+    if (!error){
+        *results = _results;
+    }else if (_results){
+        free(_results);
+    }
+    return error;
+}
+
+//-----------------------------------------------------
+//  Requests
+//-----------------------------------------------------
+// The services are called by the update loop, the eport thread waits
+typedef struct{
+  client_job job;
+  opcua_connection *connection;
+  UA_UInt32 id;
+  size_t size;
+  UA_NodeId **nodeId;
+  UA_Variant **values;
+  UA_DataValue **dataValues;
+  char **paths;
+  char ***results;
+} service_job;
+
+static void read_handler(client_job *job){
+    service_job *j = (service_job *)job;
+    job->error = service_read(j->connection, j->size, j->nodeId, j->dataValues);
+}
+
+static void write_handler(client_job *job){
+    service_job *j = (service_job *)job;
+    job->error = service_write(j->connection, j->size, j->nodeId, j->values, j->results);
+}
+
+typedef struct{
+  UA_NodeId *nodeId;
+  size_t index;
+  // The position in the request to the server, SIZE_MAX for subscribed nodes
+  size_t slot;
+} subscribe_item;
+
+static int compare_subscribe_items(const void *a, const void *b){
+    const subscribe_item *x = a, *y = b;
+    if (x->nodeId != y->nodeId) return x->nodeId < y->nodeId ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// A node is monitored once. The subscribed nodes are answered with "ok"
+// and the repeated ones share the result, otherwise the registry would lose
+// the id of the monitored item that keeps producing notifications
+static char *subscribe_new(opcua_connection *connection, size_t size, UA_NodeId **nodeId, char ***results){
+    char *error = NULL;
+    char **newResults = NULL;
+    size_t newSize = 0;
+    UA_UInt32 monitoredItemId;
+
+    char **_results = calloc(size + 1, sizeof(char *));
+    subscribe_item *items = malloc(size * sizeof(subscribe_item) + 1);
+    UA_NodeId **newIds = malloc(size * sizeof(UA_NodeId *) + 1);
+    if (!_results || !items || !newIds){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    for (size_t i = 0; i < size; i++){
+        items[i].nodeId = nodeId[i];
+        items[i].index = i;
+    }
+    qsort(items, size, sizeof(subscribe_item), compare_subscribe_items);
+
+    for (size_t i = 0; i < size; i++){
+        if (i && items[i].nodeId == items[i - 1].nodeId){
+            items[i].slot = items[i - 1].slot;
+        }else if (lookup_subscription(connection->subscriptions, items[i].nodeId, &monitoredItemId)){
+            items[i].slot = SIZE_MAX;
+        }else{
+            items[i].slot = newSize;
+            newIds[newSize++] = items[i].nodeId;
+        }
+    }
+    if (!newSize) goto on_done;
+
+    error = service_subscribe(connection, newSize, newIds, &newResults);
+    if (error) goto on_clear;
+
+    for (size_t i = 0; i < size; i++){
+        if (items[i].slot != SIZE_MAX) _results[ items[i].index ] = newResults[ items[i].slot ];
+    }
+
+on_done:
+    *results = _results;
+    _results = NULL;
+
+on_clear:
+    if (_results) free(_results);
+    if (items) free(items);
+    if (newIds) free(newIds);
+    if (newResults) free(newResults);
+    return error;
+}
+
+static void subscribe_handler(client_job *job){
+    service_job *j = (service_job *)job;
+    job->error = subscribe_new(j->connection, j->size, j->nodeId, j->results);
+}
+
+static void unsubscribe_handler(client_job *job){
+    service_job *j = (service_job *)job;
+    job->error = service_unsubscribe(j->connection, j->size, j->nodeId, j->results);
+}
+
+static void translate_handler(client_job *job){
+    service_job *j = (service_job *)job;
+    job->error = service_translate(j->connection, j->size, j->paths);
+}
+
+char *resolve_paths(opcua_connection *connection, size_t size, char **paths){
+    service_job job = { .connection = connection, .size = size, .paths = paths };
+    return run_job(connection, &job.job, translate_handler);
+}
+
+char *read_values(opcua_connection *connection, size_t size, UA_NodeId **nodeId, UA_DataValue **values){
+    service_job job = { .connection = connection, .size = size, .nodeId = nodeId, .dataValues = values };
+    return run_job(connection, &job.job, read_handler);
+}
+
+char *write_values(opcua_connection *connection, size_t size, UA_NodeId **nodeId, UA_Variant **values, char ***results){
+    service_job job = { .connection = connection, .size = size, .nodeId = nodeId, .values = values, .results = results };
+    return run_job(connection, &job.job, write_handler);
+}
+
+char *subscribe_values(opcua_connection *connection, size_t size, UA_NodeId **nodeId, char ***results){
+    service_job job = { .connection = connection, .size = size, .nodeId = nodeId, .results = results };
+    return run_job(connection, &job.job, subscribe_handler);
+}
+
+char *unsubscribe_values(opcua_connection *connection, size_t size, UA_NodeId **nodeId, char ***results){
+    service_job job = { .connection = connection, .size = size, .nodeId = nodeId, .results = results };
+    return run_job(connection, &job.job, unsubscribe_handler);
+}
+
+//-----------------------------------------------------
+//  Read sets
+//-----------------------------------------------------
+// The read request is built once and sent as is on every read.
+// The nodes are registered on the server with RegisterNodes, servers
+// give faster access to the registered nodes. The registered ids are valid
+// within the session only, they are requested again after reconnect
+struct opcua_read_set{
+  size_t size;
+  // The ids to register, copies of the cache ones
+  UA_NodeId *nodeIds;
+  UA_ReadRequest request;
+  bool registered;
+  UA_UInt32 epoch;
+};
+
+static void free_read_set(opcua_read_set *set){
+    if (set->nodeIds) UA_Array_delete(set->nodeIds, set->size, &UA_TYPES[UA_TYPES_NODEID]);
+    UA_ReadRequest_clear(&set->request);
+    free( set );
+}
+
+static void register_read_set_nodes(opcua_connection *connection, opcua_read_set *set){
+    UA_RegisterNodesRequest request;
+    UA_RegisterNodesRequest_init(&request);
+    request.nodesToRegister = set->nodeIds;
+    request.nodesToRegisterSize = set->size;
+
+    UA_RegisterNodesResponse response = UA_Client_Service_registerNodes(connection->client, request);
+
+    UA_StatusCode sc = response.responseHeader.serviceResult;
+    if (sc == UA_STATUSCODE_GOOD && response.registeredNodeIdsSize == set->size){
+        for (size_t i = 0; i < set->size; i++){
+            UA_NodeId_clear( &set->request.nodesToRead[i].nodeId );
+            // Take the id from the response
+            set->request.nodesToRead[i].nodeId = response.registeredNodeIds[i];
+            UA_NodeId_init( &response.registeredNodeIds[i] );
+        }
+    }else{
+        // Not every server supports the service, the plain ids work as well
+        LOGDEBUG("unable to register the nodes: %s", UA_StatusCode_name( sc ));
+        for (size_t i = 0; i < set->size; i++){
+            UA_NodeId_clear( &set->request.nodesToRead[i].nodeId );
+            UA_NodeId_copy( &set->nodeIds[i], &set->request.nodesToRead[i].nodeId );
+        }
+    }
+    set->registered = true;
+    set->epoch = connection->epoch;
+
+    UA_RegisterNodesResponse_clear(&response);
+}
+
+static void unregister_read_set_nodes(opcua_connection *connection, opcua_read_set *set){
+    // The ids of the previous sessions are not known to the server anymore
+    if (!set->registered || set->epoch != connection->epoch || !connection->connected) return;
+
+    UA_UnregisterNodesRequest request;
+    UA_UnregisterNodesRequest_init(&request);
+    request.nodesToUnregisterSize = set->size;
+    request.nodesToUnregister = UA_Array_new(set->size, &UA_TYPES[UA_TYPES_NODEID]);
+    if (!request.nodesToUnregister) return;
+
+    for (size_t i = 0; i < set->size; i++){
+        UA_NodeId_copy( &set->request.nodesToRead[i].nodeId, &request.nodesToUnregister[i] );
+    }
+
+    UA_UnregisterNodesResponse response = UA_Client_Service_unregisterNodes(connection->client, request);
+    UA_UnregisterNodesResponse_clear(&response);
+    UA_UnregisterNodesRequest_clear(&request);
+}
+
+static char *service_read_set(opcua_connection *connection, opcua_read_set *set, UA_DataValue **values){
+    char *error = NULL;
+
+    if (!set->registered || set->epoch != connection->epoch){
+        register_read_set_nodes(connection, set);
+    }
+
+    UA_ReadResponse response = UA_Client_Service_read(connection->client, set->request);
+
+    UA_StatusCode sc = response.responseHeader.serviceResult;
+    if(sc != UA_STATUSCODE_GOOD) {
+        error = check_connected(connection, sc);
+        goto on_clear;
+    }
+
+    if(response.resultsSize != set->size){
+        error = "invalid response results size";
+        goto on_clear;
+    }
+
+    // The results are taken from the response instead of the copy
+    *values = response.results;
+    response.results = NULL;
+    response.resultsSize = 0;
+
+on_clear:
+    UA_ReadResponse_clear(&response);
+    return error;
+}
+
+typedef struct{
+  client_job job;
+  opcua_connection *connection;
+  opcua_read_set *set;
+  UA_DataValue **values;
+} read_set_job;
+
+static void read_set_handler(client_job *job){
+    read_set_job *j = (read_set_job *)job;
+    job->error = service_read_set(j->connection, j->set, j->values);
+}
+
+static void unregister_read_set_handler(client_job *job){
+    read_set_job *j = (read_set_job *)job;
+    unregister_read_set_nodes(j->connection, j->set);
+}
+
+char *create_read_set(size_t size, UA_NodeId **nodeId, opcua_read_set **set){
+    char *error = NULL;
+
+    opcua_read_set *s = calloc(1, sizeof(opcua_read_set));
+    if (!s) return "out of memory";
+
+    UA_ReadRequest_init(&s->request);
+    s->size = size;
+    s->nodeIds = UA_Array_new(size, &UA_TYPES[UA_TYPES_NODEID]);
+    s->request.nodesToRead = UA_Array_new(size, &UA_TYPES[UA_TYPES_READVALUEID]);
+    if (!s->nodeIds || !s->request.nodesToRead){
+        error = "out of memory";
+        goto on_error;
+    }
+    s->request.nodesToReadSize = size;
+
+    for (size_t i = 0; i < size; i++){
+        UA_StatusCode sc = UA_NodeId_copy(nodeId[i], &s->nodeIds[i]);
+        if (sc == UA_STATUSCODE_GOOD) sc = UA_NodeId_copy(nodeId[i], &s->request.nodesToRead[i].nodeId);
+        if (sc != UA_STATUSCODE_GOOD){
+            error = (char*)UA_StatusCode_name( sc );
+            goto on_error;
+        }
+        s->request.nodesToRead[i].attributeId = UA_ATTRIBUTEID_VALUE;
+    }
+
+    *set = s;
+    return NULL;
+
+on_error:
+    free_read_set( s );
+    return error;
+}
+
+void delete_read_set(opcua_connection *connection, opcua_read_set *set){
+    if (!set) return;
+
+    // Nothing to unregister if the session is not started
+    read_set_job job = { .connection = connection, .set = set };
+    run_job(connection, &job.job, unregister_read_set_handler);
+
+    free_read_set( set );
+}
+
+char *read_set_values(opcua_connection *connection, opcua_read_set *set, UA_DataValue **values){
+    read_set_job job = { .connection = connection, .set = set, .values = values };
+    return run_job(connection, &job.job, read_set_handler);
+}
+
+//-----------------------------------------------------
+//  Asynchronous requests
+//-----------------------------------------------------
+// The caller waits only for the request to be sent. The answers of the server
+// go to the completions mailbox tagged by the caller's id, in any order.
+// The client calls the callbacks with an error when the connection is lost,
+// so every sent request is answered
+static void add_async_completion(opcua_connection *connection, opcua_completion *completion){
+    char *error = add_completion( connection->completions, completion );
+    if (error) LOGERROR("unable to queue the completion of the request %u: %s", completion->id, error);
+}
+
+// The completion takes the NodeIds of the context
+static opcua_completion *async_context(UA_UInt32 id, size_t size, UA_NodeId **nodeId){
+    opcua_completion *context = calloc(1, sizeof(opcua_completion));
+    if (!context) return NULL;
+
+    context->nodeId = malloc( size * sizeof(UA_NodeId *) );
+    if (!context->nodeId){
+        free( context );
+        return NULL;
+    }
+    memcpy(context->nodeId, nodeId, size * sizeof(UA_NodeId *));
+    context->id = id;
+    context->size = size;
+    return context;
+}
+
+static void on_async_read(UA_Client *client, void *userdata, UA_UInt32 requestId, UA_ReadResponse *response){
+    opcua_connection *connection = UA_Client_getContext(client);
+    opcua_completion *completion = (opcua_completion *)userdata;
+
+    connection->asyncPending--;
+
+    UA_StatusCode sc = response->responseHeader.serviceResult;
+    if (sc != UA_STATUSCODE_GOOD){
+        completion->error = (char *)UA_StatusCode_name( sc );
+    }else if (response->resultsSize != completion->size){
+        completion->error = "invalid response results size";
+    }else{
+        // Take the values from the response
+        completion->values = response->results;
+        response->results = NULL;
+        response->resultsSize = 0;
+    }
+
+    add_async_completion(connection, completion);
+    free( completion );
+}
+
+static void on_async_write(UA_Client *client, void *userdata, UA_UInt32 requestId, UA_WriteResponse *response){
+    opcua_connection *connection = UA_Client_getContext(client);
+    opcua_completion *completion = (opcua_completion *)userdata;
+
+    connection->asyncPending--;
+
+    UA_StatusCode sc = response->responseHeader.serviceResult;
+    if (sc != UA_STATUSCODE_GOOD){
+        completion->error = (char *)UA_StatusCode_name( sc );
+    }else if (response->resultsSize != completion->size){
+        completion->error = "invalid response results size";
+    }else{
+        completion->results = malloc( completion->size * sizeof(char *) );
+        if (!completion->results){
+            completion->error = "out of memory";
+        }else{
+            for (size_t i=0; i < completion->size; i++){
+                completion->results[i] = response->results[i] == UA_STATUSCODE_GOOD
+                    ? NULL
+                    : (char *)UA_StatusCode_name( response->results[i] );
+            }
+        }
+    }
+
+    add_async_completion(connection, completion);
+    free( completion );
+}
+
+static char *send_async_read(opcua_connection *connection, UA_UInt32 id, size_t size, UA_NodeId **nodeId){
+    char *error = NULL;
+
+    UA_ReadRequest request;
+    UA_ReadRequest_init(&request);
+
+    opcua_completion *context = async_context(id, size, nodeId);
+    request.nodesToRead = UA_Array_new(size, &UA_TYPES[UA_TYPES_READVALUEID]);
+    if (!context || !request.nodesToRead){
+        error = "out of memory";
+        goto on_clear;
+    }
+    for (size_t i=0; i < size; i++){
+        UA_ReadValueId_init(&request.nodesToRead[i]);
+        UA_NodeId_copy(nodeId[i], &request.nodesToRead[i].nodeId );
+        request.nodesToRead[i].attributeId = UA_ATTRIBUTEID_VALUE;
+    }
+    request.nodesToReadSize = size;
+
+    UA_StatusCode sc = UA_Client_sendAsyncReadRequest(connection->client, &request, on_async_read, context, NULL);
+    if (sc != UA_STATUSCODE_GOOD){
+        error = check_connected(connection, sc);
+        goto on_clear;
+    }
+    // The callback owns the context now
+    context = NULL;
+    connection->asyncPending++;
+
+on_clear:
+    if (context){
+        free( context->nodeId );
+        free( context );
+    }
+    UA_ReadRequest_clear(&request);
+    return error;
+}
+
+static char *send_async_write(opcua_connection *connection, UA_UInt32 id, size_t size, UA_NodeId **nodeId, UA_Variant **values){
+    char *error = NULL;
+
+    UA_WriteRequest request;
+    UA_WriteRequest_init(&request);
+
+    opcua_completion *context = async_context(id, size, nodeId);
+    request.nodesToWrite = UA_Array_new(size, &UA_TYPES[UA_TYPES_WRITEVALUE]);
+    if (!context || !request.nodesToWrite){
+        error = "out of memory";
+        goto on_clear;
+    }
+    for (size_t i=0; i < size; i++){
+        UA_WriteValue_init(&request.nodesToWrite[i]);
+        UA_NodeId_copy(nodeId[i], &request.nodesToWrite[i].nodeId );
+        request.nodesToWrite[i].attributeId = UA_ATTRIBUTEID_VALUE;
+        request.nodesToWrite[i].value.value = *values[i];
+        request.nodesToWrite[i].value.hasValue = true;
+    }
+    request.nodesToWriteSize = size;
+
+    UA_StatusCode sc = UA_Client_sendAsyncWriteRequest(connection->client, &request, on_async_write, context, NULL);
+    if (sc != UA_STATUSCODE_GOOD){
+        error = check_connected(connection, sc);
+        goto on_clear;
+    }
+    // The callback owns the context now
+    context = NULL;
+    connection->asyncPending++;
+
+on_clear:
+    if (context){
+        free( context->nodeId );
+        free( context );
+    }
+    UA_WriteRequest_clear(&request);
+    return error;
+}
+
+static void read_async_handler(client_job *job){
+    service_job *j = (service_job *)job;
+    job->error = send_async_read(j->connection, j->id, j->size, j->nodeId);
+}
+
+static void write_async_handler(client_job *job){
+    service_job *j = (service_job *)job;
+    job->error = send_async_write(j->connection, j->id, j->size, j->nodeId, j->values);
+}
+
+char *read_values_async(opcua_connection *connection, UA_UInt32 id, size_t size, UA_NodeId **nodeId){
+    service_job job = { .connection = connection, .id = id, .size = size, .nodeId = nodeId };
+    return run_job(connection, &job.job, read_async_handler);
+}
+
+char *write_values_async(opcua_connection *connection, UA_UInt32 id, size_t size, UA_NodeId **nodeId, UA_Variant **values){
+    service_job job = { .connection = connection, .id = id, .size = size, .nodeId = nodeId, .values = values };
+    return run_job(connection, &job.job, write_async_handler);
+}
+
+//-----------------------------------------------------
+//  Model changes
+//-----------------------------------------------------
+// The server reports changes of its address space by GeneralModelChangeEvents
+// and SemanticChangeEvents. Only the affected subtrees are browsed again, the
+// cache is updated in place. Changes are collected by the event callback
+// and applied by the update loop
+static void add_model_change(opcua_connection *connection, const UA_NodeId *affected, UA_Byte verb){
+    if (connection->modelChanges.all) return;
+
+    if (connection->modelChanges.used >= connection->modelChanges.size){
+        size_t size = connection->modelChanges.size ? connection->modelChanges.size * 2 : 16;
+        ModelChange *array = realloc(connection->modelChanges.array, size * sizeof(ModelChange));
+        if (!array){
+            // We are not able to track the change, check everything
+            connection->modelChanges.all = true;
+            return;
+        }
+        connection->modelChanges.array = array;
+        connection->modelChanges.size = size;
+    }
+
+    ModelChange *change = &connection->modelChanges.array[connection->modelChanges.used];
+    if (UA_NodeId_copy(affected, &change->affected) != UA_STATUSCODE_GOOD){
+        connection->modelChanges.all = true;
+        return;
+    }
+    change->verb = verb;
+    connection->modelChanges.used++;
+}
+
+static void free_model_changes(ModelChange *array, size_t size){
+    for (size_t i = 0; i < size; i++){
+        UA_NodeId_clear( &array[i].affected );
+    }
+    free( array );
+}
+
+static void purge_model_changes(opcua_connection *connection){
+    free_model_changes(connection->modelChanges.array, connection->modelChanges.used);
+    connection->modelChanges.array = NULL;
+    connection->modelChanges.used = 0;
+    connection->modelChanges.size = 0;
+    connection->modelChanges.all = false;
+}
+
+static void on_model_change(UA_Client *client, UA_UInt32 subId, void *subContext, UA_UInt32 monId, void *monContext, size_t nEventFields, UA_Variant *eventFields){
+    opcua_connection *connection = UA_Client_getContext(client);
+    if (nEventFields < 2) return;
+
+    UA_Variant *changes = &eventFields[1];
+    size_t size = UA_Variant_isScalar(changes) ? 1 : changes->arrayLength;
+
+    if (changes->type == &UA_TYPES[UA_TYPES_MODELCHANGESTRUCTUREDATATYPE]){
+        UA_ModelChangeStructureDataType *data = (UA_ModelChangeStructureDataType *)changes->data;
+        for (size_t i = 0; i < size; i++){
+            add_model_change(connection, &data[i].affected, data[i].verb);
+        }
+    }else if (changes->type == &UA_TYPES[UA_TYPES_SEMANTICCHANGESTRUCTUREDATATYPE]){
+        UA_SemanticChangeStructureDataType *data = (UA_SemanticChangeStructureDataType *)changes->data;
+        for (size_t i = 0; i < size; i++){
+            add_model_change(connection, &data[i].affected, 0);
+        }
+    }else{
+        // BaseModelChangeEvent does not say what is changed
+        LOGDEBUG("model change event without changes");
+        connection->modelChanges.all = true;
+    }
+}
+
+// Runs on the update loop thread, or in start before the thread is launched
+static char *subscribe_model_changes(opcua_connection *connection){
+    char *error = ensure_subscription(connection);
+    if (error) return error;
+
+    // Select the event type and the list of changes
+    UA_QualifiedName eventTypeName = UA_QUALIFIEDNAME(0, "EventType");
+    UA_QualifiedName changesName = UA_QUALIFIEDNAME(0, "Changes");
+    UA_SimpleAttributeOperand select[2];
+    for (size_t i = 0; i < 2; i++){
+        UA_SimpleAttributeOperand_init(&select[i]);
+        select[i].typeDefinitionId = UA_NODEID_NUMERIC(0, UA_NS0ID_BASEEVENTTYPE);
+        select[i].browsePathSize = 1;
+        select[i].attributeId = UA_ATTRIBUTEID_VALUE;
+    }
+    select[0].browsePath = &eventTypeName;
+    select[1].browsePath = &changesName;
+
+    // OR( OfType(BaseModelChangeEventType), OfType(SemanticChangeEventType) ),
+    // the first element is the root of the filter
+    UA_NodeId types[2] = {
+        UA_NODEID_NUMERIC(0, UA_NS0ID_BASEMODELCHANGEEVENTTYPE),
+        UA_NODEID_NUMERIC(0, UA_NS0ID_SEMANTICCHANGEEVENTTYPE)
+    };
+    UA_LiteralOperand literals[2];
+    UA_ElementOperand elements[2];
+    UA_ExtensionObject operands[4];
+    UA_ContentFilterElement where[3];
+    for (size_t i = 0; i < 2; i++){
+        UA_LiteralOperand_init(&literals[i]);
+        UA_Variant_setScalar(&literals[i].value, &types[i], &UA_TYPES[UA_TYPES_NODEID]);
+        UA_ExtensionObject_setValue(&operands[i], &literals[i], &UA_TYPES[UA_TYPES_LITERALOPERAND]);
+
+        UA_ContentFilterElement_init(&where[i + 1]);
+        where[i + 1].filterOperator = UA_FILTEROPERATOR_OFTYPE;
+        where[i + 1].filterOperandsSize = 1;
+        where[i + 1].filterOperands = &operands[i];
+
+        elements[i].index = (UA_UInt32)(i + 1);
+        UA_ExtensionObject_setValue(&operands[2 + i], &elements[i], &UA_TYPES[UA_TYPES_ELEMENTOPERAND]);
+    }
+    UA_ContentFilterElement_init(&where[0]);
+    where[0].filterOperator = UA_FILTEROPERATOR_OR;
+    where[0].filterOperandsSize = 2;
+    where[0].filterOperands = &operands[2];
+
+    UA_EventFilter filter;
+    UA_EventFilter_init(&filter);
+    filter.selectClauses = select;
+    filter.selectClausesSize = 2;
+    filter.whereClause.elements = where;
+    filter.whereClause.elementsSize = 3;
+
+    // Events are raised by the Server object
+    UA_MonitoredItemCreateRequest item;
+    UA_MonitoredItemCreateRequest_init(&item);
+    item.itemToMonitor.nodeId = UA_NODEID_NUMERIC(0, UA_NS0ID_SERVER);
+    item.itemToMonitor.attributeId = UA_ATTRIBUTEID_EVENTNOTIFIER;
+    item.monitoringMode = UA_MONITORINGMODE_REPORTING;
+    item.requestedParameters.queueSize = 100;
+    item.requestedParameters.discardOldest = true;
+    UA_ExtensionObject_setValue(&item.requestedParameters.filter, &filter, &UA_TYPES[UA_TYPES_EVENTFILTER]);
+
+    UA_MonitoredItemCreateResult result = UA_Client_MonitoredItems_createEvent(connection->client,
+        connection->subscriptionId, UA_TIMESTAMPSTORETURN_NEITHER, item, NULL, on_model_change, NULL);
+
+    UA_StatusCode sc = result.statusCode;
+    UA_MonitoredItemCreateResult_clear(&result);
+    if (sc != UA_STATUSCODE_GOOD) return (char*)UA_StatusCode_name( sc );
+
+    LOGDEBUG("subscribed to model change events");
+    return NULL;
+}
+
+// Everything bound to the node is released before the node itself.
+// Runs on the update loop thread
+static void remove_node(void *context, UA_NodeId *nodeId){
+    opcua_connection *connection = (opcua_connection *)context;
+    UA_UInt32 monitoredItemId;
+    if (lookup_subscription(connection->subscriptions, nodeId, &monitoredItemId)){
+        UA_StatusCode sc = UA_Client_MonitoredItems_deleteSingle(connection->client, connection->subscriptionId, monitoredItemId);
+        if (sc != UA_STATUSCODE_GOOD) LOGDEBUG("unable to delete the monitored item %d: %s", monitoredItemId, UA_StatusCode_name( sc ));
+        remove_subscription( connection->subscriptions, nodeId );
+    }
+    remove_notification( connection->subscriptions, nodeId );
+    remove_cache( connection->cache, nodeId );
+}
+
+// Only the topmost folders are kept, a refresh covers the whole subtree
+static char *add_refresh_folder(opcua_connection *connection, UA_NodeId ***folders, size_t *size, UA_NodeId *folder){
+    for (size_t i = 0; i < *size; i++){
+        if (in_subtree_cache(connection->cache, (*folders)[i], folder)) return NULL;
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < *size; i++){
+        if (!in_subtree_cache(connection->cache, folder, (*folders)[i])) (*folders)[j++] = (*folders)[i];
+    }
+
+    UA_NodeId **array = realloc(*folders, (j + 1) * sizeof(UA_NodeId *));
+    if (!array) return "out of memory";
+    array[j] = folder;
+    *folders = array;
+    *size = j + 1;
+
+    return NULL;
+}
+
+// A new node is not in the cache yet, its parents are browsed instead.
+// Runs on the update loop thread
+static char *add_parent_folders(opcua_connection *connection, UA_NodeId **nodes, size_t size, UA_NodeId ***folders, size_t *foldersSize, bool *root){
+    char *error = NULL;
+
+    UA_BrowseRequest request;
+    UA_BrowseRequest_init(&request);
+    UA_BrowseResponse response;
+    UA_BrowseResponse_init(&response);
+
+    request.nodesToBrowse = UA_Array_new(size, &UA_TYPES[UA_TYPES_BROWSEDESCRIPTION]);
+    if (!request.nodesToBrowse) return "out of memory";
+    request.nodesToBrowseSize = size;
+
+    for (size_t i = 0; i < size; i++){
+        request.nodesToBrowse[i].browseDirection = UA_BROWSEDIRECTION_INVERSE;
+        request.nodesToBrowse[i].includeSubtypes = true;
+        request.nodesToBrowse[i].referenceTypeId = UA_NODEID_NUMERIC(0, UA_NS0ID_HIERARCHICALREFERENCES);
+        request.nodesToBrowse[i].nodeClassMask = UA_NODECLASS_OBJECT | UA_NODECLASS_VARIABLE;
+        UA_NodeId_copy(nodes[i], &request.nodesToBrowse[i].nodeId);
+    }
+
+    response = UA_Client_Service_browse(connection->client, request);
+    if (response.responseHeader.serviceResult != UA_STATUSCODE_GOOD){
+        error = (char*)UA_StatusCode_name( response.responseHeader.serviceResult );
+        goto on_clear;
+    }
+
+    UA_NodeId objects = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
+    for (size_t i = 0; i < response.resultsSize; i++){
+        // The node is already gone or it is out of the 'Objects' folder
+        if (response.results[i].statusCode != UA_STATUSCODE_GOOD) continue;
+
+        for (size_t j = 0; j < response.results[i].referencesSize; j++){
+            UA_NodeId *parent = &response.results[i].references[j].nodeId.nodeId;
+            if (UA_NodeId_equal(parent, &objects)){
+                *root = true;
+                continue;
+            }
+            UA_NodeId *folder = find_nodeId_cache( connection->cache, parent );
+            if (!folder) continue;
+            error = add_refresh_folder(connection, folders, foldersSize, folder);
+            if (error) goto on_clear;
+        }
+    }
+
+on_clear:
+    UA_BrowseRequest_clear(&request);
+    UA_BrowseResponse_clear(&response);
+    return error;
+}
+
+// The refresh takes many round trips, the requests of the eport thread
+// are served between them. Runs on the update loop thread
+static char *wait_crawl(void *context){
+    opcua_connection *connection = (opcua_connection *)context;
+
+    wait_update_loop(connection);
+    if (!atomic_load(&connection->run)) return "no connection";
+
+    handle_jobs(connection, NULL);
+    if (!connection->connected) return "no connection";
+
+    return NULL;
+}
+
+// Runs on the update loop thread
+static void handle_model_changes(opcua_connection *connection){
+    if (!connection->modelChanges.used && !connection->modelChanges.all) return;
+
+    // Take the changes, new ones may come while the cache is refreshed
+    ModelChange *changes = connection->modelChanges.array;
+    size_t size = connection->modelChanges.used;
+    bool root = connection->modelChanges.all;
+    connection->modelChanges.array = NULL;
+    connection->modelChanges.used = 0;
+    connection->modelChanges.size = 0;
+    connection->modelChanges.all = false;
+
+    char *error = NULL;
+    UA_NodeId **folders = NULL;
+    size_t foldersSize = 0;
+    UA_NodeId **unknown = NULL;
+    size_t unknownSize = 0;
+
+    if (root) goto on_refresh;
+
+    unknown = malloc( size * sizeof(UA_NodeId *) );
+    if (!unknown){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    // Deleted nodes are removed first not to browse them
+    UA_NodeId objects = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
+    for (size_t i = 0; i < size; i++){
+        if (!(changes[i].verb & UA_MODELCHANGESTRUCTUREVERBMASK_NODEDELETED)) continue;
+
+        UA_NodeId *node = find_nodeId_cache( connection->cache, &changes[i].affected );
+        if (!node) continue;
+
+        LOGDEBUG("node %s is deleted", lookup_nodeId2path_cache( connection->cache, node ));
+        drop_browse_cache(connection->cache, node, remove_node, connection);
+    }
+
+    // Other changes are browsed again
+    for (size_t i = 0; i < size; i++){
+        if (changes[i].verb & UA_MODELCHANGESTRUCTUREVERBMASK_NODEDELETED) continue;
+
+        if (UA_NodeId_equal(&changes[i].affected, &objects)){
+            root = true;
+            goto on_refresh;
+        }
+
+        UA_NodeId *node = find_nodeId_cache( connection->cache, &changes[i].affected );
+        if (node){
+            error = add_refresh_folder(connection, &folders, &foldersSize, node);
+            if (error) goto on_clear;
+        }else{
+            unknown[unknownSize++] = &changes[i].affected;
+        }
+    }
+
+    if (unknownSize){
+        error = add_parent_folders(connection, unknown, unknownSize, &folders, &foldersSize, &root);
+        if (error) goto on_clear;
+    }
+
+on_refresh:
+    if (root){
+        LOGDEBUG("refresh the browse cache");
+        error = refresh_browse_cache(connection->client, connection->cache, NULL, connection->maxNodesPerBrowse,
+            connection->maxBrowseRequests, connection->maxReferencesPerNode, remove_node, wait_crawl, connection);
+        goto on_clear;
+    }
+
+    for (size_t i = 0; i < foldersSize; i++){
+        LOGDEBUG("refresh the browse cache folder %s", lookup_nodeId2path_cache( connection->cache, folders[i] ));
+        error = refresh_browse_cache(connection->client, connection->cache, folders[i], connection->maxNodesPerBrowse,
+            connection->maxBrowseRequests, connection->maxReferencesPerNode, remove_node, wait_crawl, connection);
+        if (error) goto on_clear;
+    }
+
+on_clear:
+    if (error) LOGERROR("unable to apply model changes: %s", error);
+    if (folders) free(folders);
+    if (unknown) free(unknown);
+    free_model_changes(changes, size);
+}
+
+//-----------------------------------------------------
+//  Reconnect
+//-----------------------------------------------------
+// The lost connection does not stop the update loop. The client object, the
+// browse cache and the subscribed items survive, the loop connects again with
+// a growing delay. open62541 activates the existing session on the new secure
+// channel if the server still keeps it, then the subscription lives on.
+// Otherwise the subscription and its monitored items are created again
+#define RECONNECT_MIN_DELAY 500
+#define RECONNECT_MAX_DELAY 30000
+
+static void connection_lost(opcua_connection *connection, UA_StatusCode sc){
+    if (!connection->connected) return;
+
+    LOGERROR("connection to %s is lost: %s", connection->url, UA_StatusCode_name( sc ));
+    connection->connected = false;
+    // Changes of the outage are missed until the next data change comes
+    connection->publishing = false;
+    connection->uaConnection = NULL;
+
+    // The session is kept to be activated again
+    UA_Client_disconnectSecureChannel(connection->client);
+
+    connection->reconnectDelay = RECONNECT_MIN_DELAY;
+    connection->reconnectAt = UA_DateTime_nowMonotonic() + connection->reconnectDelay * UA_DATETIME_MSEC;
+}
+
+// The lost subscription means the session is a new one
+static char *restore_subscription(opcua_connection *connection, bool *lost){
+    char *error = NULL;
+    UA_NodeId **nodeIds = NULL;
+    char **results = NULL;
+    size_t size = 0;
+
+    if (!connection->subscriptionId) return NULL;
+
+    // The subscription is alive if the server accepts its parameters
+    UA_CreateSubscriptionRequest defaults = UA_CreateSubscriptionRequest_default();
+    UA_ModifySubscriptionRequest request;
+    UA_ModifySubscriptionRequest_init(&request);
+    request.subscriptionId = connection->subscriptionId;
+    request.requestedPublishingInterval = connection->publishingInterval;
+    request.requestedLifetimeCount = defaults.requestedLifetimeCount;
+    request.requestedMaxKeepAliveCount = defaults.requestedMaxKeepAliveCount;
+    request.maxNotificationsPerPublish = defaults.maxNotificationsPerPublish;
+    request.priority = defaults.priority;
+
+    UA_ModifySubscriptionResponse response = UA_Client_Subscriptions_modify(connection->client, request);
+    UA_StatusCode sc = response.responseHeader.serviceResult;
+    UA_ModifySubscriptionResponse_clear(&response);
+
+    if (sc == UA_STATUSCODE_GOOD){
+        LOGINFO("subscription %u is restored", connection->subscriptionId);
+        return NULL;
+    }
+
+    LOGINFO("subscription %u is lost: %s, create it again", connection->subscriptionId, UA_StatusCode_name( sc ));
+    *lost = true;
+    // Release what is left of the old subscription in the client
+    UA_Client_Subscriptions_deleteSingle(connection->client, connection->subscriptionId);
+    connection->subscriptionId = 0;
+    connection->publishing = false;
+
+    if (connection->modelEvents){
+        error = subscribe_model_changes(connection);
+        if (error) goto on_clear;
+        // Events of the outage are lost, check the whole cache
+        connection->modelChanges.all = true;
+    }
+
+    nodeIds = get_subscriptions(connection->subscriptions, &size);
+    if (!size) goto on_clear;
+    if (!nodeIds){
+        error = "out of memory";
+        goto on_clear;
+    }
+
+    // The registry is updated with the new monitored items
+    error = service_subscribe(connection, size, nodeIds, &results);
+    if (error) goto on_clear;
+
+    for (size_t i = 0; i < size; i++){
+        if (!results[i]) continue;
+        LOGERROR("unable to subscribe %s again: %s", lookup_nodeId2path_cache( connection->cache, nodeIds[i] ), results[i]);
+        remove_subscription( connection->subscriptions, nodeIds[i] );
+        release_value_cache( connection->cache, nodeIds[i] );
+    }
+
+on_clear:
+    if (nodeIds) free(nodeIds);
+    if (results) free(results);
+    return error;
+}
+
+static void reconnect(opcua_connection *connection){
+    UA_DateTime now = UA_DateTime_nowMonotonic();
+    if (now < connection->reconnectAt) return;
+
+    // The identity of the first connect is kept in the client config
+    LOGINFO("reconnect to %s", connection->url);
+    UA_StatusCode sc = UA_Client_connect(connection->client, connection->url);
+    if (sc != UA_STATUSCODE_GOOD){
+        connection->reconnectDelay = connection->reconnectDelay * 2 > RECONNECT_MAX_DELAY
+            ? RECONNECT_MAX_DELAY
+            : connection->reconnectDelay * 2;
+        connection->reconnectAt = UA_DateTime_nowMonotonic() + connection->reconnectDelay * UA_DATETIME_MSEC;
+        LOGDEBUG("unable to reconnect to %s: %s, next try in %d ms", connection->url, UA_StatusCode_name( sc ), connection->reconnectDelay);
+        return;
+    }
+
+    LOGINFO("reconnected to %s", connection->url);
+    connection->connected = true;
+
+    // The restarted server may have another address space
+    UA_DateTime startTime = connection->identity.startTime;
+    char *error = read_server_identity( connection->client, &connection->identity );
+    if (error) LOGERROR("unable to read the server identity: %s", error);
+    bool restarted = error || startTime != connection->identity.startTime;
+    if (restarted){
+        LOGINFO("the server is restarted, refresh the browse cache");
+        connection->modelChanges.all = true;
+    }
+
+    // The reactivated session keeps its registered nodes. Without
+    // a subscription to check the session is taken for a new one
+    bool renewed = restarted || !connection->subscriptionId;
+    error = restore_subscription(connection, &renewed);
+    if (error) LOGERROR("unable to restore the subscription: %s", error);
+    if (renewed) connection->epoch++;
+}
@@ -0,0 +1,291 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+#include <open62541/types_generated_handling.h>
+
+#include "opcua_client_packed.h"
+
+#define PACKED_STATUS 0
+#define PACKED_MAX_TYPE UA_TYPES_STRING
+
+//-----------------------------------------------------
+//  Pack
+//-----------------------------------------------------
+void init_packed(packed_buffer *buffer){
+    memset(buffer, 0, sizeof(packed_buffer));
+}
+
+void clear_packed(packed_buffer *buffer){
+    if (buffer->data) free(buffer->data);
+    init_packed(buffer);
+}
+
+static UA_Byte *reserve(packed_buffer *buffer, size_t length){
+    if (buffer->error) return NULL;
+
+    if (buffer->length + length > buffer->size){
+        size_t size = buffer->size ? buffer->size : 1024;
+        while (size < buffer->length + length) size *= 2;
+
+        UA_Byte *data = realloc(buffer->data, size);
+        if (!data){
+            buffer->error = "out of memory";
+            return NULL;
+        }
+        buffer->data = data;
+        buffer->size = size;
+    }
+
+    UA_Byte *position = buffer->data + buffer->length;
+    buffer->length += length;
+    return position;
+}
+
+static void put_uint(UA_Byte *position, uint64_t value, size_t length){
+    for (size_t i = length; i > 0; i--){
+        position[i - 1] = (UA_Byte)value;
+        value >>= 8;
+    }
+}
+
+// The string longer than the prefix allows is an error, the truncated
+// path would answer for another item
+static void pack_string(packed_buffer *buffer, const char *string, size_t length, size_t prefix){
+    if (length > (prefix == 2 ? UINT16_MAX : UINT32_MAX)){
+        if (!buffer->error) buffer->error = prefix == 2 ? "path too long" : "string too long";
+        return;
+    }
+
+    UA_Byte *position = reserve(buffer, prefix + length);
+    if (!position) return;
+
+    put_uint(position, length, prefix);
+    memcpy(position + prefix, string, length);
+}
+
+static void pack_tag(packed_buffer *buffer, const char *path, UA_Byte tag){
+    pack_string(buffer, path, strlen(path), 2);
+
+    UA_Byte *position = reserve(buffer, 1);
+    if (position) *position = tag;
+}
+
+void pack_status(packed_buffer *buffer, const char *path, const char *status){
+    pack_tag(buffer, path, PACKED_STATUS);
+    pack_string(buffer, status, strlen(status), 2);
+}
+
+// The tag of the supported scalar value, otherwise PACKED_STATUS
+static UA_Byte value_tag(const UA_DataValue *value){
+    const UA_DataType *type = value->value.type;
+    if (!type || !UA_Variant_isScalar( &value->value ) || type->typeIndex > PACKED_MAX_TYPE || type != &UA_TYPES[type->typeIndex]){
+        return PACKED_STATUS;
+    }
+    return (UA_Byte)(type->typeIndex + 1);
+}
+
+static void pack_scalar(packed_buffer *buffer, const UA_Variant *value){
+    const UA_DataType *type = value->type;
+    void *data = value->data;
+    if (type == &UA_TYPES[UA_TYPES_STRING]){
+        UA_String *string = (UA_String *)data;
+        pack_string(buffer, (char *)string->data, string->length, 4);
+        return;
+    }
+
+    // Numbers and booleans are copied in the big endian order
+    uint64_t bits = 0;
+    if (type->memSize == 1){
+        bits = *(uint8_t *)data;
+    }else if (type->memSize == 2){
+        bits = *(uint16_t *)data;
+    }else if (type->memSize == 4){
+        uint32_t v; memcpy(&v, data, 4); bits = v;
+    }else{
+        memcpy(&bits, data, 8);
+    }
+
+    UA_Byte *position = reserve(buffer, type->memSize);
+    if (position) put_uint(position, bits, type->memSize);
+}
+
+void pack_value(packed_buffer *buffer, const char *path, const UA_DataValue *value){
+    if (value->status != UA_STATUSCODE_GOOD){
+        pack_status(buffer, path, UA_StatusCode_name( value->status ));
+        return;
+    }
+
+    UA_Byte tag = value_tag( value );
+    if (tag == PACKED_STATUS){
+        pack_status(buffer, path, "invalid value");
+        return;
+    }
+
+    pack_tag(buffer, path, tag);
+    pack_scalar(buffer, &value->value);
+}
+
+void pack_columns(packed_buffer *buffer, size_t size, const UA_DataValue *values){
+    UA_Byte *position = reserve(buffer, 4 + size * 5);
+    if (!position) return;
+
+    put_uint(position, size, 4);
+    UA_Byte *statuses = position + 4;
+    UA_Byte *tags = statuses + size * 4;
+
+    for (size_t i = 0; i < size; i++){
+        UA_StatusCode status = values[i].status;
+        UA_Byte tag = status == UA_STATUSCODE_GOOD ? value_tag( &values[i] ) : PACKED_STATUS;
+        if (status == UA_STATUSCODE_GOOD && tag == PACKED_STATUS) status = UA_STATUSCODE_BADTYPEMISMATCH;
+
+        put_uint(statuses + i * 4, status, 4);
+        tags[i] = tag;
+    }
+
+    // The buffer could be moved by the values, keep the offset of the tags
+    size_t offset = tags - buffer->data;
+    for (size_t i = 0; i < size && !buffer->error; i++){
+        if (buffer->data[offset + i] == PACKED_STATUS) continue;
+        pack_scalar(buffer, &values[i].value);
+    }
+}
+
+cJSON *packed2json(packed_buffer *buffer, char **error){
+    cJSON *result = NULL;
+    UA_String base64 = UA_STRING_NULL;
+
+    if (buffer->error){
+        *error = buffer->error;
+        goto on_clear;
+    }
+
+    UA_ByteString data = { .length = buffer->length, .data = buffer->data };
+    UA_StatusCode sc = UA_ByteString_toBase64(&data, &base64);
+    if (sc != UA_STATUSCODE_GOOD){
+        *error = (char *)UA_StatusCode_name( sc );
+        goto on_clear;
+    }
+
+    // cJSON needs the null terminated string
+    char *string = malloc( base64.length + 1 );
+    if (!string){
+        *error = "out of memory";
+        goto on_clear;
+    }
+    memcpy(string, base64.data, base64.length);
+    string[base64.length] = '\0';
+
+    result = cJSON_CreateString( string );
+    free( string );
+    if (!result) *error = "unable to create response object";
+
+on_clear:
+    UA_String_clear( &base64 );
+    clear_packed( buffer );
+    return result;
+}
+
+//-----------------------------------------------------
+//  Unpack
+//-----------------------------------------------------
+static uint64_t get_uint(const UA_Byte *position, size_t length){
+    uint64_t value = 0;
+    for (size_t i = 0; i < length; i++) value = (value << 8) | position[i];
+    return value;
+}
+
+char *unpack_item(UA_ByteString *data, size_t *offset, char **path, UA_Variant **value){
+    char *error = NULL;
+    *path = NULL;
+    *value = NULL;
+
+    size_t left = data->length - *offset;
+    UA_Byte *position = data->data + *offset;
+
+    if (left < 2) return "invalid packed item";
+    size_t length = get_uint(position, 2);
+    if (left < 3 + length) return "invalid packed item";
+
+    *path = malloc( length + 1 );
+    if (!*path) return "out of memory";
+    memcpy(*path, position + 2, length);
+    (*path)[length] = '\0';
+
+    UA_Byte tag = position[2 + length];
+    position += 3 + length;
+    left -= 3 + length;
+
+    if (tag == PACKED_STATUS || tag - 1 > PACKED_MAX_TYPE){
+        error = "invalid packed type";
+        goto on_error;
+    }
+    const UA_DataType *type = &UA_TYPES[tag - 1];
+
+    *value = UA_Variant_new();
+    if (!*value){
+        error = "out of memory";
+        goto on_error;
+    }
+
+    UA_StatusCode sc;
+    size_t consumed;
+    if (type == &UA_TYPES[UA_TYPES_STRING]){
+        if (left < 4 || left - 4 < get_uint(position, 4)){
+            error = "invalid packed item";
+            goto on_error;
+        }
+        UA_String string = { .length = get_uint(position, 4), .data = position + 4 };
+        sc = UA_Variant_setScalarCopy(*value, &string, type);
+        consumed = 4 + string.length;
+    }else{
+        if (left < type->memSize){
+            error = "invalid packed item";
+            goto on_error;
+        }
+        uint64_t bits = get_uint(position, type->memSize);
+        // The scalar is kept in the host order
+        UA_Byte scalar[8];
+        if (type->memSize == 1){
+            scalar[0] = (UA_Byte)bits;
+        }else if (type->memSize == 2){
+            uint16_t v = (uint16_t)bits; memcpy(scalar, &v, 2);
+        }else if (type->memSize == 4){
+            uint32_t v = (uint32_t)bits; memcpy(scalar, &v, 4);
+        }else{
+            memcpy(scalar, &bits, 8);
+        }
+        sc = UA_Variant_setScalarCopy(*value, scalar, type);
+        consumed = type->memSize;
+    }
+    if (sc != UA_STATUSCODE_GOOD){
+        error = (char *)UA_StatusCode_name( sc );
+        goto on_error;
+    }
+
+    *offset += 3 + length + consumed;
+    return NULL;
+
+on_error:
+    free( *path );
+    *path = NULL;
+    if (*value) UA_Variant_delete( *value );
+    *value = NULL;
+    return error;
+}
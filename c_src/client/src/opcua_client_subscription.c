@@ -0,0 +1,234 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+#include <pthread.h>
+
+#include <uthash.h>
+#include <open62541/types_generated_handling.h>
+
+#include "opcua_client_subscription.h"
+//-----------------------------------------------------
+//  Monitored items registry
+//-----------------------------------------------------
+// Items are identified by the NodeId pointers owned by the browse cache
+typedef struct {
+  UA_NodeId *nodeId;
+  UA_UInt32 monitoredItemId;
+  UT_hash_handle hh;
+} subscription_entry;
+
+typedef struct notification_entry notification_entry;
+
+struct opcua_subscriptions{
+  // The registry is used by the update loop thread only
+  subscription_entry *registry;
+  notification_entry *notifications;
+  pthread_mutex_t lock;
+};
+
+opcua_subscriptions *new_subscriptions(){
+    opcua_subscriptions *subscriptions = calloc(1, sizeof(opcua_subscriptions));
+    if (!subscriptions) return NULL;
+
+    pthread_mutex_init(&subscriptions->lock, NULL);
+    return subscriptions;
+}
+
+void delete_subscriptions(opcua_subscriptions *subscriptions){
+    if (!subscriptions) return;
+
+    purge_subscriptions( subscriptions );
+    purge_notifications( subscriptions );
+    pthread_mutex_destroy(&subscriptions->lock);
+    free( subscriptions );
+}
+
+char *add_subscription(opcua_subscriptions *subscriptions, UA_NodeId *nodeId, UA_UInt32 monitoredItemId){
+
+    subscription_entry *entry = NULL;
+    HASH_FIND_PTR(subscriptions->registry, &nodeId, entry);
+    if (entry){
+        entry->monitoredItemId = monitoredItemId;
+        return NULL;
+    }
+
+    entry = (subscription_entry *)malloc( sizeof(subscription_entry) );
+    if (!entry) return "out of memory";
+
+    entry->nodeId = nodeId;
+    entry->monitoredItemId = monitoredItemId;
+
+    HASH_ADD_PTR(subscriptions->registry, nodeId, entry);
+
+    return NULL;
+}
+
+bool lookup_subscription(opcua_subscriptions *subscriptions, UA_NodeId *nodeId, UA_UInt32 *monitoredItemId){
+    subscription_entry *entry = NULL;
+    HASH_FIND_PTR(subscriptions->registry, &nodeId, entry);
+    if (!entry) return false;
+
+    *monitoredItemId = entry->monitoredItemId;
+    return true;
+}
+
+void remove_subscription(opcua_subscriptions *subscriptions, UA_NodeId *nodeId){
+    subscription_entry *entry = NULL;
+    HASH_FIND_PTR(subscriptions->registry, &nodeId, entry);
+    if (!entry) return;
+
+    HASH_DEL(subscriptions->registry, entry);
+    free( entry );
+}
+
+// The caller frees the array, NodeIds are owned by the cache
+UA_NodeId **get_subscriptions(opcua_subscriptions *subscriptions, size_t *size){
+    *size = HASH_CNT(hh, subscriptions->registry);
+    if (!*size) return NULL;
+
+    UA_NodeId **nodeIds = malloc( *size * sizeof(UA_NodeId *) );
+    if (!nodeIds){
+        *size = 0;
+        return NULL;
+    }
+
+    subscription_entry *entry; size_t i = 0;
+    for (entry = subscriptions->registry; entry != NULL; entry = entry->hh.next) {
+        nodeIds[i++] = entry->nodeId;
+    }
+    return nodeIds;
+}
+
+void purge_subscriptions(opcua_subscriptions *subscriptions){
+    subscription_entry *entry, *tmp;
+    HASH_ITER(hh, subscriptions->registry, entry, tmp) {
+        HASH_DEL(subscriptions->registry, entry);
+        free( entry );
+    }
+    subscriptions->registry = NULL;
+}
+
+//-----------------------------------------------------
+//  Notifications mailbox
+//-----------------------------------------------------
+// Notifications arrive from the update loop thread and are taken
+// by the eport thread, the mailbox keeps only the latest value per item
+struct notification_entry{
+  UA_NodeId *nodeId;
+  UA_DataValue value;
+  UT_hash_handle hh;
+};
+
+char *add_notification(opcua_subscriptions *subscriptions, UA_NodeId *nodeId, const UA_DataValue *value){
+    char *error = NULL;
+
+    pthread_mutex_lock(&subscriptions->lock);
+
+    notification_entry *entry = NULL;
+    HASH_FIND_PTR(subscriptions->notifications, &nodeId, entry);
+    if (entry){
+        // The previous value is not delivered yet, replace it
+        UA_DataValue_clear( &entry->value );
+    }else{
+        entry = (notification_entry *)malloc( sizeof(notification_entry) );
+        if (!entry){
+            error = "out of memory";
+            goto on_clear;
+        }
+        entry->nodeId = nodeId;
+        HASH_ADD_PTR(subscriptions->notifications, nodeId, entry);
+    }
+
+    UA_StatusCode sc = UA_DataValue_copy(value, &entry->value);
+    if (sc != UA_STATUSCODE_GOOD){
+        HASH_DEL(subscriptions->notifications, entry);
+        free( entry );
+        error = (char*)UA_StatusCode_name( sc );
+    }
+
+on_clear:
+    pthread_mutex_unlock(&subscriptions->lock);
+    return error;
+}
+
+opcua_notification *get_notifications(opcua_subscriptions *subscriptions, size_t *size){
+
+    // Take the whole mailbox at once to keep the lock short
+    pthread_mutex_lock(&subscriptions->lock);
+    notification_entry *mailbox = subscriptions->notifications;
+    subscriptions->notifications = NULL;
+    pthread_mutex_unlock(&subscriptions->lock);
+
+    *size = HASH_CNT(hh, mailbox);
+    if (!*size) return NULL;
+
+    opcua_notification *notifications = (opcua_notification *)malloc( sizeof(opcua_notification) * (*size) );
+
+    notification_entry *entry, *tmp; size_t i = 0;
+    HASH_ITER(hh, mailbox, entry, tmp) {
+        if (notifications){
+            notifications[i].nodeId = entry->nodeId;
+            // The value is moved, not copied
+            notifications[i].value = entry->value;
+            i++;
+        }else{
+            UA_DataValue_clear( &entry->value );
+        }
+        HASH_DEL(mailbox, entry);
+        free( entry );
+    }
+
+    if (!notifications) *size = 0;
+
+    return notifications;
+}
+
+void remove_notification(opcua_subscriptions *subscriptions, UA_NodeId *nodeId){
+    pthread_mutex_lock(&subscriptions->lock);
+
+    notification_entry *entry = NULL;
+    HASH_FIND_PTR(subscriptions->notifications, &nodeId, entry);
+    if (entry){
+        HASH_DEL(subscriptions->notifications, entry);
+        UA_DataValue_clear( &entry->value );
+        free( entry );
+    }
+
+    pthread_mutex_unlock(&subscriptions->lock);
+}
+
+void free_notifications(opcua_notification *notifications, size_t size){
+    if (!notifications) return;
+    for (size_t i = 0; i < size; i++){
+        UA_DataValue_clear( &notifications[i].value );
+    }
+    free( notifications );
+}
+
+void purge_notifications(opcua_subscriptions *subscriptions){
+    pthread_mutex_lock(&subscriptions->lock);
+
+    notification_entry *entry, *tmp;
+    HASH_ITER(hh, subscriptions->notifications, entry, tmp) {
+        HASH_DEL(subscriptions->notifications, entry);
+        UA_DataValue_clear( &entry->value );
+        free( entry );
+    }
+    subscriptions->notifications = NULL;
+
+    pthread_mutex_unlock(&subscriptions->lock);
+}
@@ -22,14 +22,35 @@
 #include <open62541/types.h>
 #include <eport_c.h>
 
+#include "utilities.h"
+#include "opcua_server_values.h"
+
 char* start(cJSON *args);
 void stop(void);
 bool is_started(void);
+// The typed variables are backed by the value table
+bool has_value_source(void);
 
-char *add_variable(UA_NodeId folder, char *name, UA_NodeId *outNodeId);
+// The nodes are added under the lock held by the caller, a batch takes it once
+void lock_server(void);
+void unlock_server(void);
+// The NULL type leaves the variable untyped. With the data_source backend
+// the typed variable gets the source, its value lives in the value table
+char *add_variable(UA_NodeId folder, char *name, const UA_DataType *type, UA_NodeId *outNodeId, server_value **source);
 char *add_folder(UA_NodeId folder, char *name, UA_NodeId *outNodeId);
 
-char *write_value(UA_NodeId *nodeId, char *type, cJSON *value);
+// The item of a batch write, the NULL type resets the value with a bad status.
+// The items that already have an error are skipped
+typedef struct {
+  UA_NodeId *nodeId;
+  // The value in the table if the variable has the source
+  server_value *source;
+  const UA_DataType *type;
+  ua_scalar value;
+  char *error;
+} server_write;
+
+void write_values(size_t size, server_write *items);
 char *read_value(UA_NodeId *nodeId, cJSON **value);
 
 #endif
\ No newline at end of file
@@ -21,8 +21,24 @@
 
 #include <open62541/types.h>
 
-char *create_node(char *path, UA_NodeId **nodeId);
-UA_NodeId *lookup_node(char *path);
+#include "opcua_server_values.h"
+
+// The NULL type creates an untyped variable. The source is set for the variables
+// backed by the value table, it is optional for the callers not writing values
+char *create_node(char *path, const UA_DataType *type, UA_NodeId **nodeId, server_value **source);
+UA_NodeId *lookup_node(char *path, server_value **source);
+
+// The node of a bulk definition, the items that already have an error are skipped
+typedef struct {
+  char *path;
+  // NULL for an untyped variable
+  const UA_DataType *type;
+  UA_NodeId *nodeId;
+  char *error;
+} server_node;
+
+// The whole tree is defined under one server lock, the existing nodes are kept
+void define_nodes(size_t size, server_node *nodes);
 void purge_nodes(void);
 
 #endif
\ No newline at end of file
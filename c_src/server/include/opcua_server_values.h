@@ -0,0 +1,61 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2021 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+
+#ifndef eopcua_server_values__h
+#define eopcua_server_values__h
+
+#include <stdatomic.h>
+#include <open62541/server.h>
+
+#include "utilities.h"
+
+// The string of a value is immutable, a write replaces it
+typedef struct server_text server_text;
+struct server_text{
+  server_text *next;
+  size_t length;
+  UA_Byte data[];
+};
+
+// The value of a variable kept outside of the node store,
+// the server reads it through the data source callbacks.
+// The value is a seqlock, it is written and read without the server lock
+typedef struct {
+  const UA_DataType *type;
+  _Atomic UA_UInt32 sequence;
+  ua_scalar value;
+  server_text *_Atomic text;
+  UA_StatusCode status;
+  UA_DateTime timestamp;
+} server_value;
+
+// The caller holds the server lock
+server_value *add_server_value(const UA_DataType *type);
+void purge_server_values(void);
+// Releases the replaced strings, the caller holds the server lock
+void release_server_values(void);
+
+UA_StatusCode set_server_value(server_value *value, const ua_scalar *scalar);
+void reset_server_value(server_value *value);
+// The caller holds the server lock for the strings to be alive
+UA_StatusCode get_server_value(server_value *value, UA_DataValue *dataValue, bool timestamp);
+
+// The callbacks of the variables backed by the table, the node context is the value
+UA_DataSource server_value_source(void);
+
+#endif
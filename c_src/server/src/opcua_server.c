@@ -45,7 +45,8 @@ static cJSON* opcua_server_start(cJSON* args, char **error){
     return cJSON_CreateString("ok");
 }
 
-static char *write_item(cJSON *item){
+// Prepares the item to write, the value is converted without allocations
+static char *prepare_write_item(cJSON *item, server_write *write){
     LOGTRACE("write item %s",item->string);
 
     if(!cJSON_IsObject(item)) return "invalid arguments";
@@ -56,15 +57,25 @@ static char *write_item(cJSON *item){
     cJSON *value = cJSON_GetObjectItemCaseSensitive(item, "value");
     if (value == NULL) return "value is not provided";
 
-    UA_NodeId *nodeId = lookup_node( item->string );
-    if (!nodeId){
+    if (cJSON_IsNull(value)){
+        write->type = NULL;
+    }else{
+        write->type = type2ua( type->valuestring );
+        if (!write->type) return "unsupported data type";
+
+        if (!json2scalar(write->type, value, &write->value)) return "invalid value";
+    }
+
+    write->nodeId = lookup_node( item->string, &write->source );
+    if (!write->nodeId){
         LOGINFO("create new node %s",item->string);
-        char *error = create_node( item->string, &nodeId );
+        // The table needs the type of the variable, the node store takes any
+        const UA_DataType *nodeType = has_value_source() ? write->type : NULL;
+        char *error = create_node( item->string, nodeType, &write->nodeId, &write->source );
         if (error) return error;
     }
 
-    // write the value
-    return write_value(nodeId, type->valuestring, value );
+    return NULL;
 }
 
 static cJSON* opcua_server_write_items(cJSON* args, char **error){
@@ -81,28 +92,101 @@ static cJSON* opcua_server_write_items(cJSON* args, char **error){
         return NULL;
     }
 
+    // All the values are converted first and then written in one batch
+    int size = cJSON_GetArraySize( args );
+    server_write *items = calloc( size + 1, sizeof(server_write) );
+    if (!items){
+        *error = "out of memory";
+        return NULL;
+    }
+
+    cJSON *item = NULL; int i = 0;
+    cJSON_ArrayForEach(item, args) {
+        items[i].error = prepare_write_item( item, &items[i] );
+        i++;
+    }
+
+    write_values( size, items );
+
     cJSON *response = cJSON_CreateObject();
 
-    cJSON *item = NULL; char *err = NULL;
+    i = 0;
     cJSON_ArrayForEach(item, args) {
-        err = write_item( item );
-        if (err){
-            cJSON_AddStringToObject( response, item->string, err );
+        cJSON_AddStringToObject( response, item->string, items[i].error ? items[i].error : "ok" );
+        i++;
+    }
+
+    free( items );
+
+    return response;
+}
+
+// Defines the tree of the nodes at once, the arguments are the paths
+// with their types or the list of the paths for untyped variables:
+//     {
+//         "folder1/tag1": "Double",
+//         "folder1/tag2": "Int32"
+//     }
+static cJSON* opcua_server_define_nodes(cJSON* args, char **error){
+    LOGTRACE("define nodes");
+
+    if (!is_started()){
+        *error = "server not started";
+        return NULL;
+    }
+
+    //-----------validate the arguments-----------------------
+    if ( !cJSON_IsObject(args) && !cJSON_IsArray(args) ) {
+        *error = "invalid define_nodes arguments";
+        return NULL;
+    }
+
+    int size = cJSON_GetArraySize( args );
+    server_node *nodes = calloc( size + 1, sizeof(server_node) );
+    if (!nodes){
+        *error = "out of memory";
+        return NULL;
+    }
+
+    cJSON *item = NULL; int i = 0;
+    cJSON_ArrayForEach(item, args) {
+        if (cJSON_IsArray(args)){
+            if (!cJSON_IsString(item) || (!item->valuestring)){
+                nodes[i].error = "invalid path";
+            }
+            nodes[i].path = item->valuestring;
         }else{
-            cJSON_AddStringToObject( response, item->string, "ok" );
+            nodes[i].path = item->string;
+            if (!cJSON_IsString(item) || (!item->valuestring)){
+                nodes[i].error = "type not provided";
+            }else if (!(nodes[i].type = type2ua( item->valuestring ))){
+                nodes[i].error = "unsupported data type";
+            }
         }
+        i++;
     }
 
+    define_nodes( size, nodes );
+
+    cJSON *response = cJSON_CreateObject();
+    for (i = 0; i < size; i++){
+        // The invalid items of the list have no path to report
+        if (!nodes[i].path) continue;
+        cJSON_AddStringToObject( response, nodes[i].path, nodes[i].error ? nodes[i].error : "ok" );
+    }
+
+    free( nodes );
+
     return response;
 }
 
 static char* read_item(char* item, cJSON **value){
     LOGTRACE("read item %s",item);
 
-    UA_NodeId *nodeId = lookup_node( item );
+    UA_NodeId *nodeId = lookup_node( item, NULL );
     if (!nodeId){
         LOGINFO("create new node %s",item);
-        char *error = create_node( item, &nodeId );
+        char *error = create_node( item, NULL, &nodeId, NULL );
         if (error) return error;
     }
 
@@ -154,6 +238,8 @@ static cJSON* on_request( char *method, cJSON *args, char **error ){
         response = opcua_server_write_items( args, error );
     }else if( strcmp(method, "read_items") == 0){
         response = opcua_server_read_items( args, error );
+    }else if( strcmp(method, "define_nodes") == 0){
+        response = opcua_server_define_nodes( args, error );
     }else{
         *error = "invalid method";
     }
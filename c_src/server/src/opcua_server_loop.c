@@ -17,25 +17,139 @@
 ----------------------------------------------------------------*/
 //----------------------------------------
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/queue.h>
 //----------------------------------------
 #include <open62541/server.h>
+#include <open62541/plugin/network.h>
 //----------------------------------------
 #include "opcua_server_config.h"
 #include "opcua_server_loop.h"
 #include "opcua_server_nodes.h"
+#include "opcua_server_values.h"
 #include "utilities.h"
 
 struct OPCUA_SERVER {
   UA_Server *server;
   pthread_mutex_t lock;
   UA_Boolean run;
+  // The typed variables keep their values in the value table, see opcua_server_values
+  UA_Boolean dataSource;
+  pthread_t thread;
+  UA_Boolean hasThread;
+  // The self pipe to wake up the server thread, it lives as long as
+  // the process not to signal a closed descriptor
+  int wakeup[2];
+  UA_Boolean hasWakeup;
+  // The descriptors the server thread waits for
+  struct pollfd *fds;
+  size_t fdsSize;
 } opcua_server;
 
+//---------------The server thread wakeup-------------------------------------
+// The server iterates without waiting under the lock and then waits for its
+// sockets and the wakeup pipe without the lock, so the lock is held only
+// while the server works. The writes wake the server thread up to publish
+// the fresh values at once
+static void wakeup_server(){
+    if (!opcua_server.hasWakeup) return;
+    char signal = 1;
+    // The full pipe already has the signal
+    if (write(opcua_server.wakeup[1], &signal, 1) < 0) LOGTRACE("the server is already signaled");
+}
+
+static void drain_wakeup(){
+    char buffer[64];
+    while (read(opcua_server.wakeup[0], buffer, sizeof(buffer)) > 0);
+}
+
+static char *init_wakeup(){
+    if (opcua_server.hasWakeup) return NULL;
+    if (pipe(opcua_server.wakeup)) return "unable to create the wakeup pipe";
+    fcntl(opcua_server.wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(opcua_server.wakeup[1], F_SETFL, O_NONBLOCK);
+    opcua_server.hasWakeup = true;
+    return NULL;
+}
+
+// The TCP network layer does not expose its sockets. The handle of the layer
+// is read by the layout of arch/network_tcp.c of the open62541 version built
+// by build_deps.sh, other versions are not waited for and the server thread
+// sleeps until the next timer as before
+static char *add_fd(size_t *size, int fd){
+    if (*size >= opcua_server.fdsSize){
+        size_t fdsSize = opcua_server.fdsSize ? opcua_server.fdsSize * 2 : 64;
+        struct pollfd *fds = realloc(opcua_server.fds, fdsSize * sizeof(struct pollfd));
+        if (!fds) return "out of memory";
+        opcua_server.fds = fds;
+        opcua_server.fdsSize = fdsSize;
+    }
+    opcua_server.fds[*size].fd = fd;
+    opcua_server.fds[*size].events = POLLIN;
+    opcua_server.fds[*size].revents = 0;
+    (*size)++;
+    return NULL;
+}
+
+#if UA_OPEN62541_VER_MAJOR == 1 && UA_OPEN62541_VER_MINOR == 3
+typedef struct TCPConnectionEntry {
+    UA_Connection connection;
+    LIST_ENTRY(TCPConnectionEntry) pointers;
+} TCPConnectionEntry;
+
+typedef struct {
+    const UA_Logger *logger;
+    UA_UInt16 port;
+    UA_UInt16 maxConnections;
+    // UA_SOCKET is int on POSIX
+    int serverSockets[FD_SETSIZE];
+    UA_UInt16 serverSocketsSize;
+    LIST_HEAD(, TCPConnectionEntry) connections;
+    UA_UInt16 connectionsSize;
+} TCPNetworkLayer;
+
+static bool is_tcp_layer(UA_ServerNetworkLayer *layer){
+    const char *prefix = "opc.tcp://";
+    size_t length = strlen(prefix);
+    return layer->handle && layer->discoveryUrl.length >= length
+        && memcmp(layer->discoveryUrl.data, prefix, length) == 0;
+}
+
+// The listening sockets and the connections
+static char *collect_network_fds(UA_ServerConfig *config, size_t *size){
+    char *error = NULL;
+    for (size_t i = 0; i < config->networkLayersSize; i++){
+        if (!is_tcp_layer(&config->networkLayers[i])) continue;
+        TCPNetworkLayer *layer = (TCPNetworkLayer *)config->networkLayers[i].handle;
+
+        for (UA_UInt16 j = 0; j < layer->serverSocketsSize; j++){
+            error = add_fd(size, layer->serverSockets[j]);
+            if (error) return error;
+        }
+        TCPConnectionEntry *entry;
+        LIST_FOREACH(entry, &layer->connections, pointers){
+            if (entry->connection.sockfd < 0) continue;
+            error = add_fd(size, entry->connection.sockfd);
+            if (error) return error;
+        }
+    }
+    return NULL;
+}
+#else
+static char *collect_network_fds(UA_ServerConfig *config, size_t *size){
+    return NULL;
+}
+#endif
+
 //---------------The server thread-------------------------------------------
 static void *server_thread(void *arg) {
     LOGINFO("starting the server thread");
 
-    UA_Boolean waitInternal = false;
+    UA_ServerConfig *config = UA_Server_getConfig( opcua_server.server );
 
     UA_StatusCode sc = UA_Server_run_startup( opcua_server.server );
     if(sc != UA_STATUSCODE_GOOD)
@@ -47,15 +161,29 @@ static void *server_thread(void *arg) {
         // get the lock
         pthread_mutex_lock(&opcua_server.lock);
 
-        UA_UInt16 timeout = UA_Server_run_iterate(opcua_server.server, waitInternal);
+        // The requests that came while waiting are handled, nothing is waited for
+        UA_UInt16 timeout = UA_Server_run_iterate(opcua_server.server, false);
+
+        // Nobody reads the value table now, the replaced strings can go
+        release_server_values();
+
+        // Only the iterate of this thread opens and closes the sockets
+        size_t size = 0;
+        char *error = add_fd(&size, opcua_server.wakeup[0]);
+        if (!error) error = collect_network_fds(config, &size);
 
         // release the lock
         pthread_mutex_unlock(&opcua_server.lock);
 
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = timeout * 1000;
-        select(0, NULL, NULL, NULL, &tv);
+        if (error){
+            LOGERROR("unable to wait for the server sockets: %s", error);
+            size = 0;
+        }
+
+        // Wait for the network, the wakeup or the next timer
+        if (poll(opcua_server.fds, size, timeout) > 0 && opcua_server.fds[0].revents){
+            drain_wakeup();
+        }
     }
     sc = UA_Server_run_shutdown( opcua_server.server );
 
@@ -64,6 +192,7 @@ on_clean:
     UA_Server_delete(opcua_server.server);
     opcua_server.server = NULL;
     opcua_server.run = false;
+    purge_server_values();
 
     pthread_mutex_destroy(&opcua_server.lock);
 
@@ -92,22 +221,29 @@ char* start(cJSON *args){
     error = configure(config, args);
     if (error) goto on_error;
 
-    // The server is going to run in a dedicated thread
-    pthread_t serverThread;
+    // "node" (default) keeps the values in the node store, "data_source" in the value table
+    cJSON *backend = cJSON_GetObjectItemCaseSensitive(args, "value_backend");
+    opcua_server.dataSource = cJSON_IsString(backend) && backend->valuestring
+        && strcmp(backend->valuestring, "data_source") == 0;
+
+    error = init_wakeup();
+    if (error) goto on_error;
 
+    // The server is going to run in a dedicated thread
     if (pthread_mutex_init(&opcua_server.lock, NULL)) {
         error = "mutex init has failed";
         goto on_error;
     }
 
     // Launch the server thread
-    int res = pthread_create( &serverThread, NULL, &server_thread, NULL);
+    int res = pthread_create( &opcua_server.thread, NULL, &server_thread, NULL);
 
     if (res !=0 ){
         error = "unable to launch the server thread";
         pthread_mutex_destroy(&opcua_server.lock);
         goto on_error;
     }
+    opcua_server.hasThread = true;
 
     // the server has started
     return NULL;
@@ -127,24 +263,71 @@ on_error:
 void stop(){
     purge_nodes();
     opcua_server.run = false;
+    // Do not wait for the next timer to exit
+    wakeup_server();
 }
 
 bool is_started(){
     return opcua_server.run;
 }
 
-char *add_variable(UA_NodeId folder, char *name, UA_NodeId *outNodeId){
-    
+bool has_value_source(){
+    return opcua_server.dataSource;
+}
+
+// open62541 is not thread safe, the server thread iterates under the lock
+void lock_server(){
+    pthread_mutex_lock(&opcua_server.lock);
+}
+
+void unlock_server(){
+    pthread_mutex_unlock(&opcua_server.lock);
+}
+
+char *add_variable(UA_NodeId folder, char *name, const UA_DataType *type, UA_NodeId *outNodeId, server_value **source){
+    UA_StatusCode sc;
+    *source = NULL;
+
     UA_VariableAttributes attr = UA_VariableAttributes_default;
     attr.accessLevel = UA_ACCESSLEVELMASK_READ | UA_ACCESSLEVELMASK_WRITE;
     attr.displayName = UA_LOCALIZEDTEXT_ALLOC("en-US", name);
-    //attr.dataType = type->typeId;
+
+    // The typed variable starts with the zero value of its type
+    ua_scalar zero;
+    if (type){
+        memset(&zero, 0, sizeof(zero));
+        attr.dataType = type->typeId;
+        attr.valueRank = UA_VALUERANK_SCALAR;
+    }
     UA_QualifiedName qname = UA_QUALIFIEDNAME_ALLOC(1, name);
 
-    // open62541 is not thread safe, we use mutex
-    pthread_mutex_lock(&opcua_server.lock); 
+    if (type && opcua_server.dataSource){
+        *source = add_server_value( type );
+        if (!*source) return "out of memory";
+
+        sc = UA_Server_addDataSourceVariableNode(
+            opcua_server.server,
+            UA_NODEID_NULL,
+            folder,
+            UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT),
+            qname,
+            UA_NODEID_NUMERIC(0, UA_NS0ID_BASEDATAVARIABLETYPE),
+            attr,
+            server_value_source(),
+            *source,
+            outNodeId
+        );
+        if (sc != UA_STATUSCODE_GOOD){
+            // The slot of the table is not reused, it is released with the table
+            *source = NULL;
+            return (char*)UA_StatusCode_name( sc );
+        }
+        return NULL;
+    }
 
-    UA_StatusCode sc = UA_Server_addVariableNode(
+    if (type) UA_Variant_setScalar(&attr.value, &zero, type);
+
+    sc = UA_Server_addVariableNode(
         opcua_server.server, 
         UA_NODEID_NULL, 
         folder, 
@@ -156,9 +339,6 @@ char *add_variable(UA_NodeId folder, char *name, UA_NodeId *outNodeId){
         outNodeId
     );
 
-    // release the lock
-    pthread_mutex_unlock(&opcua_server.lock);
-
     //TODO?
     //UA_QualifiedName_clear( &qname );
     
@@ -175,9 +355,6 @@ char *add_folder(UA_NodeId folder, char *name, UA_NodeId *outNodeId){
     attr.displayName = UA_LOCALIZEDTEXT_ALLOC("en-US", (char *)name);
     UA_QualifiedName qname = UA_QUALIFIEDNAME_ALLOC(1, (char *)name);
 
-    // open62541 is not thread safe, we use mutex
-    pthread_mutex_lock(&opcua_server.lock);
-
     UA_StatusCode sc = UA_Server_addObjectNode(
         opcua_server.server, 
         UA_NODEID_NULL,
@@ -190,52 +367,64 @@ char *add_folder(UA_NodeId folder, char *name, UA_NodeId *outNodeId){
         outNodeId
     );
 
-    // release the lock
-    pthread_mutex_unlock(&opcua_server.lock);
-
     if (sc != UA_STATUSCODE_GOOD) return (char*)UA_StatusCode_name( sc );
 
     return NULL;
 }
 
-char *write_value(UA_NodeId *nodeId, char *type, cJSON *value){
-    UA_StatusCode sc;
-
-    if (cJSON_IsNull(value)){
-
-        // NULL reset the value, bad status
-        UA_WriteValue wv;
-        UA_WriteValue_init(&wv);
-        wv.nodeId = *nodeId;
-        wv.attributeId = UA_ATTRIBUTEID_VALUE;
-        wv.value.status = UA_STATUSCODE_BADNOTCONNECTED;
-        wv.value.hasStatus = true;
-
-        pthread_mutex_lock(&opcua_server.lock);
-        sc = UA_Server_write(opcua_server.server, &wv);
-        pthread_mutex_unlock(&opcua_server.lock);
-
-        if (sc != UA_STATUSCODE_GOOD){
-            return (char*)UA_StatusCode_name( sc );
+void write_values(size_t size, server_write *items){
+
+    UA_WriteValue wv;
+    UA_WriteValue_init(&wv);
+    wv.attributeId = UA_ATTRIBUTEID_VALUE;
+
+    // The table values are just copied, they do not wait for the server thread
+    bool locked = false;
+    for (size_t i = 0; i < size; i++){
+        if (items[i].error) continue;
+
+        if (items[i].source){
+            if (!items[i].type){
+                reset_server_value( items[i].source );
+            }else if (items[i].type != items[i].source->type){
+                items[i].error = (char*)UA_StatusCode_name( UA_STATUSCODE_BADTYPEMISMATCH );
+            }else{
+                UA_StatusCode sc = set_server_value( items[i].source, &items[i].value );
+                if (sc != UA_STATUSCODE_GOOD) items[i].error = (char*)UA_StatusCode_name( sc );
+            }
+            continue;
         }
-    }else{
-        const UA_DataType *ua_type = type2ua( type );
-        if (!ua_type) return "unsupported data type";
 
-        UA_Variant *ua_value = json2ua(ua_type, value);
-        if (!ua_value) return "invalid value";
+        // The rest of the batch goes to the node store under one lock
+        if (!locked){
+            pthread_mutex_lock(&opcua_server.lock);
+            locked = true;
+        }
 
-        pthread_mutex_lock(&opcua_server.lock);
-        sc = UA_Server_writeValue(opcua_server.server, *nodeId, *ua_value);
-        pthread_mutex_unlock(&opcua_server.lock);
-        UA_Variant_delete(ua_value);
+        wv.nodeId = *items[i].nodeId;
+        if (items[i].type){
+            // The variant refers to the caller's storage, the server copies the value
+            UA_Variant_setScalar(&wv.value.value, &items[i].value, items[i].type);
+            wv.value.hasValue = true;
+            wv.value.hasStatus = false;
+        }else{
+            // NULL reset the value, bad status
+            UA_Variant_init(&wv.value.value);
+            wv.value.hasValue = false;
+            wv.value.status = UA_STATUSCODE_BADNOTCONNECTED;
+            wv.value.hasStatus = true;
+        }
 
+        UA_StatusCode sc = UA_Server_write(opcua_server.server, &wv);
         if (sc != UA_STATUSCODE_GOOD){
-            return (char*)UA_StatusCode_name( sc );
+            items[i].error = (char*)UA_StatusCode_name( sc );
         }
     }
 
-    return NULL;
+    if (locked) pthread_mutex_unlock(&opcua_server.lock);
+
+    // The subscriptions publish the new values without waiting for the next timer
+    wakeup_server();
 }
 
 char *read_value(UA_NodeId *nodeId, cJSON **value){
@@ -25,12 +25,14 @@
 typedef struct {
   char *path;
   UA_NodeId *nodeId;
+  // The value in the table for the variables with the source
+  server_value *source;
   UT_hash_handle hh;
 } path2nodeId_cache;
 
 path2nodeId_cache *__path2nodeId_cache = NULL;
 
-static char *add_node(char *path, UA_NodeId nodeId, UA_NodeId **outNodeId){
+static char *add_node(char *path, UA_NodeId nodeId, server_value *source, UA_NodeId **outNodeId){
     char *error = NULL;
 
     path2nodeId_cache *path2nodeId = NULL;
@@ -50,6 +52,7 @@ static char *add_node(char *path, UA_NodeId nodeId, UA_NodeId **outNodeId){
     }
     UA_NodeId_copy(&nodeId, path2nodeId->nodeId);
     path2nodeId->path = strdup(path);
+    path2nodeId->source = source;
 
     HASH_ADD_STR(__path2nodeId_cache, path, path2nodeId);
 
@@ -62,12 +65,13 @@ on_error:
   return error;
 }
 
-UA_NodeId *lookup_node(char *path){
+UA_NodeId *lookup_node(char *path, server_value **source){
     path2nodeId_cache *path2nodeId = NULL;
     HASH_FIND_STR(__path2nodeId_cache, path, path2nodeId);
     if (path2nodeId == NULL){
         return NULL;
     }else{
+       if (source) *source = path2nodeId->source;
        return path2nodeId->nodeId;
     }
 }
@@ -85,77 +89,139 @@ void purge_nodes(){
     }
 }
 
-static char *ensure_path(char **path, UA_NodeId folder, char* context, UA_NodeId **outNodeId){
-
-    char *name = *path;
-
-    int l = strlen(name);
-    if(context){
-        l += strlen(context) + 1;
-    }
-    char _path[l+1];
-    if(context){
-        sprintf(_path,"%s/%s",context,name);
-    }else{
-        sprintf(_path,"%s",name);
-    }
-
-    *outNodeId = lookup_node( _path );
-    if(!*outNodeId) {
-        UA_NodeId _outNodeId;
-        char *error = add_folder(folder, name, &_outNodeId);
-        if(error) return error;
-
-        error = add_node(_path, _outNodeId, outNodeId);
-        if(error) return error;
-    }
+//-----------------------------------------------------
+//  Node definition
+//-----------------------------------------------------
+// The folders of the previous defined path. Sorted paths share the most of
+// their folders with the previous one, the shared folders are not looked up again
+typedef struct {
+  const char *path;
+  // folders[i] is the folder of the path prefix that ends at ends[i]
+  UA_NodeId **folders;
+  size_t *ends;
+  size_t depth;
+  size_t capacity;
+} path_prefix;
+
+static void clear_prefix(path_prefix *prefix){
+    if (prefix->folders) free( prefix->folders );
+    if (prefix->ends) free( prefix->ends );
+}
 
-    if (*(path + 1)){
-        return ensure_path( path + 1, **outNodeId, _path, outNodeId);
+static char *push_prefix(path_prefix *prefix, UA_NodeId *folder, size_t end){
+    if (prefix->depth == prefix->capacity){
+        size_t capacity = prefix->capacity ? prefix->capacity * 2 : 16;
+        UA_NodeId **folders = realloc( prefix->folders, capacity * sizeof(UA_NodeId *) );
+        if (!folders) return "out of memory";
+        prefix->folders = folders;
+        size_t *ends = realloc( prefix->ends, capacity * sizeof(size_t) );
+        if (!ends) return "out of memory";
+        prefix->ends = ends;
+        prefix->capacity = capacity;
     }
-
+    prefix->folders[prefix->depth] = folder;
+    prefix->ends[prefix->depth++] = end;
     return NULL;
 }
 
-char *create_node(char *path, UA_NodeId **outNodeId){
+// The caller holds the server lock
+static char *define_node(char *path, const UA_DataType *type, path_prefix *prefix, UA_NodeId **outNodeId, server_value **source){
     char *error = NULL;
+    server_value *_source = NULL;
+
+    *outNodeId = lookup_node( path, source );
+    if (*outNodeId) return NULL;
 
-    char *name = NULL; 
-    char **tokens = NULL;
-
-    UA_NodeId *folder;
-    tokens = str_split( path, '/');
-    if (tokens){
-        // Extract the name from the path
-        int depth = 0; while (*(tokens + depth)) depth++;
-        name = *(tokens + depth -1);
-        *(tokens + depth -1) = NULL;
-
-        // Create a folder if not exists
-        error = ensure_path(tokens, UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER), NULL, &folder);
-        if (error) {
-            free( name );
-            goto on_clear;
+    // The folders shared with the previous path end before the first difference
+    size_t common = 0;
+    if (prefix->path){
+        while (path[common] && path[common] == prefix->path[common]) common++;
+    }
+    while (prefix->depth && prefix->ends[prefix->depth - 1] >= common) prefix->depth--;
+    prefix->path = path;
+
+    // The names and the prefixes are cut in the copy of the path
+    char *buffer = strdup( path );
+    if (!buffer) return "out of memory";
+
+    UA_NodeId root = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
+    UA_NodeId *folder = prefix->depth ? prefix->folders[prefix->depth - 1] : &root;
+    size_t start = prefix->depth ? prefix->ends[prefix->depth - 1] + 1 : 0;
+
+    for (size_t i = start; buffer[i]; i++){
+        if (buffer[i] != '/') continue;
+
+        buffer[i] = '\0';
+        UA_NodeId *next = lookup_node( buffer, NULL );
+        if (!next) {
+            UA_NodeId _outNodeId;
+            error = add_folder(*folder, buffer + start, &_outNodeId);
+            if (!error) error = add_node(buffer, _outNodeId, NULL, &next);
         }
-    }else{
-        name = strdup( path );
+        buffer[i] = '/';
+        if (!error) error = push_prefix(prefix, next, i);
+        if (error) goto on_clear;
+
+        folder = next;
+        start = i + 1;
     }
 
     UA_NodeId _outNodeId;
-    error = add_variable(*folder, name, &_outNodeId);
+    error = add_variable(*folder, buffer + start, type, &_outNodeId, &_source);
     if (error) goto on_clear;
 
-    error = add_node(path, _outNodeId, outNodeId);
+    error = add_node(path, _outNodeId, _source, outNodeId);
+    if (!error && source) *source = _source;
 
 on_clear:
-    if (name) free( name );
-    if (tokens) str_split_destroy( tokens );
+    // The chain of the folders is broken, the next path builds its own
+    if (error){
+        prefix->path = NULL;
+        prefix->depth = 0;
+    }
+    free( buffer );
     return error;
 }
 
+char *create_node(char *path, const UA_DataType *type, UA_NodeId **outNodeId, server_value **source){
+    path_prefix prefix = {0};
 
+    lock_server();
+    char *error = define_node(path, type, &prefix, outNodeId, source);
+    unlock_server();
+
+    clear_prefix( &prefix );
+    return error;
+}
 
+static int compare_nodes(const void *a, const void *b){
+    return strcmp( (*(server_node **)a)->path, (*(server_node **)b)->path );
+}
 
+void define_nodes(size_t size, server_node *nodes){
+    path_prefix prefix = {0};
 
+    // The sorted paths come grouped by their folders
+    server_node **sorted = malloc( size * sizeof(server_node *) + 1 );
+    if (!sorted){
+        for (size_t i = 0; i < size; i++){
+            if (!nodes[i].error) nodes[i].error = "out of memory";
+        }
+        return;
+    }
+    // The failed items may have no path, they are not sorted
+    size_t valid = 0;
+    for (size_t i = 0; i < size; i++){
+        if (!nodes[i].error) sorted[valid++] = &nodes[i];
+    }
+    qsort(sorted, valid, sizeof(server_node *), compare_nodes);
 
+    lock_server();
+    for (size_t i = 0; i < valid; i++){
+        sorted[i]->error = define_node(sorted[i]->path, sorted[i]->type, &prefix, &sorted[i]->nodeId, NULL);
+    }
+    unlock_server();
 
+    clear_prefix( &prefix );
+    free( sorted );
+}
@@ -0,0 +1,222 @@
+/*----------------------------------------------------------------
+* Copyright (c) 2022 Faceplate
+*
+* This file is provided to you under the Apache License,
+* Version 2.0 (the "License"); you may not use this file
+* except in compliance with the License.  You may obtain
+* a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+----------------------------------------------------------------*/
+#include <string.h>
+#include <sched.h>
+
+#include <open62541/server.h>
+
+#include "opcua_server_values.h"
+
+//-----------------------------------------------------
+//  The value table
+//-----------------------------------------------------
+// The values are allocated in blocks, a value never moves while
+// the server lives, the nodes refer to it by their context.
+// The blocks are added under the server lock, the values are not:
+// every value is a seqlock, the writers take its sequence odd for
+// the update and the readers copy the value until the sequence
+// is the same even number before and after the copy
+#define VALUES_BLOCK_SIZE 1024
+
+typedef struct values_block values_block;
+struct values_block{
+  server_value values[VALUES_BLOCK_SIZE];
+  size_t used;
+  values_block *next;
+};
+
+static values_block *__values = NULL;
+
+// The replaced strings, a reader may still copy them.
+// They are released under the server lock when no reader is running
+static server_text *_Atomic __retired = NULL;
+
+server_value *add_server_value(const UA_DataType *type){
+    if (!__values || __values->used == VALUES_BLOCK_SIZE){
+        values_block *block = calloc(1, sizeof(values_block));
+        if (!block) return NULL;
+        block->next = __values;
+        __values = block;
+    }
+
+    server_value *value = &__values->values[ __values->used++ ];
+    value->type = type;
+    atomic_init(&value->sequence, 0);
+    atomic_init(&value->text, NULL);
+    value->status = UA_STATUSCODE_GOOD;
+    value->timestamp = UA_DateTime_now();
+    return value;
+}
+
+static void retire_text(server_text *text){
+    if (!text) return;
+
+    text->next = atomic_load_explicit(&__retired, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&__retired, &text->next, text,
+        memory_order_release, memory_order_relaxed));
+}
+
+void release_server_values(){
+    server_text *text = atomic_exchange_explicit(&__retired, NULL, memory_order_acquire);
+    while (text){
+        server_text *next = text->next;
+        free( text );
+        text = next;
+    }
+}
+
+// Writers are the eport thread and the server thread for the OPC UA writes
+static void begin_write(server_value *value){
+    UA_UInt32 sequence = atomic_load_explicit(&value->sequence, memory_order_relaxed);
+    for (;;){
+        if (sequence & 1){
+            sched_yield();
+            sequence = atomic_load_explicit(&value->sequence, memory_order_relaxed);
+        }else if (atomic_compare_exchange_weak_explicit(&value->sequence, &sequence, sequence + 1,
+            memory_order_acquire, memory_order_relaxed)){
+            break;
+        }
+    }
+    atomic_thread_fence(memory_order_release);
+}
+
+static void end_write(server_value *value){
+    atomic_fetch_add_explicit(&value->sequence, 1, memory_order_release);
+}
+
+UA_StatusCode set_server_value(server_value *value, const ua_scalar *scalar){
+    server_text *text = NULL;
+
+    if (value->type == &UA_TYPES[UA_TYPES_STRING]){
+        // The string is never changed, the new one replaces it
+        text = malloc( sizeof(server_text) + scalar->string.length + 1 );
+        if (!text) return UA_STATUSCODE_BADOUTOFMEMORY;
+        text->length = scalar->string.length;
+        if (text->length) memcpy(text->data, scalar->string.data, text->length);
+    }
+
+    begin_write( value );
+    if (text){
+        text = atomic_exchange_explicit(&value->text, text, memory_order_relaxed);
+    }else{
+        memcpy(&value->value, scalar, value->type->memSize);
+    }
+    value->status = UA_STATUSCODE_GOOD;
+    value->timestamp = UA_DateTime_now();
+    end_write( value );
+
+    retire_text( text );
+    return UA_STATUSCODE_GOOD;
+}
+
+void reset_server_value(server_value *value){
+    begin_write( value );
+    value->status = UA_STATUSCODE_BADNOTCONNECTED;
+    value->timestamp = UA_DateTime_now();
+    end_write( value );
+}
+
+UA_StatusCode get_server_value(server_value *value, UA_DataValue *dataValue, bool timestamp){
+    ua_scalar scalar;
+    server_text *text;
+    UA_StatusCode status;
+    UA_DateTime time;
+    UA_UInt32 sequence;
+
+    do{
+        sequence = atomic_load_explicit(&value->sequence, memory_order_acquire);
+        if (sequence & 1) continue;
+
+        memcpy(&scalar, &value->value, sizeof(scalar));
+        text = atomic_load_explicit(&value->text, memory_order_relaxed);
+        status = value->status;
+        time = value->timestamp;
+
+        atomic_thread_fence(memory_order_acquire);
+    }while ((sequence & 1) || sequence != atomic_load_explicit(&value->sequence, memory_order_relaxed));
+
+    if (status == UA_STATUSCODE_GOOD){
+        if (value->type == &UA_TYPES[UA_TYPES_STRING]){
+            // The text is not released while the caller holds the server lock
+            scalar.string.length = text ? text->length : 0;
+            scalar.string.data = text ? text->data : NULL;
+        }
+        // The server owns the result, the only copy of the read
+        UA_StatusCode sc = UA_Variant_setScalarCopy(&dataValue->value, &scalar, value->type);
+        if (sc != UA_STATUSCODE_GOOD) return sc;
+        dataValue->hasValue = true;
+    }else{
+        dataValue->status = status;
+        dataValue->hasStatus = true;
+    }
+
+    if (timestamp){
+        dataValue->sourceTimestamp = time;
+        dataValue->hasSourceTimestamp = true;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+void purge_server_values(){
+    while (__values){
+        values_block *block = __values;
+        __values = block->next;
+        for (size_t i = 0; i < block->used; i++){
+            server_text *text = atomic_load(&block->values[i].text);
+            if (text) free( text );
+        }
+        free( block );
+    }
+    release_server_values();
+}
+
+//-----------------------------------------------------
+//  Data source callbacks
+//-----------------------------------------------------
+// The server thread calls them holding the server lock
+static UA_StatusCode read_value_source(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext,
+    const UA_NodeId *nodeId, void *nodeContext, UA_Boolean includeSourceTimeStamp,
+    const UA_NumericRange *range, UA_DataValue *dataValue){
+
+    if (range) return UA_STATUSCODE_BADINDEXRANGEINVALID;
+
+    return get_server_value((server_value *)nodeContext, dataValue, includeSourceTimeStamp);
+}
+
+static UA_StatusCode write_value_source(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext,
+    const UA_NodeId *nodeId, void *nodeContext, const UA_NumericRange *range, const UA_DataValue *dataValue){
+
+    server_value *value = (server_value *)nodeContext;
+    if (range) return UA_STATUSCODE_BADINDEXRANGEINVALID;
+
+    if (!dataValue->hasValue || UA_Variant_isEmpty(&dataValue->value)){
+        reset_server_value( value );
+        return UA_STATUSCODE_GOOD;
+    }
+
+    if (dataValue->value.type != value->type || !UA_Variant_isScalar(&dataValue->value)){
+        return UA_STATUSCODE_BADTYPEMISMATCH;
+    }
+
+    return set_server_value(value, (const ua_scalar *)dataValue->value.data);
+}
+
+UA_DataSource server_value_source(){
+    UA_DataSource source = { .read = read_value_source, .write = write_value_source };
+    return source;
+}
@@ -37,6 +37,25 @@ char* parse_certificate_uri(const UA_ByteString *certificate, char **error);
 cJSON* ua2json( const UA_DataType *type, void *value );
 UA_Variant *json2ua(const UA_DataType *type, cJSON *value);
 
+// The storage of a scalar value for json2scalar, no allocations are made.
+// A String refers to the cJSON string, it is valid while the cJSON lives
+typedef union {
+  UA_Boolean boolean;
+  UA_SByte sbyte;
+  UA_Byte byte;
+  UA_Int16 int16;
+  UA_UInt16 uint16;
+  UA_Int32 int32;
+  UA_UInt32 uint32;
+  UA_Int64 int64;
+  UA_UInt64 uint64;
+  UA_Float float_;
+  UA_Double double_;
+  UA_String string;
+} ua_scalar;
+
+bool json2scalar(const UA_DataType *type, cJSON *value, ua_scalar *scalar);
+
 const UA_DataType *type2ua(const char *type );
 
 #endif
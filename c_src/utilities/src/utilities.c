@@ -415,6 +415,40 @@ on_error:
     return NULL;
 }
 
+bool json2scalar(const UA_DataType *type, cJSON *value, ua_scalar *scalar){
+
+    bool isNumber = cJSON_IsBool(value) || cJSON_IsNumber(value);
+
+    if (type == &UA_TYPES[UA_TYPES_SBYTE] && isNumber){
+        scalar->sbyte = (UA_SByte)value->valuedouble;
+    }else if (type == &UA_TYPES[UA_TYPES_BYTE] && isNumber){
+        scalar->byte = (UA_Byte)value->valuedouble;
+    }else if (type == &UA_TYPES[UA_TYPES_INT16] && isNumber){
+        scalar->int16 = (UA_Int16)value->valuedouble;
+    }else if (type == &UA_TYPES[UA_TYPES_UINT16] && isNumber){
+        scalar->uint16 = (UA_UInt16)value->valuedouble;
+    }else if (type == &UA_TYPES[UA_TYPES_INT32] && isNumber){
+        scalar->int32 = (UA_Int32)value->valuedouble;
+    }else if (type == &UA_TYPES[UA_TYPES_UINT32] && isNumber){
+        scalar->uint32 = (UA_UInt32)value->valuedouble;
+    }else if (type == &UA_TYPES[UA_TYPES_INT64] && isNumber){
+        scalar->int64 = (UA_Int64)value->valuedouble;
+    }else if (type == &UA_TYPES[UA_TYPES_UINT64] && isNumber){
+        scalar->uint64 = (UA_UInt64)value->valuedouble;
+    }else if (type == &UA_TYPES[UA_TYPES_FLOAT] && isNumber){
+        scalar->float_ = (UA_Float)value->valuedouble;
+    }else if (type == &UA_TYPES[UA_TYPES_DOUBLE] && isNumber){
+        scalar->double_ = (UA_Double)value->valuedouble;
+    }else if(type == &UA_TYPES[UA_TYPES_BOOLEAN] && isNumber){
+        scalar->boolean = (value->valueint != 0);
+    } else if( type == &UA_TYPES[UA_TYPES_STRING] && cJSON_IsString(value) && value->valuestring != NULL){
+        scalar->string = UA_STRING((char *)value->valuestring);
+    }else{
+        return false;
+    }
+    return true;
+}
+
 const UA_DataType *type2ua(const char *type ){
 
     if( strcmp(type,"Boolean") == 0 ){
@@ -34,9 +34,22 @@
 -export([
     browse_servers/2,browse_servers/3,
     connect/2,connect/3,
+    disconnect/1,disconnect/2,
     read_items/2,read_items/3,
     write_items/2,write_items/3,
+    read_items_async/2,read_items_async/3,
+    write_items_async/2,write_items_async/3,
+    async_results/1,async_results/2,
     search/2,search/3,
+    subscribe/2,subscribe/3,
+    unsubscribe/2,unsubscribe/3,
+    notifications/1,notifications/2,
+    read_items_packed/2,read_items_packed/3,
+    write_items_packed/2,write_items_packed/3,
+    notifications_packed/1,notifications_packed/2,
+    register_items/2,register_items/3,
+    unregister_items/2,unregister_items/3,
+    read_item_set/2,read_item_set/3,
     create_certificate/1
 ]).
 
@@ -71,6 +84,9 @@ set_log_level(PID, Level)->
 %%==============================================================================
 %%	Protocol API
 %%==============================================================================
+% The port hosts many independent sessions. The session is addressed
+% by {PID, Connection} where Connection is an integer chosen by the caller,
+% PID alone stays for the session 0
 browse_servers(PID, Params)->
     browse_servers(PID, Params, undefined).
 browse_servers(PID, Params, Timeout)->
@@ -94,31 +110,154 @@ browse_servers(PID, Params, Timeout)->
 %         ----optional---------
 %         login => <<"user1">>,
 %         password => <<"secret">>,
-%         update_cycle => 100
+%         update_cycle => 100,        % the longest idle wait of the update loop, server data is handled as it comes
+%         max_nodes_per_browse => 1000, % by default is taken from the server OperationLimits
+%         max_browse_requests => 4,     % Browse requests in flight while building the cache
+%         max_references_per_node => 0, % 0 - defined by the server
+%         publishing_interval => 500,
+%         cache_dir => <<"/var/lib/eopcua">>, % the browse cache snapshot is kept here between connects
+%         resolve_paths => true, % unknown paths are translated within the request instead of the next cycle
+%         max_misses => 10000,   % the size of the negative cache for the paths the server does not know
+%         miss_ttl => 10000      % ms, such paths are not asked from the server again until then
 %     }
 connect(PID, Params)->
     connect(PID, Params,?CONNECT_TIMEOUT).
 connect(PID, Params, Timeout)->
-    case eport_c:request( PID, <<"connect">>, Params, Timeout ) of
+    case request( PID, <<"connect">>, Params, Timeout ) of
         {ok, <<"ok">>} -> ok;
         Error -> Error
     end.
 
+% Stops the session and releases its cache
+disconnect(PID)->
+    disconnect(PID, undefined).
+disconnect(PID, Timeout)->
+    case request( PID, <<"disconnect">>, null, Timeout ) of
+        {ok, <<"ok">>} -> ok;
+        Error -> Error
+    end.
+
+% Items is either a list of paths or a map:
+%   #{
+%       items => [<<"Simulation/Sinusoid">>],
+%       max_age => 1000     % in ms, values received later are taken from the cache
+%   }
 read_items(PID, Items)->
     read_items(PID, Items, undefined).
 read_items(PID, Items, Timeout)->
-    eport_c:request( PID, <<"read_items">>, Items, Timeout ).
+    request( PID, <<"read_items">>, Items, Timeout ).
 
 write_items(PID, Items)->
     write_items(PID, Items, undefined).
 write_items(PID, Items, Timeout)->
-    eport_c:request( PID, <<"write_items">>, Items, Timeout ).
+    request( PID, <<"write_items">>, Items, Timeout ).
+
+% The same as read_items and write_items but return the id of the request
+% without waiting for the server, many requests can be in flight at once
+read_items_async(PID, Items)->
+    read_items_async(PID, Items, undefined).
+read_items_async(PID, Items, Timeout)->
+    request( PID, <<"read_items_async">>, Items, Timeout ).
+
+write_items_async(PID, Items)->
+    write_items_async(PID, Items, undefined).
+write_items_async(PID, Items, Timeout)->
+    request( PID, <<"write_items_async">>, Items, Timeout ).
+
+% Returns the results of the finished asynchronous requests:
+%   #{ RequestId => Result } where Result is the read_items or write_items
+%   result or the error of the whole request
+async_results(PID)->
+    async_results(PID, undefined).
+async_results(PID, Timeout)->
+    case request( PID, <<"async_results">>, null, Timeout ) of
+        {ok, Results}->
+            {ok, maps:fold(fun(Id, Result, Acc)->
+                Acc#{ binary_to_integer(Id) => Result }
+            end, #{}, Results)};
+        Error->
+            Error
+    end.
 
 
+% Search is either a substring of the path or one of the modes:
+%   #{ prefix => Prefix } the items which paths start with Prefix
+%   #{ regex => Regex } POSIX extended regular expression
+%   #{ glob => Glob } shell wildcards, * and ? do not match the slash
 search(PID, Search)->
     search(PID, Search, undefined).
 search(PID, Search, Timeout)->
-    eport_c:request( PID, <<"search">>, Search, Timeout ).
+    request( PID, <<"search">>, Search, Timeout ).
+
+% Items is a list of paths to create monitored items for
+subscribe(PID, Items)->
+    subscribe(PID, Items, undefined).
+subscribe(PID, Items, Timeout)->
+    request( PID, <<"subscribe">>, Items, Timeout ).
+
+unsubscribe(PID, Items)->
+    unsubscribe(PID, Items, undefined).
+unsubscribe(PID, Items, Timeout)->
+    request( PID, <<"unsubscribe">>, Items, Timeout ).
+
+% Returns the values of the subscribed items changed since the previous call
+notifications(PID)->
+    notifications(PID, undefined).
+notifications(PID, Timeout)->
+    request( PID, <<"notifications">>, null, Timeout ).
+
+% The same as read_items, write_items and notifications but the items
+% go through the port as one packed binary instead of JSON, which is much
+% cheaper for the large amounts of items. The results have the same format
+read_items_packed(PID, Items)->
+    read_items_packed(PID, Items, undefined).
+read_items_packed(PID, Items, Timeout) when is_list(Items)->
+    read_items_packed(PID, #{ items => Items }, Timeout);
+read_items_packed(PID, Items, Timeout)->
+    unpack_response( request( PID, <<"read_items">>, Items#{ packed => true }, Timeout ) ).
+
+write_items_packed(PID, Items)->
+    write_items_packed(PID, Items, undefined).
+write_items_packed(PID, Items, Timeout)->
+    case try {ok, pack_items(Items)} catch _:Reason-> {error, Reason} end of
+        {ok, Packed}->
+            unpack_response( request( PID, <<"write_items">>, base64:encode(Packed), Timeout ) );
+        Error->
+            Error
+    end.
+
+notifications_packed(PID)->
+    notifications_packed(PID, undefined).
+notifications_packed(PID, Timeout)->
+    unpack_response( request( PID, <<"notifications">>, #{ packed => true }, Timeout ) ).
+
+% The item set is registered once and then read by its id. The values
+% come back as a list in the order of the registered paths, the failed
+% items are {error, StatusCode}
+register_items(PID, Paths)->
+    register_items(PID, Paths, undefined).
+register_items(PID, Paths, Timeout)->
+    request( PID, <<"register_items">>, Paths, Timeout ).
+
+unregister_items(PID, SetId)->
+    unregister_items(PID, SetId, undefined).
+unregister_items(PID, SetId, Timeout)->
+    request( PID, <<"unregister_items">>, SetId, Timeout ).
+
+read_item_set(PID, SetId)->
+    read_item_set(PID, SetId, undefined).
+read_item_set(PID, SetId, Timeout)->
+    case request( PID, <<"read_item_set">>, SetId, Timeout ) of
+        {ok, Packed}->
+            {ok, unpack_columns(base64:decode(Packed))};
+        Error->
+            Error
+    end.
+
+request({PID, Connection}, Method, Args, Timeout)->
+    eport_c:request( PID, Method, #{ connection => Connection, args => Args }, Timeout );
+request(PID, Method, Args, Timeout)->
+    eport_c:request( PID, Method, Args, Timeout ).
 
 create_certificate( Name )->
     Priv = code:priv_dir(eopcua),
@@ -146,6 +285,98 @@ create_certificate( Name )->
 
     Result.
 
+%%==============================================================================
+%%	Packed items
+%%==============================================================================
+% Every item is:
+%   <<PathLength:16, Path/binary, Tag:8, Value/binary>>
+% Tag is the type of the value, numbers are big endian, strings are prefixed
+% by their length:32. The tag 0 is followed by the status <<Length:16, Status/binary>>,
+% it is the error of the item or <<"ok">> for the written one
+-define(PACKED_TYPES,[
+    {1, <<"Boolean">>},
+    {2, <<"SByte">>},
+    {3, <<"Byte">>},
+    {4, <<"Int16">>},
+    {5, <<"UInt16">>},
+    {6, <<"Int32">>},
+    {7, <<"UInt32">>},
+    {8, <<"Int64">>},
+    {9, <<"UInt64">>},
+    {10, <<"Float">>},
+    {11, <<"Double">>},
+    {12, <<"String">>}
+]).
+
+pack_items(Items)->
+    << <<(pack_item(Path, Item))/binary>> || {Path, Item} <- maps:to_list(Items) >>.
+
+pack_item(Path, #{ type := Type, value := Value })->
+    pack_item(Path, Type, Value);
+pack_item(Path, #{ <<"type">> := Type, <<"value">> := Value })->
+    pack_item(Path, Type, Value).
+
+pack_item(Path, Type, Value) when is_atom(Type)->
+    pack_item(Path, atom_to_binary(Type, utf8), Value);
+pack_item(Path, Type, Value)->
+    {Tag, _} = lists:keyfind(Type, 2, ?PACKED_TYPES),
+    <<(byte_size(Path)):16, Path/binary, Tag, (pack_value(Tag, Value))/binary>>.
+
+pack_value(1, Value)-> <<(if Value =:= true; Value =:= 1 -> 1; true -> 0 end)>>;
+pack_value(2, Value)-> <<(trunc(Value)):8/signed>>;
+pack_value(3, Value)-> <<(trunc(Value)):8>>;
+pack_value(4, Value)-> <<(trunc(Value)):16/signed>>;
+pack_value(5, Value)-> <<(trunc(Value)):16>>;
+pack_value(6, Value)-> <<(trunc(Value)):32/signed>>;
+pack_value(7, Value)-> <<(trunc(Value)):32>>;
+pack_value(8, Value)-> <<(trunc(Value)):64/signed>>;
+pack_value(9, Value)-> <<(trunc(Value)):64>>;
+pack_value(10, Value)-> <<Value:32/float>>;
+pack_value(11, Value)-> <<Value:64/float>>;
+pack_value(12, Value)-> <<(byte_size(Value)):32, Value/binary>>.
+
+unpack_response({ok, Packed}) when is_binary(Packed)->
+    {ok, unpack_items(base64:decode(Packed), #{})};
+unpack_response(Error)->
+    Error.
+
+unpack_items(<<>>, Acc)->
+    Acc;
+unpack_items(<<Length:16, Path:Length/binary, 0, StatusLength:16, Status:StatusLength/binary, Rest/binary>>, Acc)->
+    unpack_items(Rest, Acc#{ Path => Status });
+unpack_items(<<Length:16, Path:Length/binary, Tag, Rest/binary>>, Acc)->
+    {_, Type} = lists:keyfind(Tag, 1, ?PACKED_TYPES),
+    {Value, Tail} = unpack_value(Tag, Rest),
+    unpack_items(Tail, Acc#{ Path => #{ <<"type">> => Type, <<"value">> => Value } }).
+
+unpack_value(1, <<Value:8, Rest/binary>>)-> {Value =/= 0, Rest};
+unpack_value(2, <<Value:8/signed, Rest/binary>>)-> {Value, Rest};
+unpack_value(3, <<Value:8, Rest/binary>>)-> {Value, Rest};
+unpack_value(4, <<Value:16/signed, Rest/binary>>)-> {Value, Rest};
+unpack_value(5, <<Value:16, Rest/binary>>)-> {Value, Rest};
+unpack_value(6, <<Value:32/signed, Rest/binary>>)-> {Value, Rest};
+unpack_value(7, <<Value:32, Rest/binary>>)-> {Value, Rest};
+unpack_value(8, <<Value:64/signed, Rest/binary>>)-> {Value, Rest};
+unpack_value(9, <<Value:64, Rest/binary>>)-> {Value, Rest};
+unpack_value(10, <<Value:32/float, Rest/binary>>)-> {Value, Rest};
+unpack_value(11, <<Value:64/float, Rest/binary>>)-> {Value, Rest};
+% NaN and infinity, JSON has null for them too
+unpack_value(10, <<_:32, Rest/binary>>)-> {null, Rest};
+unpack_value(11, <<_:64, Rest/binary>>)-> {null, Rest};
+unpack_value(12, <<Length:32, Value:Length/binary, Rest/binary>>)-> {Value, Rest}.
+
+unpack_columns(<<Count:32, Statuses:Count/binary-unit:32, Tags:Count/binary, Values/binary>>)->
+    unpack_columns([S || <<S:32>> <= Statuses], [T || <<T>> <= Tags], Values).
+
+unpack_columns([Status|Statuses], [0|Tags], Values)->
+    [{error, Status} | unpack_columns(Statuses, Tags, Values)];
+unpack_columns([_|Statuses], [Tag|Tags], Values)->
+    {_, Type} = lists:keyfind(Tag, 1, ?PACKED_TYPES),
+    {Value, Tail} = unpack_value(Tag, Values),
+    [#{ <<"type">> => Type, <<"value">> => Value } | unpack_columns(Statuses, Tags, Tail)];
+unpack_columns([], [], <<>>)->
+    [].
+
 replace_host(Endpoint, Host)->
     % Open62541 sometimes returns bad strings in ad[i].discoveryUrls[j].data
     % probably without the null at the end
@@ -35,6 +35,7 @@
     server_start/2,
     write_items/2, write_items/3,
     read_items/2, read_items/3,
+    define_nodes/2, define_nodes/3,
     create_certificate/1
 ]).
 
@@ -102,7 +103,12 @@ set_log_level(PID, Level)->
 %       maxSessionTimeout => ,
 %       maxNodesPerRead => ,
 %       maxNodesPerWrite =>
-%   }
+%   },
+%   % node (default) keeps the values in the server's node store,
+%   % data_source keeps the values of the typed variables in a value table
+%   % the server reads through callbacks, a write is just a copy into the table.
+%   % The variables created by write_items are typed with data_source
+%   value_backend => <<"data_source">>
 %}
 server_start(PID, Params)->
     case eport_c:request( PID, <<"server_start">>, Params ) of
@@ -131,6 +137,18 @@ read_items(PID, Items)->
 read_items(PID, Items, Timeout)->
     eport_c:request( PID, <<"read_items">>, Items, Timeout ).
 
+% Defines the whole tree of the variables at once, the folders are created
+% for the paths. Nodes is a map of the paths to the types:
+%   #{
+%       <<"TAGS/my_folder/temperature">> => <<"Double">>,
+%       <<"TAGS/my_folder/pressure">> => <<"UInt32">>
+%   }
+% or a list of the paths for untyped variables. The existing nodes are kept
+define_nodes(PID, Nodes)->
+    define_nodes(PID, Nodes, undefined).
+define_nodes(PID, Nodes, Timeout)->
+    eport_c:request( PID, <<"define_nodes">>, Nodes, Timeout ).
+
 create_certificate( Name )->
     Priv = code:priv_dir(eopcua),
     Key = Priv++"/eopcua.pem",